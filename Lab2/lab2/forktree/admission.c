@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/sysinfo.h>
+
+#include "admission.h"
+#include "futex.h"
+#include "proc-common.h"
+
+/* Rough memory cost of one more process of the tree, in KiB */
+#define ADMISSION_PROC_COST_KB 512
+
+/* Processes left for everything else the user runs */
+#define ADMISSION_SLACK 32
+
+/*
+ * Lives in shared memory, used by every process of the tree.
+ *
+ * Node i is forked by the process of node parent[i], or by the initial
+ * process, which counts as node `nodes'. A process waiting to fork a
+ * child sleeps on the futex word of its own node, which is bumped when
+ * its child is next in line and a slot frees up, or when one of its
+ * children is about to exit and should be reaped. So nobody polls.
+ */
+struct admission {
+	int enabled;
+	int limit;
+	unsigned nodes;
+	int next;	/* preorder index of the next node to admit */
+	int live;	/* admitted processes that have not been reaped yet */
+	unsigned *parent;
+	int *turn;	/* futex word per node */
+	int *exited;	/* children of the node that announced their exit */
+	int *acked;	/* and how many of them the node has reaped */
+};
+
+/* Number the nodes in preorder, noting the parent of each; returns the next */
+static unsigned
+number_nodes(struct tree_node *node, unsigned idx, unsigned parent,
+	unsigned *parents)
+{
+	unsigned i, next = idx + 1;
+
+	parents[idx] = parent;
+	for (i = 0; i < node->nr_children; i++)
+		next = number_nodes(node->children + i, next, idx, parents);
+
+	return next;
+}
+
+static unsigned
+tree_depth(struct tree_node *node)
+{
+	unsigned i, d, max = 0;
+
+	for (i = 0; i < node->nr_children; i++) {
+		d = tree_depth(node->children + i);
+		if (d > max)
+			max = d;
+	}
+
+	return max + 1;
+}
+
+static long
+read_proc_long(const char *path)
+{
+	FILE *fp;
+	long val = LONG_MAX;
+
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld", &val) != 1)
+			val = LONG_MAX;
+		fclose(fp);
+	}
+
+	return val;
+}
+
+/*
+ * How many more processes can we afford?
+ * RLIMIT_NPROC (not enforced for root), the kernel's thread and PID
+ * limits, all minus what already runs, and half the free memory.
+ */
+static long
+default_limit(void)
+{
+	struct rlimit rl;
+	struct sysinfo si;
+	long cap = LONG_MAX, lim, mem;
+
+	if (sysinfo(&si) < 0) {
+		perror("sysinfo");
+		exit(1);
+	}
+
+	if (getrlimit(RLIMIT_NPROC, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+	    getuid() != 0)
+		cap = rl.rlim_cur;
+	lim = read_proc_long("/proc/sys/kernel/threads-max");
+	if (lim < cap)
+		cap = lim;
+	lim = read_proc_long("/proc/sys/kernel/pid_max");
+	if (lim < cap)
+		cap = lim;
+	if (cap != LONG_MAX)
+		cap -= si.procs;
+
+	mem = (long)((unsigned long long)si.freeram * si.mem_unit / 2 / 1024 /
+		ADMISSION_PROC_COST_KB);
+	if (mem < cap)
+		cap = mem;
+
+	return cap - ADMISSION_SLACK;
+}
+
+struct admission *
+create_admission(struct tree_node *root, int max_live)
+{
+	struct admission *adm;
+	unsigned nodes, depth;
+	long limit;
+
+	nodes = tree_count_nodes(root);
+	depth = tree_depth(root);
+	limit = max_live > 0 ? max_live : default_limit();
+
+	if (limit >= nodes) {
+		adm = create_shared_memory_area(sizeof(*adm));
+		adm->enabled = 0;
+		return adm;
+	}
+
+	if (limit <= depth) {
+		fprintf(stderr, "%s: a tree of depth %u needs more than %u "
+			"live processes, only %ld allowed\n",
+			__func__, depth, depth, limit);
+		exit(1);
+	}
+
+	adm = create_shared_memory_area(sizeof(*adm));
+	adm->parent = create_shared_memory_area(nodes * sizeof(adm->parent[0]));
+	adm->turn = create_shared_memory_area((nodes + 1) * sizeof(int));
+	adm->exited = create_shared_memory_area((nodes + 1) * sizeof(int));
+	adm->acked = create_shared_memory_area((nodes + 1) * sizeof(int));
+	number_nodes(root, 0, nodes, adm->parent);
+	adm->enabled = 1;
+	adm->limit = limit;
+	adm->nodes = nodes;
+	adm->next = 0;
+	adm->live = 0;
+
+	return adm;
+}
+
+int
+admission_limit(struct admission *adm)
+{
+	return adm->enabled ? adm->limit : 0;
+}
+
+/* Wake up the process of node p, if it is waiting */
+static void
+wake_node(struct admission *adm, unsigned p)
+{
+	__atomic_add_fetch(&adm->turn[p], 1, __ATOMIC_RELEASE);
+	futex_wake(&adm->turn[p], 1);
+}
+
+/* Wake the parent of the next node in line, something has changed */
+static void
+kick(struct admission *adm)
+{
+	unsigned n = __atomic_load_n(&adm->next, __ATOMIC_ACQUIRE);
+
+	if (n < adm->nodes)
+		wake_node(adm, adm->parent[n]);
+}
+
+void
+admission_acquire(struct admission *adm, unsigned idx,
+	int (*reap)(void *, int), void *arg)
+{
+	unsigned p;
+	int seq, live, due;
+
+	if (!adm->enabled)
+		return;
+
+	p = adm->parent[idx];
+	for (;;) {
+		/* read the futex word first, so that no wakeup is lost */
+		seq = __atomic_load_n(&adm->turn[p], __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&adm->next, __ATOMIC_ACQUIRE) == idx) {
+			/* only we can admit node idx, but others release */
+			live = __atomic_load_n(&adm->live, __ATOMIC_RELAXED);
+			while (live < adm->limit)
+				if (__atomic_compare_exchange_n(&adm->live, &live,
+						live + 1, 0, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+					__atomic_store_n(&adm->next, idx + 1,
+						__ATOMIC_RELEASE);
+					kick(adm);
+					return;
+				}
+		}
+
+		/*
+		 * Our own finished children hold slots until reaped. Those
+		 * that announced their exit are gone or about to be, so
+		 * it is fine to block for them; then sleep until a kick.
+		 * Whatever else is reaped has announced its exit too, after
+		 * we looked: count it, or we would block for it next time.
+		 */
+		due = __atomic_load_n(&adm->exited[p], __ATOMIC_ACQUIRE) -
+			adm->acked[p];
+		if (reap)
+			adm->acked[p] += reap(arg, due);
+		futex_wait(&adm->turn[p], seq, NULL);
+	}
+}
+
+void
+admission_release(struct admission *adm)
+{
+	if (!adm->enabled)
+		return;
+
+	__atomic_sub_fetch(&adm->live, 1, __ATOMIC_RELEASE);
+	kick(adm);
+}
+
+void
+admission_exit(struct admission *adm, unsigned idx)
+{
+	unsigned p;
+
+	if (!adm->enabled)
+		return;
+
+	p = adm->parent[idx];
+	__atomic_add_fetch(&adm->exited[p], 1, __ATOMIC_RELEASE);
+	wake_node(adm, p);
+}
@@ -0,0 +1,50 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Admission control for forking very large process trees.
+ *
+ * The number of live processes of the tree is capped. Nodes are admitted
+ * in DFS (preorder) order: node i may only be forked after nodes 0..i-1,
+ * and only while fewer than the cap are alive. At any time the live
+ * processes are the ancestors of the next node plus nodes whose subtree
+ * has already been admitted and which will finish without forking again,
+ * so a cap larger than the depth of the tree never deadlocks. The tree is
+ * materialized in waves: leaves run while later subtrees are queued.
+ */
+
+struct admission;
+
+/*
+ * Set up admission control for a tree. max_live caps the number of live
+ * processes; 0 derives the cap from RLIMIT_NPROC, the number of processes
+ * in the system and the available memory. If the whole tree fits under
+ * the cap, admission is disabled and every call below is a no-op.
+ */
+struct admission *create_admission(struct tree_node *root, int max_live);
+
+/* The cap in use, or 0 if admission is disabled. */
+int admission_limit(struct admission *adm);
+
+/*
+ * Wait until node idx may be forked, and count it as live.
+ * While waiting, reap(arg, n) is called to reap finished children of
+ * the caller (it must call admission_release() for each of them): at
+ * least n of them, who called admission_exit() and may be waited for,
+ * and any others that are done already. It returns how many it reaped.
+ */
+void admission_acquire(struct admission *adm, unsigned idx,
+	int (*reap)(void *, int), void *arg);
+
+/* A process of the tree has been reaped. */
+void admission_release(struct admission *adm);
+
+/*
+ * The process of node idx is about to exit: wake its parent, to reap
+ * it. Call it last, right before exit(), so no parent waits for long.
+ */
+void admission_exit(struct admission *adm, unsigned idx);
+
+#endif /* ADMISSION_H */
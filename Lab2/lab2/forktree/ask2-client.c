@@ -0,0 +1,107 @@
+/*
+ * ask2-client.c
+ *
+ * Load generator for ask2-server: sends requests with fresh
+ * variable values one after the other and reports the request rate
+ * and the latency distribution of the replies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "eval-server.h"
+
+static double
+elapsed_us(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+static int
+cmp_double(const void *x, const void *y)
+{
+	double a = *(const double *)x, b = *(const double *)y;
+
+	return (a > b) - (a < b);
+}
+
+int main(int argc, char *argv[])
+{
+	int sd, i, res;
+	long n, count;
+	int nvars = 2;
+	double *lat, total;
+	struct sockaddr_un sa;
+	struct eval_request rq;
+	struct timespec start, t0, t1;
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s <socket_path> <count> [<nvars>]\n\n",
+			argv[0]);
+		exit(1);
+	}
+	count = atol(argv[2]);
+	if (argc == 4)
+		nvars = atoi(argv[3]);
+	if (count <= 0 || nvars < 0 || nvars > EVAL_MAX_VARS) {
+		fprintf(stderr, "bad count or nvars\n");
+		exit(1);
+	}
+
+	lat = malloc(count * sizeof(*lat));
+	if (lat == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", argv[1]);
+	if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	memset(&rq, 0, sizeof(rq));
+	rq.nvars = nvars;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < count; n++) {
+		for (i = 0; i < nvars; i++)
+			rq.vars[i] = n + i;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (insist_write(sd, &rq, sizeof(rq)) != sizeof(rq) ||
+		    insist_read(sd, &res, sizeof(res)) != sizeof(res)) {
+			fprintf(stderr, "Client: server went away\n");
+			exit(1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		lat[n] = elapsed_us(&t0, &t1);
+
+		if (n == 0)
+			printf("Client: first result = %d\n", res);
+	}
+	total = elapsed_us(&start, &t1);
+	close(sd);
+
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	printf("Client: %ld requests in %.3f s, %.0f requests/s\n",
+		count, total / 1e6, count / (total / 1e6));
+	printf("Client: latency us: min %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+		lat[0], lat[count / 2], lat[count * 99 / 100], lat[count - 1]);
+
+	free(lat);
+
+	return 0;
+}
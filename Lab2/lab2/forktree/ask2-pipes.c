@@ -4,26 +4,41 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "proc-common.h"
 #include "tree.h"
+#include "tree-stats.h"
 
 #define SLEEP_PROC_SEC 10
 #define SLEEP_TREE_SEC 3
 
-void fork_procs(struct tree_node *node, int pfd[]) {
+/*
+ * Benchmark mode (-b): no sleeping, no per-node chatter, no pstree.
+ * Only the time from forking the root to reading the result is printed.
+ */
+int bench = 0;
+
+/* One record per node, indexed in DFS order */
+struct node_stats *stats;
+
+void fork_procs(struct tree_node *node, unsigned idx, int pfd[]) {
   pid_t child;
   int status;
   int i;
+  unsigned c;
 
   change_pname(node->name);
-  printf("Proccess %s has PID = %ld\n", node->name, (long)getpid());
+  if (!bench)
+    printf("Proccess %s has PID = %ld\n", node->name, (long)getpid());
 
   if (node->nr_children == 0) {
-    printf("%s: Sleeping...\n", node->name);
-    sleep(SLEEP_PROC_SEC);
-    printf("%s: Done Sleeping...\n", node->name);
+    if (!bench) {
+      printf("%s: Sleeping...\n", node->name);
+      sleep(SLEEP_PROC_SEC);
+      printf("%s: Done Sleeping...\n", node->name);
+    }
 
     if (close(pfd[0]) < 0) {
       perror("closing pipe");
@@ -46,8 +61,11 @@ void fork_procs(struct tree_node *node, int pfd[]) {
     }
 
     for (i = 0; i < 2; ++i) {
-      fprintf(stderr, "Parent %s, PID = %ld: Creating child %s\n", node->name,
-              (long)getpid(), node->children[i].name);
+      if (!bench)
+        fprintf(stderr, "Parent %s, PID = %ld: Creating child %s\n",
+                node->name, (long)getpid(), node->children[i].name);
+      c = tree_stats_child(node, idx, i);
+      tree_stats_spawn(&stats[c]);
       child = fork();
       if (child < 0) {
         /* fork failed */
@@ -56,8 +74,9 @@ void fork_procs(struct tree_node *node, int pfd[]) {
       }
 
       if (child == 0) {
-        fork_procs(&node->children[i], newpipe);
+        fork_procs(&node->children[i], c, newpipe);
       }
+      stats[c].pid = child;
     }
 
     if (close(newpipe[1]) < 0) {
@@ -76,12 +95,14 @@ void fork_procs(struct tree_node *node, int pfd[]) {
     int res;
     if (!strcmp(node->name, "+")) {
       res = operators[0] + operators[1];
-      printf("Current operation is: %d + %d = %d\n", operators[0], operators[1],
-             res);
+      if (!bench)
+        printf("Current operation is: %d + %d = %d\n", operators[0],
+               operators[1], res);
     } else {
       res = operators[0] * operators[1];
-      printf("Current operation is: %d * %d = %d\n", operators[0], operators[1],
-             res);
+      if (!bench)
+        printf("Current operation is: %d * %d = %d\n", operators[0],
+               operators[1], res);
     }
 
     if (close(pfd[0]) < 0) {
@@ -95,12 +116,15 @@ void fork_procs(struct tree_node *node, int pfd[]) {
     }
 
     for (i = 0; i < 2; ++i) {
-      child = wait(&status);
-      explain_wait_status(child, status);
+      child = tree_stats_wait(stats, node, idx, -1, &status, 0);
+      if (!bench)
+        explain_wait_status(child, status);
     }
   }
-  printf("%s with PID = %ld is ready to terminate...\n%s: Exiting...\n",
-         node->name, (long)getpid(), node->name);
+  if (!bench)
+    printf("%s with PID = %ld is ready to terminate...\n%s: Exiting...\n",
+           node->name, (long)getpid(), node->name);
+  tree_stats_exit(&stats[idx]);
   exit(0);
 }
 
@@ -119,24 +143,40 @@ int main(int argc, char *argv[]) {
   pid_t pid;
   int status;
   int pfd[2];
+  int opt, json = 0;
   struct tree_node *root;
-
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <input_tree_file>\n\n", argv[0]);
+  struct timespec start, end;
+
+  while ((opt = getopt(argc, argv, "bj")) != -1) {
+    if (opt == 'b')
+      bench = 1;
+    else if (opt == 'j')
+      json = 1;
+    else
+      optind = argc + 1;
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-b] [-j] <input_tree_file>\n\n", argv[0]);
     exit(1);
   }
 
-  root = get_tree_from_file(argv[1]);
-  printf("Constructing the following process tree:\n");
-  print_tree(root);
+  root = get_tree_from_file(argv[optind]);
+  stats = create_tree_stats(root);
+  if (!bench) {
+    printf("Constructing the following process tree:\n");
+    print_tree(root);
 
-  printf("Parent: Creating pipe...\n");
+    printf("Parent: Creating pipe...\n");
+  }
   if (pipe(pfd) < 0) {
     perror("pipe");
     exit(1);
   }
 
-  printf("Parent: Creating child...\n");
+  if (!bench)
+    printf("Parent: Creating child...\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  tree_stats_spawn(&stats[0]);
   pid = fork();
   if (pid < 0) {
     /* fork failed */
@@ -144,28 +184,43 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
   if (pid == 0) {
-    fork_procs(root, pfd);
+    fork_procs(root, 0, pfd);
     exit(1);
   }
+  stats[0].pid = pid;
 
   /*
    * In parent process.
    */
-  sleep(SLEEP_TREE_SEC);
-  show_pstree(pid);
+  if (!bench) {
+    sleep(SLEEP_TREE_SEC);
+    show_pstree(pid);
+  }
 
   int res;
   if (read(pfd[0], &res, sizeof(res)) != sizeof(res)) {
     perror("read from pipe");
     exit(1);
   }
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
   /* Print the process tree root at pid */
 
-  pid = wait(&status);
+  pid = tree_stats_wait(stats, NULL, 0, pid, &status, 0);
+  if (bench) {
+    printf("pipes: %u nodes, result = %d, %.3f ms\n", tree_count_nodes(root),
+           res,
+           (end.tv_sec - start.tv_sec) * 1e3 +
+               (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+  }
   explain_wait_status(pid, status);
 
   printf("The final result is %d\n", res);
 
+  /* Where did the tree spend its time? */
+  printf("\nResource usage per node (self, subtree, fork-to-exit time):\n");
+  print_tree_stats(stdout, root, stats, json);
+
   return 0;
 }
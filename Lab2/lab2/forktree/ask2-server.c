@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "eval-server.h"
+#include "proc-common.h"
+#include "tree.h"
+
+/*
+ * Persistent version of ask2-pipes.
+ *
+ * The process tree is built once and every node stays alive, looping:
+ * receive a request from its parent, forward it to its children,
+ * combine their replies and send the result up. The initial process
+ * accepts clients on a UNIX socket and feeds their requests to the root,
+ * so the cost of parsing the tree and forking is paid once, not once
+ * per evaluation.
+ *
+ * Closing the request pipe of a node makes it close the request pipes of
+ * its children, reap them and exit, so the whole tree goes away when the
+ * server stops.
+ */
+
+volatile sig_atomic_t stop = 0;
+
+static void leaf_value(struct tree_node *node, struct eval_request *rq,
+                       int *val) {
+  int col;
+
+  if (node->name[0] != '$') {
+    *val = atoi(node->name);
+    return;
+  }
+
+  col = atoi(node->name + 1);
+  if (col < 1 || col > rq->nvars) {
+    fprintf(stderr, "%s: request has only %d variables\n", node->name,
+            rq->nvars);
+    *val = 0;
+    return;
+  }
+  *val = rq->vars[col - 1];
+}
+
+/* Never returns: every process of the tree exits at its end */
+void fork_procs(struct tree_node *node, int rfd, int wfd)
+    __attribute__((noreturn));
+
+void fork_procs(struct tree_node *node, int rfd, int wfd) {
+  pid_t child;
+  int status;
+  unsigned i, j;
+  int down[node->nr_children], up[node->nr_children];
+  int res, val;
+  struct eval_request rq;
+
+  change_pname(node->name);
+
+  if (node->nr_children != 0 && strcmp(node->name, "+") &&
+      strcmp(node->name, "*")) {
+    fprintf(stderr, "%s: unknown operator\n", node->name);
+    exit(1);
+  }
+
+  for (i = 0; i < node->nr_children; ++i) {
+    int cdown[2], cup[2];
+
+    if (pipe(cdown) < 0 || pipe(cup) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+
+    child = fork();
+    if (child < 0) {
+      /* fork failed */
+      perror("Error at children");
+      exit(1);
+    }
+
+    if (child == 0) {
+      /* Do not keep the pipes of older siblings open */
+      for (j = 0; j < i; j++) {
+        close(down[j]);
+        close(up[j]);
+      }
+      close(cdown[1]);
+      close(cup[0]);
+      fork_procs(&node->children[i], cdown[0], cup[1]);
+    }
+
+    close(cdown[0]);
+    close(cup[1]);
+    down[i] = cdown[1];
+    up[i] = cup[0];
+  }
+
+  /* Serve requests until the parent closes our request pipe */
+  while (insist_read(rfd, &rq, sizeof(rq)) == sizeof(rq)) {
+    if (node->nr_children == 0) {
+      leaf_value(node, &rq, &res);
+    } else {
+      /* Let all children work in parallel, then collect */
+      for (i = 0; i < node->nr_children; ++i)
+        if (insist_write(down[i], &rq, sizeof(rq)) != sizeof(rq)) {
+          perror("write request");
+          exit(1);
+        }
+
+      res = (node->name[0] == '+') ? 0 : 1;
+      for (i = 0; i < node->nr_children; ++i) {
+        if (insist_read(up[i], &val, sizeof(val)) != sizeof(val)) {
+          fprintf(stderr, "%s: child %u did not reply\n", node->name, i);
+          exit(1);
+        }
+        res = (node->name[0] == '+') ? res + val : res * val;
+      }
+    }
+
+    if (insist_write(wfd, &res, sizeof(res)) != sizeof(res)) {
+      perror("write reply");
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < node->nr_children; ++i) close(down[i]);
+  for (i = 0; i < node->nr_children; ++i) {
+    child = wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      explain_wait_status(child, status);
+  }
+
+  exit(0);
+}
+
+static void sigterm_handler(int signum) { stop = 1; }
+
+/*
+ * Read a whole request from the client, like insist_read(), but give
+ * up once a signal has asked us to stop: an idle client must not keep
+ * the server from shutting down.
+ */
+static ssize_t read_request(int sd, struct eval_request *rq) {
+  ssize_t ret;
+  size_t done = 0;
+
+  while (done < sizeof(*rq)) {
+    ret = read(sd, (char *)rq + done, sizeof(*rq) - done);
+    if (ret < 0 && errno == EINTR && !stop)
+      continue;
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      return done == 0 ? 0 : -1;
+    done += ret;
+  }
+
+  return done;
+}
+
+/* Serve one client connection, until it hangs up */
+static void serve_client(int sd, int down, int up) {
+  struct eval_request rq;
+  int res;
+  long served = 0;
+
+  while (!stop && read_request(sd, &rq) == sizeof(rq)) {
+    if (rq.nvars < 0 || rq.nvars > EVAL_MAX_VARS) {
+      fprintf(stderr, "Server: bad request, nvars = %d\n", rq.nvars);
+      break;
+    }
+    if (insist_write(down, &rq, sizeof(rq)) != sizeof(rq) ||
+        insist_read(up, &res, sizeof(res)) != sizeof(res)) {
+      fprintf(stderr, "Server: process tree is gone\n");
+      exit(1);
+    }
+    if (insist_write(sd, &res, sizeof(res)) != sizeof(res)) break;
+    served++;
+  }
+
+  printf("Server: client done, %ld requests served\n", served);
+}
+
+int main(int argc, char *argv[]) {
+  pid_t pid;
+  int status;
+  int down[2], up[2];
+  int lsd, sd;
+  struct tree_node *root;
+  struct sockaddr_un sa;
+  struct sigaction act;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <input_tree_file> <socket_path>\n\n", argv[0]);
+    exit(1);
+  }
+
+  root = get_tree_from_file(argv[1]);
+  printf("Constructing the following process tree:\n");
+  print_tree(root);
+
+  if (pipe(down) < 0 || pipe(up) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  /* Or every process of the tree writes out what is buffered again */
+  fflush(stdout);
+
+  pid = fork();
+  if (pid < 0) {
+    /* fork failed */
+    perror("main: fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    /*
+     * Ctrl-C reaches the whole process group: leave the tree alone, it
+     * goes away when the server closes the request pipe of the root.
+     */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    close(down[1]);
+    close(up[0]);
+    fork_procs(root, down[0], up[1]);
+    exit(1);
+  }
+  close(down[0]);
+  close(up[1]);
+
+  /*
+   * In parent process.
+   *
+   * No SA_RESTART, so that SIGINT/SIGTERM interrupt accept() and read().
+   * Ignore SIGPIPE, a client that goes away must not kill the server.
+   */
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = sigterm_handler;
+  sigemptyset(&act.sa_mask);
+  if (sigaction(SIGINT, &act, NULL) < 0 || sigaction(SIGTERM, &act, NULL) < 0) {
+    perror("sigaction");
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  lsd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lsd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", argv[2]);
+  unlink(sa.sun_path);
+  if (bind(lsd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  if (listen(lsd, 5) < 0) {
+    perror("listen");
+    exit(1);
+  }
+
+  show_pstree(pid);
+  printf("Server: listening on %s\n", sa.sun_path);
+  fflush(stdout);
+
+  while (!stop) {
+    sd = accept(lsd, NULL, NULL);
+    if (sd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      exit(1);
+    }
+    serve_client(sd, down[1], up[0]);
+    close(sd);
+  }
+
+  printf("Server: shutting down the process tree...\n");
+  close(lsd);
+  unlink(sa.sun_path);
+  close(down[1]);
+
+  pid = wait(&status);
+  explain_wait_status(pid, status);
+
+  return 0;
+}
@@ -0,0 +1,199 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futex.h"
+#include "proc-common.h"
+#include "tree.h"
+
+#define SLEEP_PROC_SEC 10
+#define SLEEP_TREE_SEC 3
+
+/*
+ * Same evaluator as ask2-pipes, but results travel through shared memory.
+ *
+ * Every node owns one slot, indexed by its position in a DFS (preorder)
+ * walk of the tree. A child stores its value in its own slot, then
+ * decrements the pending counter of its parent's slot; the child that
+ * brings the counter to zero wakes the parent with a futex. The parent
+ * only sleeps if its children are not done yet, so a value costs one
+ * store and, at most, one FUTEX_WAKE per node.
+ */
+struct result_slot {
+  int value;
+  int pending; /* children that have not stored their value yet */
+};
+
+struct result_slot *slots;
+
+/* Same as ask2-pipes: -b skips sleeps, output and pstree. */
+int bench = 0;
+
+static void wait_for_slot(struct result_slot *slot) {
+  int pending;
+
+  while ((pending = __atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE)) != 0)
+    futex_wait(&slot->pending, pending, NULL);
+}
+
+static void post_to_slot(struct result_slot *slot) {
+  if (__atomic_sub_fetch(&slot->pending, 1, __ATOMIC_RELEASE) == 0)
+    futex_wake(&slot->pending, 1);
+}
+
+/* Never returns: every process of the tree exits at its end */
+void fork_procs(struct tree_node *node, unsigned idx, unsigned parent)
+    __attribute__((noreturn));
+
+void fork_procs(struct tree_node *node, unsigned idx, unsigned parent) {
+  pid_t child;
+  int status;
+  int i;
+  int res;
+
+  change_pname(node->name);
+  if (!bench)
+    printf("Proccess %s has PID = %ld\n", node->name, (long)getpid());
+
+  if (node->nr_children == 0) {
+    if (!bench) {
+      printf("%s: Sleeping...\n", node->name);
+      sleep(SLEEP_PROC_SEC);
+      printf("%s: Done Sleeping...\n", node->name);
+    }
+
+    res = atoi(node->name);
+  } else {
+    int operators[2] = {0, 0};
+    unsigned child_idx[2];
+
+    slots[idx].pending = 2;
+    child_idx[0] = idx + 1;
+    child_idx[1] = child_idx[0] + tree_count_nodes(&node->children[0]);
+
+    for (i = 0; i < 2; ++i) {
+      if (!bench)
+        fprintf(stderr, "Parent %s, PID = %ld: Creating child %s\n",
+                node->name, (long)getpid(), node->children[i].name);
+      child = fork();
+      if (child < 0) {
+        /* fork failed */
+        perror("Error at children");
+        exit(1);
+      }
+
+      if (child == 0) {
+        fork_procs(&node->children[i], child_idx[i], idx);
+      }
+    }
+
+    wait_for_slot(&slots[idx]);
+    for (i = 0; i < 2; i++)
+      operators[i] = slots[child_idx[i]].value;
+
+    if (!strcmp(node->name, "+")) {
+      res = operators[0] + operators[1];
+      if (!bench)
+        printf("Current operation is: %d + %d = %d\n", operators[0],
+               operators[1], res);
+    } else {
+      res = operators[0] * operators[1];
+      if (!bench)
+        printf("Current operation is: %d * %d = %d\n", operators[0],
+               operators[1], res);
+    }
+  }
+
+  slots[idx].value = res;
+  post_to_slot(&slots[parent]);
+
+  for (i = 0; i < node->nr_children; ++i) {
+    child = wait(&status);
+    if (!bench)
+      explain_wait_status(child, status);
+  }
+
+  if (!bench)
+    printf("%s with PID = %ld is ready to terminate...\n%s: Exiting...\n",
+           node->name, (long)getpid(), node->name);
+  exit(0);
+}
+
+/*
+ * The initial process sets up one result slot per node, plus one for
+ * itself, forks the root of the process tree and sleeps on its own slot
+ * until the root has stored the final result.
+ */
+int main(int argc, char *argv[]) {
+  pid_t pid;
+  int status;
+  unsigned nodes;
+  struct tree_node *root;
+  struct timespec start, end;
+
+  if (argc == 3 && !strcmp(argv[1], "-b")) {
+    bench = 1;
+    argv++;
+    argc--;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s [-b] <input_tree_file>\n\n", argv[0]);
+    exit(1);
+  }
+
+  root = get_tree_from_file(argv[1]);
+  nodes = tree_count_nodes(root);
+  if (!bench) {
+    printf("Constructing the following process tree:\n");
+    print_tree(root);
+
+    printf("Parent: Creating %u result slots...\n", nodes);
+  }
+
+  /* slots[nodes] belongs to this process, it waits for the root */
+  slots = create_shared_memory_area((nodes + 1) * sizeof(*slots));
+  slots[nodes].pending = 1;
+
+  if (!bench)
+    printf("Parent: Creating child...\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid = fork();
+  if (pid < 0) {
+    /* fork failed */
+    perror("main: fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    fork_procs(root, 0, nodes);
+    exit(1);
+  }
+
+  /*
+   * In parent process.
+   */
+  if (!bench) {
+    sleep(SLEEP_TREE_SEC);
+    show_pstree(pid);
+  }
+
+  wait_for_slot(&slots[nodes]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pid = wait(&status);
+  if (bench) {
+    printf("shm:   %u nodes, result = %d, %.3f ms\n", nodes, slots[0].value,
+           (end.tv_sec - start.tv_sec) * 1e3 +
+               (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+  }
+  explain_wait_status(pid, status);
+
+  printf("The final result is %d\n", slots[0].value);
+
+  return 0;
+}
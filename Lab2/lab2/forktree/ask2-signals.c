@@ -2,19 +2,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include "tree.h"
+#include "tree-stats.h"
 #include "proc-common.h"
 
-void fork_procs(struct tree_node *root)
+/* One record per node, indexed in DFS order */
+struct node_stats *stats;
+
+void fork_procs(struct tree_node *root, unsigned idx)
 {
 	/*
 	 * Start
 	 */
 	int i;
+	unsigned c;
 	int status[root->nr_children];
 	pid_t child[root->nr_children];
 
@@ -34,6 +40,8 @@ void fork_procs(struct tree_node *root)
 		{
 			fprintf(stderr, "Parent %s, PID = %ld: Creating child %s\n", root->name, (long)getpid(), root->children[i].name);
 
+			c = tree_stats_child(root, idx, i);
+			tree_stats_spawn(&stats[c]);
 			child[i] = fork();
 			if (child[i] < 0)
 			{
@@ -44,9 +52,10 @@ void fork_procs(struct tree_node *root)
 
 			if (child[i] == 0)
 			{
-				fork_procs(&root->children[i]);
+				fork_procs(&root->children[i], c);
 				exit(1);
 			}
+			stats[c].pid = child[i];
 
 			wait_for_ready_children(1);
 		}
@@ -61,7 +70,7 @@ void fork_procs(struct tree_node *root)
 		for (i = 0; i < root->nr_children; ++i)
 		{
 			kill(child[i], SIGCONT);
-			waitpid(child[i], &status[i], 0);
+			tree_stats_wait(stats, root, idx, child[i], &status[i], 0);
 			explain_wait_status(child[i], status[i]);
 		}
 	}
@@ -69,6 +78,7 @@ void fork_procs(struct tree_node *root)
 	/*
 	 * Exit
 	 */
+	tree_stats_exit(&stats[idx]);
 	exit(0);
 }
 
@@ -89,18 +99,27 @@ int main(int argc, char *argv[])
 {
 	pid_t pid;
 	int status;
+	int json = 0;
 	struct tree_node *root;
 
+	if (argc > 2 && !strcmp(argv[1], "-j"))
+	{
+		json = 1;
+		argv++;
+		argc--;
+	}
 	if (argc < 2)
 	{
-		fprintf(stderr, "Usage: %s <tree_file>\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-j] <tree_file>\n", argv[0]);
 		exit(1);
 	}
 
 	/* Read tree into memory */
 	root = get_tree_from_file(argv[1]);
+	stats = create_tree_stats(root);
 
 	/* Fork root of process tree */
+	tree_stats_spawn(&stats[0]);
 	pid = fork();
 	if (pid < 0)
 	{
@@ -110,9 +129,10 @@ int main(int argc, char *argv[])
 	if (pid == 0)
 	{
 		/* Child */
-		fork_procs(root);
+		fork_procs(root, 0);
 		exit(1);
 	}
+	stats[0].pid = pid;
 
 	/*
 	 * Father
@@ -127,8 +147,12 @@ int main(int argc, char *argv[])
 	kill(pid, SIGCONT);
 
 	/* Wait for the root of the process tree to terminate */
-	wait(&status);
+	tree_stats_wait(stats, NULL, 0, pid, &status, 0);
 	explain_wait_status(pid, status);
 
+	/* Where did the tree spend its time? */
+	printf("\nResource usage per node (self, subtree, fork-to-exit time):\n");
+	print_tree_stats(stdout, root, stats, json);
+
 	return 0;
 }
@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proc-common.h"
+#include "tree.h"
+
+/*
+ * Streaming version of ask2-pipes.
+ *
+ * Instead of computing one scalar, the process tree stays alive while
+ * rows of an input file flow through it. A leaf named "$N" reads column N
+ * (counting from 1) of every row, any other leaf is a constant. Values
+ * travel up in batches of up to BATCH_SIZE rows; each operator node reads
+ * one batch from every child and combines them element by element, so the
+ * cost of the pipes and processes is paid once per batch, not once per row.
+ *
+ * A batch on the wire is an int count followed by count values;
+ * a count of zero marks the end of the stream.
+ */
+#define BATCH_SIZE 4096
+#define LINE_SIZE 1024
+
+struct batch {
+  int count;
+  int val[BATCH_SIZE];
+};
+
+const char *input_path;
+
+static void read_all(int fd, void *buf, size_t count) {
+  ssize_t ret;
+
+  while (count > 0) {
+    ret = read(fd, buf, count);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      perror("read batch");
+      exit(1);
+    }
+    if (ret == 0) {
+      fprintf(stderr, "read batch: unexpected EOF\n");
+      exit(1);
+    }
+    buf = (char *)buf + ret;
+    count -= ret;
+  }
+}
+
+static void write_all(int fd, const void *buf, size_t count) {
+  ssize_t ret;
+
+  while (count > 0) {
+    ret = write(fd, buf, count);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror("write batch");
+      exit(1);
+    }
+    buf = (const char *)buf + ret;
+    count -= ret;
+  }
+}
+
+static void send_batch(int fd, struct batch *b) {
+  write_all(fd, b, sizeof(b->count) + b->count * sizeof(b->val[0]));
+}
+
+static void recv_batch(int fd, struct batch *b) {
+  read_all(fd, &b->count, sizeof(b->count));
+  if (b->count < 0 || b->count > BATCH_SIZE) {
+    fprintf(stderr, "recv_batch: bad batch size %d\n", b->count);
+    exit(1);
+  }
+  read_all(fd, b->val, b->count * sizeof(b->val[0]));
+}
+
+/*
+ * Combine a batch into the accumulator. The loops have no branches and
+ * no aliasing, so the compiler turns them into SIMD code.
+ */
+static void apply_op(char op, int *restrict acc, const int *restrict in,
+                     int count) {
+  int k;
+
+  if (op == '+')
+    for (k = 0; k < count; k++) acc[k] += in[k];
+  else
+    for (k = 0; k < count; k++) acc[k] *= in[k];
+}
+
+/* Return field col (1-based) of a whitespace separated line */
+static int get_column(char *line, int col) {
+  char *tok, *save;
+  int i;
+
+  tok = strtok_r(line, " \t\n", &save);
+  for (i = 1; tok != NULL && i < col; i++) tok = strtok_r(NULL, " \t\n", &save);
+  if (tok == NULL) {
+    fprintf(stderr, "input has no column %d\n", col);
+    exit(1);
+  }
+
+  return atoi(tok);
+}
+
+static void leaf_stream(struct tree_node *node, int wfd) {
+  FILE *in;
+  char line[LINE_SIZE];
+  struct batch b;
+  int col = 0, constant = 0;
+
+  if (node->name[0] == '$') {
+    col = atoi(node->name + 1);
+    if (col < 1) {
+      fprintf(stderr, "%s: bad column name\n", node->name);
+      exit(1);
+    }
+  } else {
+    constant = atoi(node->name);
+  }
+
+  in = fopen(input_path, "r");
+  if (in == NULL) {
+    perror(input_path);
+    exit(1);
+  }
+
+  b.count = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    b.val[b.count++] = col ? get_column(line, col) : constant;
+    if (b.count == BATCH_SIZE) {
+      send_batch(wfd, &b);
+      b.count = 0;
+    }
+  }
+  if (b.count > 0) send_batch(wfd, &b);
+
+  /* End of stream */
+  b.count = 0;
+  send_batch(wfd, &b);
+  fclose(in);
+}
+
+static void operator_stream(struct tree_node *node, int rfd[], int wfd) {
+  struct batch acc, in;
+  unsigned i;
+  char op = node->name[0];
+
+  if (op != '+' && op != '*') {
+    fprintf(stderr, "%s: unknown operator\n", node->name);
+    exit(1);
+  }
+
+  for (;;) {
+    recv_batch(rfd[0], &acc);
+    for (i = 1; i < node->nr_children; i++) {
+      recv_batch(rfd[i], &in);
+      if (in.count != acc.count) {
+        fprintf(stderr, "%s: children sent batches of %d and %d rows\n",
+                node->name, acc.count, in.count);
+        exit(1);
+      }
+      apply_op(op, acc.val, in.val, acc.count);
+    }
+
+    send_batch(wfd, &acc);
+    if (acc.count == 0) break;
+  }
+}
+
+/* Never returns: every process of the tree exits at its end */
+void fork_procs(struct tree_node *node, int wfd)
+    __attribute__((noreturn));
+
+void fork_procs(struct tree_node *node, int wfd) {
+  pid_t child;
+  int status;
+  unsigned i, j;
+
+  change_pname(node->name);
+
+  if (node->nr_children == 0) {
+    leaf_stream(node, wfd);
+  } else {
+    int rfd[node->nr_children];
+    int pfd[2];
+
+    /* One pipe per child, so that batches of different children
+     * never interleave */
+    for (i = 0; i < node->nr_children; ++i) {
+      if (pipe(pfd) < 0) {
+        perror("pipe");
+        exit(1);
+      }
+
+      child = fork();
+      if (child < 0) {
+        /* fork failed */
+        perror("Error at children");
+        exit(1);
+      }
+
+      if (child == 0) {
+        /*
+         * Keep only our own write end: the pipes of older siblings and
+         * of our parent held open down here would keep a writer from
+         * ever seeing EPIPE, and pile up with the depth of the tree
+         */
+        for (j = 0; j < i; j++) close(rfd[j]);
+        close(wfd);
+        close(pfd[0]);
+        fork_procs(&node->children[i], pfd[1]);
+      }
+
+      close(pfd[1]);
+      rfd[i] = pfd[0];
+    }
+
+    operator_stream(node, rfd, wfd);
+
+    for (i = 0; i < node->nr_children; ++i) {
+      child = wait(&status);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        explain_wait_status(child, status);
+    }
+  }
+
+  exit(0);
+}
+
+/*
+ * Copy standard input to a temporary file, so that every leaf can
+ * read it from the start independently.
+ */
+static char *spool_stdin(void) {
+  static char path[] = "/tmp/ask2-stream-XXXXXX";
+  char buf[BUFSIZ];
+  ssize_t n;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) write_all(fd, buf, n);
+  if (n < 0) {
+    perror("read stdin");
+    exit(1);
+  }
+  close(fd);
+
+  return path;
+}
+
+/*
+ * The initial process forks the root of the process tree
+ * and prints every value that comes out of it, one per line.
+ */
+int main(int argc, char *argv[]) {
+  pid_t pid;
+  int status;
+  int pfd[2];
+  long rows = 0;
+  int k;
+  char *spool = NULL;
+  struct tree_node *root;
+  struct batch b;
+  struct timespec start, end;
+  double secs;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s <input_tree_file> [<input_file>|-]\n\n",
+            argv[0]);
+    exit(1);
+  }
+
+  root = get_tree_from_file(argv[1]);
+  if (argc == 3 && strcmp(argv[2], "-") != 0)
+    input_path = argv[2];
+  else
+    input_path = spool = spool_stdin();
+
+  if (pipe(pfd) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid = fork();
+  if (pid < 0) {
+    /* fork failed */
+    perror("main: fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(pfd[0]);
+    fork_procs(root, pfd[1]);
+    exit(1);
+  }
+  close(pfd[1]);
+
+  /*
+   * In parent process.
+   */
+  for (;;) {
+    recv_batch(pfd[0], &b);
+    if (b.count == 0) break;
+    for (k = 0; k < b.count; k++) printf("%d\n", b.val[k]);
+    rows += b.count;
+  }
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pid = wait(&status);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    explain_wait_status(pid, status);
+  if (spool != NULL) unlink(spool);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%ld rows through %u processes in %.3f s (%.0f rows/s)\n",
+          rows, tree_count_nodes(root), secs, secs > 0 ? rows / secs : 0.0);
+
+  return 0;
+}
@@ -2,20 +2,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include "proc-common.h"
 #include "tree.h"
+#include "tree-stats.h"
+#include "admission.h"
 
 #define SLEEP_PROC_SEC 10
 #define SLEEP_TREE_SEC 3
 
-void fork_procs(struct tree_node *node)
+/* One record per node, indexed in DFS order */
+struct node_stats *stats;
+
+/* Caps the live processes of the tree, see admission.h */
+struct admission *adm;
+
+/* Children of a node that have been forked but not reaped yet */
+struct live_children
+{
+    struct tree_node *node;
+    unsigned idx;
+    int live;
+};
+
+static int reap_child(struct live_children *lc, int options)
 {
     pid_t child;
     int status;
+
+    child = tree_stats_wait(stats, lc->node, lc->idx, -1, &status, options);
+    if (child == 0)
+        return 0;
+    explain_wait_status(child, status);
+    admission_release(adm);
+    lc->live--;
+    return 1;
+}
+
+/*
+ * Called while waiting for admission: reap the n children that are
+ * exiting, waiting for them if need be, and whichever others are done;
+ * return how many
+ */
+static int reap_finished(void *arg, int n)
+{
+    struct live_children *lc = arg;
+    int reaped = 0;
+
+    for (; n > 0 && lc->live > 0; n--)
+        reaped += reap_child(lc, 0);
+
+    while (lc->live > 0 && reap_child(lc, WNOHANG))
+        reaped++;
+
+    return reaped;
+}
+
+void fork_procs(struct tree_node *node, unsigned idx)
+{
+    pid_t child;
     int i;
+    unsigned c;
+    struct live_children lc = { node, idx, 0 };
 
     change_pname(node->name);
     printf("Proccess %s has PID = %ld and %d children\n", node->name, (long)getpid(), node->nr_children);
@@ -23,6 +74,9 @@ void fork_procs(struct tree_node *node)
     for (i = 0; i < node->nr_children; ++i)
     {
         fprintf(stderr, "Parent %s, PID = %ld: Creating child %s\n", node->name, (long)getpid(), node->children[i].name);
+        c = tree_stats_child(node, idx, i);
+        admission_acquire(adm, c, reap_finished, &lc);
+        tree_stats_spawn(&stats[c]);
         child = fork();
         if (child < 0)
         {
@@ -33,15 +87,14 @@ void fork_procs(struct tree_node *node)
 
         if (child == 0)
         {
-            fork_procs(&node->children[i]);
+            fork_procs(&node->children[i], c);
         }
+        stats[c].pid = child;
+        lc.live++;
     }
 
-    for (i = 0; i < node->nr_children; ++i)
-    {
-        child = wait(&status);
-        explain_wait_status(child, status);
-    }
+    while (lc.live > 0)
+        reap_child(&lc, 0);
 
     if (node->nr_children == 0)
     {
@@ -51,6 +104,8 @@ void fork_procs(struct tree_node *node)
     }
     printf("%s with PID = %ld is ready to terminate...\n%s: Exiting...\n", node->name, (long)getpid(), node->name);
 
+    tree_stats_exit(&stats[idx]);
+    admission_exit(adm, idx);
     exit(0);
 }
 
@@ -69,19 +124,45 @@ int main(int argc, char *argv[])
 {
     pid_t pid;
     int status;
+    int opt;
+    int json = 0, max_live = 0;
     struct tree_node *root;
 
-    if (argc != 2)
+    while ((opt = getopt(argc, argv, "jp:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <input_tree_file>\n\n", argv[0]);
+        switch (opt)
+        {
+        case 'j':
+            json = 1;
+            break;
+        case 'p':
+            max_live = atoi(optarg);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc != optind + 1 || max_live < 0)
+    {
+        fprintf(stderr, "Usage: %s [-j] [-p max_live] <input_tree_file>\n\n", argv[0]);
         exit(1);
     }
 
-    root = get_tree_from_file(argv[1]);
+    root = get_tree_from_file(argv[optind]);
     printf("Constructing the following process tree:\n");
     print_tree(root);
 
+    stats = create_tree_stats(root);
+    adm = create_admission(root, max_live);
+    if (admission_limit(adm) > 0)
+        printf("At most %d processes alive at a time, the tree is forked in waves\n", admission_limit(adm));
+
+    /* Flush, or the children inherit and repeat what is buffered */
+    fflush(stdout);
+
     /* Fork root of process tree */
+    admission_acquire(adm, 0, NULL, NULL);
+    tree_stats_spawn(&stats[0]);
     pid = fork();
     if (pid < 0)
     {
@@ -91,9 +172,10 @@ int main(int argc, char *argv[])
     if (pid == 0)
     {
         /* Child */
-        fork_procs(root);
+        fork_procs(root, 0);
         exit(1);
     }
+    stats[0].pid = pid;
 
     /* for ask2-{fork, tree} */
     sleep(SLEEP_TREE_SEC);
@@ -102,8 +184,13 @@ int main(int argc, char *argv[])
     show_pstree(pid);
 
     /* Wait for the root of the process tree to terminate */
-    pid = wait(&status);
+    pid = tree_stats_wait(stats, NULL, 0, pid, &status, 0);
     explain_wait_status(pid, status);
+    admission_release(adm);
+
+    /* Where did the tree spend its time? */
+    printf("\nResource usage per node (self, subtree, fork-to-exit time):\n");
+    print_tree_stats(stdout, root, stats, json);
 
     return 0;
 }
@@ -0,0 +1,19 @@
+#!/bin/bash
+#
+# bench-transport.sh
+#
+# Compare the pipe (ask2-pipes) and shared memory (ask2-shm) transports
+# of the expression evaluator, for trees of growing size.
+#
+# Usage: ./bench-transport.sh [number_of_nodes ...]
+#
+
+SIZES=${@:-7 63 1023 16383 100001}
+TREE=$(mktemp)
+trap 'rm -f $TREE' EXIT
+
+for n in $SIZES; do
+	./gen-tree $n > $TREE || exit 1
+	./ask2-pipes -b $TREE
+	./ask2-shm -b $TREE
+done
@@ -0,0 +1,66 @@
+#ifndef EVAL_SERVER_H
+#define EVAL_SERVER_H
+
+#include <errno.h>
+#include <unistd.h>
+
+/******************************************************************************
+ * Protocol shared by ask2-server, its process tree and ask2-client.
+ *
+ * A request carries fresh values for the variables of the expression;
+ * a leaf named $N takes vars[N - 1]. The reply is a single int.
+ * The same request travels down the process tree, one copy per child,
+ * and the results travel back up. Both fit in a single pipe write.
+ */
+
+#define EVAL_MAX_VARS 16
+
+struct eval_request {
+	int nvars;
+	int vars[EVAL_MAX_VARS];
+};
+
+/*
+ * Insist until count bytes have been read, or EOF.
+ * Returns count, 0 on EOF before any data, -1 on error or short read.
+ */
+static inline ssize_t
+insist_read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = read(fd, (char *)buf + done, count - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			return done == 0 ? 0 : -1;
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Insist until count bytes have been written */
+static inline ssize_t
+insist_write(int fd, const void *buf, size_t count)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = write(fd, (const char *)buf + done, count - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		done += ret;
+	}
+
+	return done;
+}
+
+#endif /* EVAL_SERVER_H */
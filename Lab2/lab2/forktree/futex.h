@@ -0,0 +1,31 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/******************************************************************************
+ * Thin wrappers around the futex() system call.
+ *
+ * The non-private operations are used on purpose: the futex words live in
+ * memory returned by create_shared_memory_area(), which is shared between
+ * processes after fork().
+ */
+
+/* Sleep while *uaddr == val, or until timeout (may be NULL) expires. */
+static inline int
+futex_wait(int *uaddr, int val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+/* Wake up to nr processes sleeping on uaddr. */
+static inline int
+futex_wake(int *uaddr, int nr)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE, nr, NULL, NULL, 0);
+}
+
+#endif /* FUTEX_H */
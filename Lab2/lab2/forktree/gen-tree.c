@@ -0,0 +1,59 @@
+/*
+ * gen-tree.c
+ *
+ * Print an expression tree file with a given number of nodes,
+ * in the format read by get_tree_from_file().
+ *
+ * Internal nodes are "+" with exactly two children and leaves are "1",
+ * so the tree evaluates to its number of leaves. The tree is as balanced
+ * as the node count allows, which keeps the process tree shallow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Split an odd node count into two odd subtree sizes */
+static void
+split(unsigned long n, unsigned long *left, unsigned long *right)
+{
+	*left = (n - 1) / 2;
+	if (*left % 2 == 0)
+		(*left)++;
+	*right = n - 1 - *left;
+}
+
+static void
+print_node(unsigned long n)
+{
+	unsigned long left, right;
+
+	if (n == 1) {
+		printf("1\n0\n\n");
+		return;
+	}
+
+	split(n, &left, &right);
+	printf("+\n2\n%s\n%s\n\n", left == 1 ? "1" : "+", right == 1 ? "1" : "+");
+	print_node(left);
+	print_node(right);
+}
+
+int main(int argc, char *argv[])
+{
+	long n;
+
+	if (argc != 2 || (n = atol(argv[1])) < 1) {
+		fprintf(stderr, "Usage: %s <number_of_nodes>\n\n", argv[0]);
+		exit(1);
+	}
+
+	/* Every internal node has two children, so the count must be odd */
+	if (n % 2 == 0)
+		n++;
+
+	printf("# generated by gen-tree: %ld nodes, evaluates to %ld\n\n",
+		n, (n + 1) / 2);
+	print_node(n);
+
+	return 0;
+}
@@ -0,0 +1,735 @@
+/*
+ * ipc-bench.c
+ *
+ * pipe-example.c, grown into a benchmark: a parent and a forked child
+ * exchange messages over each of a number of transports, and the
+ * parent reports
+ *
+ *   - ping-pong round-trip latency (p50, p99, p999): the parent sends a
+ *     message, the child sends one of the same size back;
+ *   - one-way streaming throughput: the parent sends messages back to
+ *     back and the child acknowledges the last one.
+ *
+ * Transports:
+ *   pipe      two pipes, one per direction
+ *   socket    a UNIX stream socketpair
+ *   sysvmsg   two System V message queues
+ *   posixmq   two POSIX message queues
+ *   eventfd   a shared memory slot per direction, eventfd notification
+ *   futex     a shared memory slot per direction, futex notification
+ *   signal    a shared memory slot per direction, SIGUSR1/SIGUSR2
+ *
+ * Message queues carry at most msgmax (SysV) or msgsize_max (POSIX)
+ * bytes per message; larger messages are sent in chunks of that size.
+ *
+ * Each run is repeated with both processes pinned to the same CPU and
+ * to two different CPUs; the latter needs a machine with more than one.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "futex.h"
+#include "proc-common.h"
+
+#define MAX_SIZES      32
+#define STREAM_BYTES   (64L << 20)
+#define PINGPONG_BYTES (256L << 20)
+
+/*
+ * One bidirectional channel. Direction 0 is parent to child,
+ * direction 1 is child to parent.
+ */
+struct chan {
+	size_t size;
+	size_t chunk;        /* largest single message, for queues */
+	pid_t peer;
+	int fd[2][2];        /* pipe: [dir][end]; socket: fd[0][end] */
+	int msqid[2];
+	mqd_t mq[2];
+	int efd_full[2], efd_empty[2];
+	struct slot *slot[2];
+	void *msgbuf;
+};
+
+/* A one-message mailbox in shared memory */
+struct slot {
+	int full;            /* futex word for the futex transport */
+	int pad[15];
+	unsigned char data[];
+};
+
+struct transport {
+	const char *name;
+	void (*setup)(struct chan *c);
+	void (*send)(struct chan *c, int dir, const void *buf);
+	void (*recv)(struct chan *c, int dir, void *buf);
+	void (*teardown)(struct chan *c);
+};
+
+static void
+die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static long
+read_proc_long(const char *path, long def)
+{
+	FILE *fp;
+	long val;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return def;
+	if (fscanf(fp, "%ld", &val) != 1)
+		val = def;
+	fclose(fp);
+
+	return val;
+}
+
+static void
+write_all(int fd, const void *buf, size_t n)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = write(fd, buf, n);
+		if (ret < 0)
+			die("write");
+		buf = (const char *)buf + ret;
+		n -= ret;
+	}
+}
+
+static void
+read_all(int fd, void *buf, size_t n)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = read(fd, buf, n);
+		if (ret <= 0)
+			die("read");
+		buf = (char *)buf + ret;
+		n -= ret;
+	}
+}
+
+/******************************************************************************
+ * pipe, socketpair
+ */
+
+static void
+pipe_setup(struct chan *c)
+{
+	if (pipe(c->fd[0]) < 0 || pipe(c->fd[1]) < 0)
+		die("pipe");
+}
+
+static void
+pipe_send(struct chan *c, int dir, const void *buf)
+{
+	write_all(c->fd[dir][1], buf, c->size);
+}
+
+static void
+pipe_recv(struct chan *c, int dir, void *buf)
+{
+	read_all(c->fd[dir][0], buf, c->size);
+}
+
+static void
+pipe_teardown(struct chan *c)
+{
+	close(c->fd[0][0]);
+	close(c->fd[0][1]);
+	close(c->fd[1][0]);
+	close(c->fd[1][1]);
+}
+
+static void
+socket_setup(struct chan *c)
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, c->fd[0]) < 0)
+		die("socketpair");
+}
+
+/* The parent uses end 0 and the child end 1, in both directions */
+static void
+socket_send(struct chan *c, int dir, const void *buf)
+{
+	write_all(c->fd[0][dir], buf, c->size);
+}
+
+static void
+socket_recv(struct chan *c, int dir, void *buf)
+{
+	read_all(c->fd[0][!dir], buf, c->size);
+}
+
+static void
+socket_teardown(struct chan *c)
+{
+	close(c->fd[0][0]);
+	close(c->fd[0][1]);
+}
+
+/******************************************************************************
+ * System V and POSIX message queues
+ */
+
+static void
+sysvmsg_setup(struct chan *c)
+{
+	int dir;
+
+	c->chunk = read_proc_long("/proc/sys/kernel/msgmax", 8192);
+	if (c->chunk > c->size)
+		c->chunk = c->size;
+	c->msgbuf = malloc(sizeof(long) + c->chunk);
+	if (c->msgbuf == NULL)
+		die("malloc");
+	for (dir = 0; dir < 2; dir++) {
+		c->msqid[dir] = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+		if (c->msqid[dir] < 0)
+			die("msgget");
+	}
+}
+
+static void
+sysvmsg_send(struct chan *c, int dir, const void *buf)
+{
+	size_t off, n;
+
+	*(long *)c->msgbuf = 1;
+	for (off = 0; off < c->size; off += n) {
+		n = c->size - off < c->chunk ? c->size - off : c->chunk;
+		memcpy((char *)c->msgbuf + sizeof(long),
+			(const char *)buf + off, n);
+		if (msgsnd(c->msqid[dir], c->msgbuf, n, 0) < 0)
+			die("msgsnd");
+	}
+}
+
+static void
+sysvmsg_recv(struct chan *c, int dir, void *buf)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < c->size; off += n) {
+		n = msgrcv(c->msqid[dir], c->msgbuf, c->chunk, 0, 0);
+		if (n < 0)
+			die("msgrcv");
+		memcpy((char *)buf + off, (char *)c->msgbuf + sizeof(long), n);
+	}
+}
+
+static void
+sysvmsg_teardown(struct chan *c)
+{
+	msgctl(c->msqid[0], IPC_RMID, NULL);
+	msgctl(c->msqid[1], IPC_RMID, NULL);
+	free(c->msgbuf);
+}
+
+static void
+posixmq_setup(struct chan *c)
+{
+	struct mq_attr attr;
+	char name[64];
+	int dir;
+
+	c->chunk = read_proc_long("/proc/sys/fs/mqueue/msgsize_max", 8192);
+	if (c->chunk > c->size)
+		c->chunk = c->size;
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = read_proc_long("/proc/sys/fs/mqueue/msg_max", 10);
+	attr.mq_msgsize = c->chunk;
+
+	/* Unlink right away, the descriptors are inherited by the child */
+	for (dir = 0; dir < 2; dir++) {
+		snprintf(name, sizeof(name), "/ipc-bench-%ld-%d",
+			(long)getpid(), dir);
+		c->mq[dir] = mq_open(name, O_RDWR | O_CREAT | O_EXCL, 0600,
+			&attr);
+		if (c->mq[dir] == (mqd_t)-1)
+			die("mq_open");
+		mq_unlink(name);
+	}
+}
+
+static void
+posixmq_send(struct chan *c, int dir, const void *buf)
+{
+	size_t off, n;
+
+	for (off = 0; off < c->size; off += n) {
+		n = c->size - off < c->chunk ? c->size - off : c->chunk;
+		if (mq_send(c->mq[dir], (const char *)buf + off, n, 0) < 0)
+			die("mq_send");
+	}
+}
+
+static void
+posixmq_recv(struct chan *c, int dir, void *buf)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < c->size; off += n) {
+		n = mq_receive(c->mq[dir], (char *)buf + off, c->chunk, NULL);
+		if (n < 0)
+			die("mq_receive");
+	}
+}
+
+static void
+posixmq_teardown(struct chan *c)
+{
+	mq_close(c->mq[0]);
+	mq_close(c->mq[1]);
+}
+
+/******************************************************************************
+ * Shared memory slots, with eventfd, futex or signal notification
+ */
+
+static void
+slots_setup(struct chan *c)
+{
+	c->slot[0] = create_shared_memory_area(sizeof(struct slot) + c->size);
+	c->slot[1] = create_shared_memory_area(sizeof(struct slot) + c->size);
+}
+
+static void
+slots_teardown(struct chan *c)
+{
+	munmap(c->slot[0], sizeof(struct slot) + c->size);
+	munmap(c->slot[1], sizeof(struct slot) + c->size);
+}
+
+/* "empty" starts at 1: the slot may be filled once before any ack */
+static void
+eventfd_setup(struct chan *c)
+{
+	int dir;
+
+	slots_setup(c);
+	for (dir = 0; dir < 2; dir++) {
+		c->efd_full[dir] = eventfd(0, 0);
+		c->efd_empty[dir] = eventfd(1, 0);
+		if (c->efd_full[dir] < 0 || c->efd_empty[dir] < 0)
+			die("eventfd");
+	}
+}
+
+static void
+eventfd_send(struct chan *c, int dir, const void *buf)
+{
+	uint64_t v;
+
+	read_all(c->efd_empty[dir], &v, sizeof(v));
+	memcpy(c->slot[dir]->data, buf, c->size);
+	v = 1;
+	write_all(c->efd_full[dir], &v, sizeof(v));
+}
+
+static void
+eventfd_recv(struct chan *c, int dir, void *buf)
+{
+	uint64_t v;
+
+	read_all(c->efd_full[dir], &v, sizeof(v));
+	memcpy(buf, c->slot[dir]->data, c->size);
+	v = 1;
+	write_all(c->efd_empty[dir], &v, sizeof(v));
+}
+
+static void
+eventfd_teardown(struct chan *c)
+{
+	int dir;
+
+	for (dir = 0; dir < 2; dir++) {
+		close(c->efd_full[dir]);
+		close(c->efd_empty[dir]);
+	}
+	slots_teardown(c);
+}
+
+static void
+futex_send(struct chan *c, int dir, const void *buf)
+{
+	struct slot *s = c->slot[dir];
+
+	while (__atomic_load_n(&s->full, __ATOMIC_ACQUIRE))
+		futex_wait(&s->full, 1, NULL);
+	memcpy(s->data, buf, c->size);
+	__atomic_store_n(&s->full, 1, __ATOMIC_RELEASE);
+	futex_wake(&s->full, 1);
+}
+
+static void
+futex_recv(struct chan *c, int dir, void *buf)
+{
+	struct slot *s = c->slot[dir];
+
+	while (!__atomic_load_n(&s->full, __ATOMIC_ACQUIRE))
+		futex_wait(&s->full, 0, NULL);
+	memcpy(buf, s->data, c->size);
+	__atomic_store_n(&s->full, 0, __ATOMIC_RELEASE);
+	futex_wake(&s->full, 1);
+}
+
+/*
+ * SIGUSR1 says "the slot is full", SIGUSR2 "I have emptied it". Both are
+ * blocked and taken with sigwaitinfo(). A sender waits for the ack of
+ * each message, so at most one signal of each kind is ever pending and
+ * none is lost to merging.
+ */
+static void
+signal_setup(struct chan *c)
+{
+	sigset_t set;
+
+	slots_setup(c);
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+		die("sigprocmask");
+}
+
+static void
+wait_signal(int signo)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	while (sigwaitinfo(&set, NULL) < 0)
+		;
+}
+
+static void
+signal_send(struct chan *c, int dir, const void *buf)
+{
+	memcpy(c->slot[dir]->data, buf, c->size);
+	if (kill(c->peer, SIGUSR1) < 0)
+		die("kill");
+	wait_signal(SIGUSR2);
+}
+
+static void
+signal_recv(struct chan *c, int dir, void *buf)
+{
+	wait_signal(SIGUSR1);
+	memcpy(buf, c->slot[dir]->data, c->size);
+	if (kill(c->peer, SIGUSR2) < 0)
+		die("kill");
+}
+
+static void
+signal_teardown(struct chan *c)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	slots_teardown(c);
+}
+
+static struct transport transports[] = {
+	{ "pipe", pipe_setup, pipe_send, pipe_recv, pipe_teardown },
+	{ "socket", socket_setup, socket_send, socket_recv, socket_teardown },
+	{ "sysvmsg", sysvmsg_setup, sysvmsg_send, sysvmsg_recv,
+		sysvmsg_teardown },
+	{ "posixmq", posixmq_setup, posixmq_send, posixmq_recv,
+		posixmq_teardown },
+	{ "eventfd", eventfd_setup, eventfd_send, eventfd_recv,
+		eventfd_teardown },
+	{ "futex", slots_setup, futex_send, futex_recv, slots_teardown },
+	{ "signal", signal_setup, signal_send, signal_recv, signal_teardown },
+};
+
+#define NR_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+/******************************************************************************
+ * The benchmark
+ */
+
+/* The CPUs we may run on, as we started */
+static cpu_set_t allowed;
+
+static void
+pin_to(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		die("sched_setaffinity");
+}
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+cmp_double(const void *x, const void *y)
+{
+	double a = *(const double *)x, b = *(const double *)y;
+
+	return (a > b) - (a < b);
+}
+
+static void
+child(struct transport *t, struct chan *c, int cpu, long pings, long msgs)
+{
+	void *buf;
+	long i;
+
+	pin_to(cpu);
+	buf = malloc(c->size);
+	if (buf == NULL)
+		die("malloc");
+	memset(buf, 0, c->size);
+	c->peer = getppid();
+
+	for (i = 0; i < pings; i++) {
+		t->recv(c, 0, buf);
+		t->send(c, 1, buf);
+	}
+	for (i = 0; i < msgs; i++)
+		t->recv(c, 0, buf);
+	t->send(c, 1, buf);
+
+	exit(0);
+}
+
+static void
+run(struct transport *t, size_t size, const char *pin, int pcpu, int ccpu,
+	long max_pings)
+{
+	struct chan c;
+	double *lat, t0, t1;
+	void *buf;
+	long i, pings, msgs;
+	pid_t p;
+	int status;
+
+	pings = PINGPONG_BYTES / size;
+	if (pings < 1000)
+		pings = 1000;
+	if (pings > max_pings)
+		pings = max_pings;
+	msgs = STREAM_BYTES / size;
+	if (msgs < 64)
+		msgs = 64;
+	if (msgs > 10 * max_pings)
+		msgs = 10 * max_pings;
+
+	lat = malloc(pings * sizeof(*lat));
+	buf = malloc(size);
+	if (lat == NULL || buf == NULL)
+		die("malloc");
+	memset(buf, 0x5a, size);
+
+	memset(&c, 0, sizeof(c));
+	c.size = size;
+	t->setup(&c);
+
+	p = fork();
+	if (p < 0)
+		die("fork");
+	if (p == 0)
+		child(t, &c, ccpu, pings, msgs);
+	c.peer = p;
+	pin_to(pcpu);
+
+	for (i = 0; i < pings; i++) {
+		t0 = now_us();
+		t->send(&c, 0, buf);
+		t->recv(&c, 1, buf);
+		lat[i] = now_us() - t0;
+	}
+
+	t0 = now_us();
+	for (i = 0; i < msgs; i++)
+		t->send(&c, 0, buf);
+	t->recv(&c, 1, buf);
+	t1 = now_us();
+
+	p = wait(&status);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		explain_wait_status(p, status);
+	t->teardown(&c);
+
+	/* Unpin, or the next run is forked on our CPU */
+	if (pcpu >= 0 && sched_setaffinity(0, sizeof(allowed), &allowed) < 0)
+		die("sched_setaffinity");
+
+	qsort(lat, pings, sizeof(*lat), cmp_double);
+	printf("%-8s %8zu %-6s %10.1f %10.1f %10.1f %10.1f\n",
+		t->name, size, pin, lat[pings / 2], lat[pings * 99 / 100],
+		lat[pings * 999 / 1000], size * (double)msgs / (t1 - t0));
+
+	free(lat);
+	free(buf);
+}
+
+static void
+usage(const char *argv0)
+{
+	unsigned i;
+
+	fprintf(stderr, "Usage: %s [-t transport,...] [-s size,...] "
+		"[-n max_pingpongs] [-p same|cross|none]\n\n  transports:",
+		argv0);
+	for (i = 0; i < NR_TRANSPORTS; i++)
+		fprintf(stderr, " %s", transports[i].name);
+	fprintf(stderr, "\n  sizes in bytes, K or M suffix allowed; "
+		"default 4 to 1M in steps of 16x\n");
+	exit(1);
+}
+
+static int
+parse_sizes(char *arg, size_t *sizes)
+{
+	char *tok, *end;
+	int n = 0;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_SIZES;
+	     tok = strtok(NULL, ",")) {
+		sizes[n] = strtoul(tok, &end, 10);
+		if (*end == 'K' || *end == 'k')
+			sizes[n] <<= 10;
+		else if (*end == 'M' || *end == 'm')
+			sizes[n] <<= 20;
+		if (sizes[n] == 0)
+			return 0;
+		n++;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sizes[MAX_SIZES] = { 4, 64, 1 << 10, 16 << 10, 256 << 10,
+		1 << 20 };
+	int nsizes = 6, same = 1, cross = 1, asked_cross = 0;
+	int cpu[2] = { -1, -1 }, ncpus = 0, c;
+	long max_pings = 20000;
+	char *only = NULL, *tok;
+	int opt, s;
+	unsigned i;
+
+	while ((opt = getopt(argc, argv, "t:s:n:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			only = optarg;
+			break;
+		case 's':
+			nsizes = parse_sizes(optarg, sizes);
+			if (nsizes == 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			max_pings = atol(optarg);
+			if (max_pings < 1)
+				usage(argv[0]);
+			break;
+		case 'p':
+			same = !strcmp(optarg, "same");
+			cross = asked_cross = !strcmp(optarg, "cross");
+			if (!same && !cross && strcmp(optarg, "none"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	/* Pin to the first two CPUs we are allowed on, whichever they are */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		die("sched_getaffinity");
+	for (c = 0; c < CPU_SETSIZE && ncpus < 2; c++)
+		if (CPU_ISSET(c, &allowed))
+			cpu[ncpus++] = c;
+	if (cross && ncpus < 2) {
+		if (asked_cross) {
+			fprintf(stderr, "Only one CPU to run on, cannot pin "
+				"the processes to different CPUs\n");
+			exit(1);
+		}
+		fprintf(stderr, "Only one CPU to run on, skipping the "
+			"cross-core runs\n");
+		cross = 0;
+	}
+
+	/* Make sure nothing buffered is inherited by the children */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("%-8s %8s %-6s %10s %10s %10s %10s\n", "#transp", "size",
+		"pin", "p50_us", "p99_us", "p999_us", "MB/s");
+
+	for (i = 0; i < NR_TRANSPORTS; i++) {
+		if (only != NULL) {
+			for (tok = only; (tok = strstr(tok, transports[i].name));
+			     tok++)
+				if ((tok == only || tok[-1] == ',') &&
+				    (tok[strlen(transports[i].name)] == '\0' ||
+				     tok[strlen(transports[i].name)] == ','))
+					break;
+			if (tok == NULL)
+				continue;
+		}
+		for (s = 0; s < nsizes; s++) {
+			if (same)
+				run(&transports[i], sizes[s], "same", cpu[0],
+					cpu[0], max_pings);
+			if (cross)
+				run(&transports[i], sizes[s], "cross", cpu[0],
+					cpu[1], max_pings);
+			if (!same && !cross)
+				run(&transports[i], sizes[s], "none", -1, -1,
+					max_pings);
+		}
+	}
+
+	return 0;
+}
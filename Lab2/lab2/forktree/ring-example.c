@@ -0,0 +1,225 @@
+/*
+ * ring-example.c
+ *
+ * Message passing between forked processes through shm-ring,
+ * next to the same transfer over a pipe.
+ *
+ * 1. pipe vs spsc_ring: the parent streams messages to one child,
+ *    which checks that they arrive in order.
+ * 2. mpmc_ring: several producer processes feed several consumers.
+ *    The consumers add up what they got, and the parent checks that
+ *    every message was received exactly once.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/wait.h>
+
+#include "proc-common.h"
+#include "shm-ring.h"
+
+#define RING_CAPACITY 1024
+
+struct msg {
+	long seq;
+	double val;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+wait_all(int nprocs)
+{
+	int status;
+	pid_t p;
+
+	while (nprocs-- > 0) {
+		p = wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			explain_wait_status(p, status);
+			exit(1);
+		}
+	}
+}
+
+static void
+check_order(struct msg *m, long expected)
+{
+	if (m->seq != expected) {
+		fprintf(stderr, "Child: got message %ld, expected %ld\n",
+			m->seq, expected);
+		exit(1);
+	}
+}
+
+static void
+report(const char *what, long n, double sec)
+{
+	printf("%-10s %ld messages in %.3f s, %.2f M messages/s\n",
+		what, n, sec, n / sec / 1e6);
+}
+
+static void
+pipe_stream(long n)
+{
+	int pfd[2];
+	long i;
+	double t;
+	struct msg m;
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	t = now();
+	if (fork() == 0) {
+		close(pfd[1]);
+		for (i = 0; i < n; i++) {
+			if (read(pfd[0], &m, sizeof(m)) != sizeof(m)) {
+				perror("child: read from pipe");
+				exit(1);
+			}
+			check_order(&m, i);
+		}
+		exit(0);
+	}
+	close(pfd[0]);
+
+	for (i = 0; i < n; i++) {
+		m.seq = i;
+		m.val = i * 0.5;
+		if (write(pfd[1], &m, sizeof(m)) != sizeof(m)) {
+			perror("parent: write to pipe");
+			exit(1);
+		}
+	}
+	close(pfd[1]);
+	wait_all(1);
+	report("pipe", n, now() - t);
+}
+
+static void
+spsc_stream(long n)
+{
+	struct spsc_ring *r;
+	long i;
+	double t;
+	struct msg m;
+
+	r = spsc_ring_create(RING_CAPACITY, sizeof(struct msg));
+
+	t = now();
+	if (fork() == 0) {
+		for (i = 0; spsc_ring_recv(r, &m); i++)
+			check_order(&m, i);
+		if (i != n) {
+			fprintf(stderr, "Child: got %ld of %ld messages\n", i, n);
+			exit(1);
+		}
+		exit(0);
+	}
+
+	for (i = 0; i < n; i++) {
+		m.seq = i;
+		m.val = i * 0.5;
+		spsc_ring_send(r, &m);
+	}
+	spsc_ring_close(r);
+	wait_all(1);
+	report("spsc_ring", n, now() - t);
+}
+
+static void
+mpmc_stream(long n, int producers, int consumers)
+{
+	struct mpmc_ring *r;
+	long i, per_producer, *sums, total = 0, expected = 0;
+	int k;
+	double t;
+	struct msg m;
+
+	r = mpmc_ring_create(RING_CAPACITY, sizeof(struct msg));
+	sums = create_shared_memory_area(2 * consumers * sizeof(long));
+	per_producer = n / producers;
+
+	t = now();
+	for (k = 0; k < consumers; k++)
+		if (fork() == 0) {
+			for (i = 0; mpmc_ring_recv(r, &m); i++)
+				total += m.seq;
+			sums[2 * k] = total;
+			sums[2 * k + 1] = i;
+			exit(0);
+		}
+	for (k = 0; k < producers; k++)
+		if (fork() == 0) {
+			for (i = 0; i < per_producer; i++) {
+				m.seq = k * per_producer + i;
+				m.val = m.seq * 0.5;
+				mpmc_ring_send(r, &m);
+			}
+			exit(0);
+		}
+
+	/* The producers exit first, then nothing more will be sent */
+	wait_all(producers);
+	mpmc_ring_close(r);
+	wait_all(consumers);
+	t = now() - t;
+
+	n = per_producer * producers;
+	for (k = 0; k < consumers; k++) {
+		total += sums[2 * k];
+		expected += sums[2 * k + 1];
+	}
+	if (expected != n || total != n * (n - 1) / 2) {
+		fprintf(stderr, "mpmc_ring: %ld messages received, "
+			"sum %ld, expected %ld and %ld\n",
+			expected, total, n, n * (n - 1) / 2);
+		exit(1);
+	}
+	printf("%d producers -> %d consumers:\n", producers, consumers);
+	report("mpmc_ring", n, t);
+}
+
+int main(int argc, char *argv[])
+{
+	long n = 1000000;
+	int producers = 2, consumers = 2;
+
+	if (argc > 4) {
+		fprintf(stderr, "Usage: %s [<messages> [<producers> [<consumers>]]]\n\n",
+			argv[0]);
+		exit(1);
+	}
+	if (argc > 1)
+		n = atol(argv[1]);
+	if (argc > 2)
+		producers = atoi(argv[2]);
+	if (argc > 3)
+		consumers = atoi(argv[3]);
+	if (n < 1 || producers < 1 || consumers < 1 || n < producers) {
+		fprintf(stderr, "bad message or process count\n");
+		exit(1);
+	}
+
+	/* Make sure nothing buffered is inherited by the children */
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	pipe_stream(n);
+	spsc_stream(n);
+	mpmc_stream(n, producers, consumers);
+
+	return 0;
+}
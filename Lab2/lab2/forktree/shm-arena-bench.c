@@ -0,0 +1,308 @@
+/*
+ * shm-arena-bench.c
+ *
+ * Multi-process benchmark for the shared-memory arena allocator.
+ *
+ * Every worker process keeps a window of live blocks and, at random,
+ * frees an occupied slot or fills an empty one with a block of random
+ * size. Each block is stamped with its owner and slot, and the stamp is
+ * checked before the block is freed, so a block handed out twice shows
+ * up as an error. With -m the workers use their private malloc() heap
+ * instead, as a baseline.
+ *
+ * Then, on an arena of its own, the parent allocates blocks and a child
+ * frees them, which is what the arena is for; the parent allocates as
+ * many again, and they must be the very blocks the child freed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "futex.h"
+#include "proc-common.h"
+#include "shm-arena.h"
+
+struct start_line {
+	int ready;
+	int go;
+};
+
+struct bench {
+	struct shm_arena *arena;
+	int use_malloc;
+	long ops;
+	int window;
+	int max_size;
+};
+
+static uint32_t
+xorshift(uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+static void *
+block_alloc(struct bench *b, size_t n, shm_off_t *off)
+{
+	if (b->use_malloc)
+		return malloc(n);
+	*off = shm_alloc(b->arena, n);
+	return shm_ptr(b->arena, *off);
+}
+
+static void
+block_free(struct bench *b, void *p, shm_off_t off)
+{
+	if (b->use_malloc)
+		free(p);
+	else
+		shm_free(b->arena, off);
+}
+
+static void
+worker(struct bench *b, struct start_line *sl, int id)
+{
+	void **ptr;
+	shm_off_t *off;
+	uint64_t stamp;
+	uint32_t seed = 2463534242U + id * 7919;
+	long i;
+	int slot;
+
+	ptr = calloc(b->window, sizeof(*ptr));
+	off = calloc(b->window, sizeof(*off));
+	if (ptr == NULL || off == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	__atomic_add_fetch(&sl->ready, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&sl->go, __ATOMIC_ACQUIRE) == 0)
+		futex_wait(&sl->go, 0, NULL);
+
+	for (i = 0; i < b->ops; i++) {
+		slot = xorshift(&seed) % b->window;
+		stamp = (uint64_t)id << 32 | slot;
+		if (ptr[slot] != NULL) {
+			if (*(uint64_t *)ptr[slot] != stamp) {
+				fprintf(stderr, "Worker %d: block of slot %d "
+					"was handed out twice\n", id, slot);
+				exit(1);
+			}
+			block_free(b, ptr[slot], off[slot]);
+			ptr[slot] = NULL;
+		} else {
+			ptr[slot] = block_alloc(b,
+				sizeof(stamp) + xorshift(&seed) % b->max_size,
+				&off[slot]);
+			if (ptr[slot] == NULL) {
+				fprintf(stderr, "Worker %d: out of arena space\n",
+					id);
+				exit(1);
+			}
+			*(uint64_t *)ptr[slot] = stamp;
+		}
+	}
+
+	exit(0);
+}
+
+static int
+cmp_off(const void *x, const void *y)
+{
+	shm_off_t a = *(const shm_off_t *)x, b = *(const shm_off_t *)y;
+
+	return a < b ? -1 : a > b;
+}
+
+#define CROSS_BLOCKS 10000
+#define CROSS_SIZE   100
+
+/* Blocks allocated by the parent, freed by a child, reused by the parent */
+static int
+cross_process_free(int flags)
+{
+	struct shm_arena *a;
+	shm_off_t *off, *again;
+	struct timespec t0, t1;
+	size_t used;
+	int i, status, failed = 0;
+	pid_t pid;
+
+	a = shm_arena_create(4 << 20, flags);
+	off = create_shared_memory_area(CROSS_BLOCKS * sizeof(*off));
+	again = calloc(CROSS_BLOCKS, sizeof(*again));
+	if (again == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < CROSS_BLOCKS; i++) {
+		off[i] = shm_alloc(a, CROSS_SIZE);
+		if (off[i] == 0) {
+			fprintf(stderr, "Cross-process free: out of arena space\n");
+			exit(1);
+		}
+		*(int *)shm_ptr(a, off[i]) = i;
+	}
+	used = shm_arena_used(a);
+
+	/* Or the child writes out what is buffered again */
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		for (i = 0; i < CROSS_BLOCKS; i++) {
+			if (*(int *)shm_ptr(a, off[i]) != i) {
+				fprintf(stderr, "Cross-process free: block %d "
+					"is not what the parent wrote\n", i);
+				exit(1);
+			}
+			shm_free(a, off[i]);
+		}
+		exit(0);
+	}
+	pid = wait(&status);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		explain_wait_status(pid, status);
+		return 1;
+	}
+
+	/* The same blocks, in whatever order, and no new superblocks */
+	for (i = 0; i < CROSS_BLOCKS; i++)
+		again[i] = shm_alloc(a, CROSS_SIZE);
+	qsort(off, CROSS_BLOCKS, sizeof(*off), cmp_off);
+	qsort(again, CROSS_BLOCKS, sizeof(*again), cmp_off);
+	for (i = 0; i < CROSS_BLOCKS; i++)
+		if (again[i] != off[i])
+			failed = 1;
+	if (shm_arena_used(a) != used)
+		failed = 1;
+
+	printf("cross-process free: %d blocks freed by a child in %.1f ms "
+		"(fork included), %s\n", CROSS_BLOCKS,
+		((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9) * 1e3,
+		failed ? "NOT reused" : "all reused");
+	free(again);
+
+	return failed;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-H] [-T] [-m] [-p procs] [-n ops] "
+		"[-w window] [-s max_size] [-a arena_mib]\n\n"
+		"  -H  back the arena with MAP_HUGETLB pages\n"
+		"  -T  ask for transparent huge pages (MADV_HUGEPAGE)\n"
+		"  -m  use malloc() in each process instead of the arena\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { NULL, 0, 1000000, 1024, 512 };
+	struct start_line *sl;
+	struct timespec t0, t1;
+	int opt, i, status, nprocs = 4, flags = 0, failed = 0;
+	long arena_mib = 256;
+	double sec;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "HTmp:n:w:s:a:")) != -1) {
+		switch (opt) {
+		case 'H':
+			flags |= SHM_ARENA_HUGETLB;
+			break;
+		case 'T':
+			flags |= SHM_ARENA_THP;
+			break;
+		case 'm':
+			b.use_malloc = 1;
+			break;
+		case 'p':
+			nprocs = atoi(optarg);
+			break;
+		case 'n':
+			b.ops = atol(optarg);
+			break;
+		case 'w':
+			b.window = atoi(optarg);
+			break;
+		case 's':
+			b.max_size = atoi(optarg);
+			break;
+		case 'a':
+			arena_mib = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nprocs < 1 || b.ops < 1 || b.window < 1 ||
+	    b.max_size < 1 ||
+	    b.max_size + sizeof(uint64_t) > SHM_ARENA_MAX_ALLOC)
+		usage(argv[0]);
+
+	if (!b.use_malloc)
+		b.arena = shm_arena_create(arena_mib << 20, flags);
+	sl = create_shared_memory_area(sizeof(*sl));
+
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0)
+			worker(&b, sl, i);
+	}
+
+	/* Start everyone at once, so that they contend */
+	while (__atomic_load_n(&sl->ready, __ATOMIC_ACQUIRE) < nprocs)
+		usleep(1000);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	__atomic_store_n(&sl->go, 1, __ATOMIC_RELEASE);
+	futex_wake(&sl->go, nprocs);
+
+	for (i = 0; i < nprocs; i++) {
+		pid = wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			explain_wait_status(pid, status);
+			failed = 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	printf("%s: %d procs x %ld ops, %.1f Mops/s, %.1f ns/op per process",
+		b.use_malloc ? "malloc" : "arena", nprocs, b.ops,
+		nprocs * b.ops / sec / 1e6, sec * 1e9 / b.ops);
+	if (!b.use_malloc)
+		printf(", %zu KiB of superblocks%s%s",
+			shm_arena_used(b.arena) >> 10,
+			shm_arena_flags(b.arena) & SHM_ARENA_HUGETLB ?
+				", hugetlb" : "",
+			shm_arena_flags(b.arena) & SHM_ARENA_THP ? ", thp" : "");
+	printf("\n");
+
+	if (!b.use_malloc)
+		failed |= cross_process_free(flags);
+
+	return failed;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "proc-common.h"
+#include "shm-arena.h"
+
+#define SB_SHIFT    16
+#define SB_SIZE     (1UL << SB_SHIFT)
+#define MIN_SHIFT   4
+#define MAX_SHIFT   15
+#define NR_CLASSES  (MAX_SHIFT - MIN_SHIFT + 1)
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define MAX_ARENA_SIZE (0x10000UL * SB_SIZE - SB_SIZE)
+
+/*
+ * Free list of a size class: a Treiber stack whose head packs the offset
+ * of the top block in the low 32 bits and a counter in the high 32 bits.
+ * The counter changes on every update, so a pop that raced with a
+ * pop-push of the same block (ABA) fails its compare-and-swap. A free
+ * block keeps the offset of the next one in its first 4 bytes.
+ *
+ * Each head has a cache line of its own.
+ */
+struct free_list {
+	uint64_t head;
+} __attribute__((aligned(64)));
+
+struct shm_arena {
+	struct free_list free[NR_CLASSES];
+	size_t size;
+	int flags;
+	uint32_t first_sb;    /* superblocks before it hold this header */
+	uint32_t nr_sb;
+	uint32_t next_sb;     /* next superblock to hand out */
+	uint8_t sb_class[];   /* size class of each superblock */
+};
+
+static int
+size_class(size_t n)
+{
+	int shift;
+
+	if (n <= (1UL << MIN_SHIFT))
+		return 0;
+	shift = 64 - __builtin_clzl(n - 1);
+
+	return shift - MIN_SHIFT;
+}
+
+static uint32_t *
+next_of(struct shm_arena *a, shm_off_t off)
+{
+	return shm_ptr(a, off);
+}
+
+/* Push the chain first..last, already linked from first to last */
+static void
+push_chain(struct shm_arena *a, int cls, shm_off_t first, shm_off_t last)
+{
+	uint64_t *head = &a->free[cls].head;
+	uint64_t old, new;
+
+	old = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(next_of(a, last), (uint32_t)old,
+			__ATOMIC_RELAXED);
+		new = ((old >> 32) + 1) << 32 | first;
+	} while (!__atomic_compare_exchange_n(head, &old, new, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static shm_off_t
+pop(struct shm_arena *a, int cls)
+{
+	uint64_t *head = &a->free[cls].head;
+	uint64_t old, new;
+	shm_off_t off, next;
+
+	old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	do {
+		off = (uint32_t)old;
+		if (off == 0)
+			return 0;
+		/*
+		 * The block may be popped and reused under our feet, so
+		 * next may be garbage; the counter makes the CAS fail then.
+		 * The arena is never unmapped, so the read itself is safe.
+		 */
+		next = __atomic_load_n(next_of(a, off), __ATOMIC_RELAXED);
+		new = ((old >> 32) + 1) << 32 | next;
+	} while (!__atomic_compare_exchange_n(head, &old, new, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return off;
+}
+
+/*
+ * Dedicate a fresh superblock to a size class: keep its first block
+ * for the caller and push the rest onto the free list in one go.
+ */
+static shm_off_t
+refill(struct shm_arena *a, int cls)
+{
+	uint32_t sb;
+	shm_off_t base, bsize, off;
+
+	sb = __atomic_load_n(&a->next_sb, __ATOMIC_RELAXED);
+	do {
+		if (sb >= a->nr_sb)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&a->next_sb, &sb, sb + 1, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	/* published to other processes by the release in push_chain() */
+	a->sb_class[sb] = cls;
+
+	base = sb << SB_SHIFT;
+	bsize = 1U << (cls + MIN_SHIFT);
+	if (bsize == SB_SIZE)
+		return base;
+	for (off = base + bsize; off + bsize < base + SB_SIZE; off += bsize)
+		*next_of(a, off) = off + bsize;
+	push_chain(a, cls, base + bsize, off);
+
+	return base;
+}
+
+struct shm_arena *
+shm_arena_create(size_t size, int flags)
+{
+	struct shm_arena *a = NULL;
+	size_t header;
+
+	size = (size + SB_SIZE - 1) & ~(SB_SIZE - 1);
+	if (flags & SHM_ARENA_HUGETLB)
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	if (size > MAX_ARENA_SIZE) {
+		fprintf(stderr, "%s: %zu bytes is too large, offsets are 32-bit\n",
+			__func__, size);
+		exit(1);
+	}
+
+	if (flags & SHM_ARENA_HUGETLB) {
+		a = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (a == MAP_FAILED) {
+			perror("shm_arena_create: MAP_HUGETLB, using normal pages");
+			a = NULL;
+			flags &= ~SHM_ARENA_HUGETLB;
+		}
+	}
+	if (a == NULL)
+		a = create_shared_memory_area(size);
+
+	if ((flags & SHM_ARENA_THP) && madvise(a, size, MADV_HUGEPAGE) < 0) {
+		perror("shm_arena_create: MADV_HUGEPAGE");
+		flags &= ~SHM_ARENA_THP;
+	}
+
+	/* the mapping is zero-filled: the free lists are empty */
+	a->size = size;
+	a->flags = flags;
+	a->nr_sb = size >> SB_SHIFT;
+	header = offsetof(struct shm_arena, sb_class) + a->nr_sb;
+	a->first_sb = (header + SB_SIZE - 1) >> SB_SHIFT;
+	a->next_sb = a->first_sb;
+	if (a->first_sb >= a->nr_sb) {
+		fprintf(stderr, "%s: %zu bytes is too small\n", __func__, size);
+		exit(1);
+	}
+
+	return a;
+}
+
+int
+shm_arena_flags(struct shm_arena *a)
+{
+	return a->flags;
+}
+
+size_t
+shm_arena_used(struct shm_arena *a)
+{
+	uint32_t sb = __atomic_load_n(&a->next_sb, __ATOMIC_RELAXED);
+
+	return (size_t)(sb - a->first_sb) << SB_SHIFT;
+}
+
+shm_off_t
+shm_alloc(struct shm_arena *a, size_t n)
+{
+	shm_off_t off;
+	int cls;
+
+	if (n > SHM_ARENA_MAX_ALLOC)
+		return 0;
+
+	cls = size_class(n);
+	off = pop(a, cls);
+	if (off == 0)
+		off = refill(a, cls);
+
+	return off;
+}
+
+void
+shm_free(struct shm_arena *a, shm_off_t off)
+{
+	if (off == 0)
+		return;
+
+	push_chain(a, a->sb_class[off >> SB_SHIFT], off, off);
+}
@@ -0,0 +1,60 @@
+#ifndef SHM_ARENA_H
+#define SHM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * A process-shared arena allocator.
+ *
+ * One shared mapping is created up front and carved into 64 KiB
+ * superblocks. Each superblock serves a single size class, from 16 bytes
+ * to 32 KiB in powers of two. Freed blocks go to a per-class lock-free
+ * stack, so any process may free a block allocated by any other.
+ *
+ * Blocks are named by their offset from the start of the arena, not by
+ * pointer. An offset stays valid in every process, even where the arena
+ * is mapped at a different address; offset 0 is the null block. All
+ * state lives inside the mapping, so create the arena before fork().
+ */
+
+#define SHM_ARENA_HUGETLB  0x1  /* back the arena with MAP_HUGETLB pages */
+#define SHM_ARENA_THP      0x2  /* ask for transparent huge pages */
+
+#define SHM_ARENA_MAX_ALLOC 32768
+
+typedef uint32_t shm_off_t;
+
+struct shm_arena;
+
+/*
+ * Create an arena of (at least) size bytes. If the huge page mapping
+ * fails, fall back to plain create_shared_memory_area() pages.
+ */
+struct shm_arena *shm_arena_create(size_t size, int flags);
+
+/* The SHM_ARENA_* flags that actually took effect. */
+int shm_arena_flags(struct shm_arena *a);
+
+/* Bytes of the arena handed out to size classes so far. */
+size_t shm_arena_used(struct shm_arena *a);
+
+/* Allocate n bytes, 16-byte aligned; returns 0 if out of space. */
+shm_off_t shm_alloc(struct shm_arena *a, size_t n);
+
+/* Return a block to its size class. off may be 0. */
+void shm_free(struct shm_arena *a, shm_off_t off);
+
+static inline void *
+shm_ptr(struct shm_arena *a, shm_off_t off)
+{
+	return off ? (char *)a + off : NULL;
+}
+
+static inline shm_off_t
+shm_off(struct shm_arena *a, void *p)
+{
+	return p ? (shm_off_t)((char *)p - (char *)a) : 0;
+}
+
+#endif /* SHM_ARENA_H */
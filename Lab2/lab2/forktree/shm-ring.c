@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "futex.h"
+#include "proc-common.h"
+#include "shm-ring.h"
+
+#define CACHE_LINE 64
+
+/* Tries before going to sleep; short, a sleeper costs two syscalls */
+#define RING_SPIN 64
+
+/*
+ * Where processes sleep until the ring is no longer full (or empty).
+ * A sleeper first sets sleepers, then reads epoch, tries once more and
+ * sleeps on epoch. A waker first updates the ring, then looks at
+ * sleepers; only if it is set does it clear it, bump epoch and wake
+ * everyone up, so a batch of messages costs at most one wake-up system
+ * call. The full fences on both sides ensure that either the sleeper
+ * sees the update or the waker sees the sleeper.
+ */
+struct wait_queue {
+	int epoch;
+	int sleepers;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static void
+wake_all(struct wait_queue *wq)
+{
+	__atomic_add_fetch(&wq->epoch, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&wq->epoch, INT_MAX);
+}
+
+static void
+wake_sleepers(struct wait_queue *wq)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&wq->sleepers, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&wq->sleepers, 0, __ATOMIC_RELAXED))
+		wake_all(wq);
+}
+
+/*
+ * Block until try(r, msg) succeeds or the ring is closed. On close,
+ * receivers get one last try, to drain messages sent before it.
+ */
+static int
+wait_for(struct wait_queue *wq, int *closed, int sender,
+	int (*try)(void *, void *), void *r, void *msg)
+{
+	int i, epoch;
+
+	for (;;) {
+		for (i = 0; i < RING_SPIN; i++) {
+			if (__atomic_load_n(closed, __ATOMIC_ACQUIRE))
+				return sender ? 0 : try(r, msg);
+			if (try(r, msg))
+				return 1;
+			cpu_relax();
+		}
+
+		__atomic_store_n(&wq->sleepers, 1, __ATOMIC_SEQ_CST);
+		epoch = __atomic_load_n(&wq->epoch, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(closed, __ATOMIC_ACQUIRE))
+			continue;
+		if (try(r, msg))
+			return 1;
+		futex_wait(&wq->epoch, epoch, NULL);
+	}
+}
+
+static unsigned
+round_capacity(unsigned capacity)
+{
+	unsigned n = 1;
+
+	if (capacity == 0 || capacity > (1U << 30)) {
+		fprintf(stderr, "shm-ring: bad capacity %u\n", capacity);
+		exit(1);
+	}
+	while (n < capacity)
+		n <<= 1;
+
+	return n;
+}
+
+/******************************************************************************
+ * Single producer, single consumer
+ *
+ * head and tail are free-running counters, each written by one side only
+ * and on a cache line of its own. Each side also keeps a private copy of
+ * the other side's counter and re-reads the shared one only when the
+ * copy says the ring is full/empty, so the lines bounce between caches
+ * once per batch of messages, not once per message.
+ */
+
+struct spsc_ring {
+	/* producer */
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));
+	uint32_t head_cache;
+
+	/* consumer */
+	uint32_t head __attribute__((aligned(CACHE_LINE)));
+	uint32_t tail_cache;
+
+	struct wait_queue not_full;
+	struct wait_queue not_empty;
+
+	/* read-only after creation, but for closed */
+	uint32_t mask __attribute__((aligned(CACHE_LINE)));
+	uint32_t msg_size;
+	int closed;
+
+	unsigned char data[] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct spsc_ring *
+spsc_ring_create(unsigned capacity, size_t msg_size)
+{
+	struct spsc_ring *r;
+
+	capacity = round_capacity(capacity);
+	r = create_shared_memory_area(sizeof(*r) + capacity * msg_size);
+	r->mask = capacity - 1;
+	r->msg_size = msg_size;
+
+	return r;
+}
+
+int
+spsc_ring_try_send(struct spsc_ring *r, const void *msg)
+{
+	uint32_t tail = r->tail;
+
+	if (tail - r->head_cache > r->mask) {
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_cache > r->mask)
+			return 0;
+	}
+
+	memcpy(r->data + (size_t)(tail & r->mask) * r->msg_size, msg,
+		r->msg_size);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	wake_sleepers(&r->not_empty);
+
+	return 1;
+}
+
+int
+spsc_ring_try_recv(struct spsc_ring *r, void *msg)
+{
+	uint32_t head = r->head;
+
+	if (head == r->tail_cache) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_cache)
+			return 0;
+	}
+
+	memcpy(msg, r->data + (size_t)(head & r->mask) * r->msg_size,
+		r->msg_size);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	wake_sleepers(&r->not_full);
+
+	return 1;
+}
+
+static int
+spsc_try_send(void *r, void *msg)
+{
+	return spsc_ring_try_send(r, msg);
+}
+
+static int
+spsc_try_recv(void *r, void *msg)
+{
+	return spsc_ring_try_recv(r, msg);
+}
+
+int
+spsc_ring_send(struct spsc_ring *r, const void *msg)
+{
+	if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return 0;
+	if (spsc_ring_try_send(r, msg))
+		return 1;
+
+	return wait_for(&r->not_full, &r->closed, 1, spsc_try_send, r,
+		(void *)msg);
+}
+
+int
+spsc_ring_recv(struct spsc_ring *r, void *msg)
+{
+	if (spsc_ring_try_recv(r, msg))
+		return 1;
+
+	return wait_for(&r->not_empty, &r->closed, 0, spsc_try_recv, r, msg);
+}
+
+void
+spsc_ring_close(struct spsc_ring *r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+	wake_all(&r->not_full);
+	wake_all(&r->not_empty);
+}
+
+/******************************************************************************
+ * Multiple producers, multiple consumers
+ *
+ * Producers claim a position by advancing enqueue_pos with a CAS, but
+ * only once the cell at that position has sequence number == position,
+ * i.e. its previous message has been consumed. After copying in the
+ * message they set the sequence to position + 1, which is what the
+ * consumer of that position waits for. The consumer in turn sets it to
+ * position + capacity, handing the cell to the producer of the next lap.
+ */
+
+struct mpmc_cell {
+	uint32_t seq;
+	uint32_t pad;
+	unsigned char data[];
+};
+
+struct mpmc_ring {
+	uint32_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+	uint32_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+
+	struct wait_queue not_full;
+	struct wait_queue not_empty;
+
+	uint32_t mask __attribute__((aligned(CACHE_LINE)));
+	uint32_t msg_size;
+	uint32_t cell_size;
+	int closed;
+
+	unsigned char cells[] __attribute__((aligned(CACHE_LINE)));
+};
+
+static inline struct mpmc_cell *
+mpmc_cell(struct mpmc_ring *r, uint32_t pos)
+{
+	return (struct mpmc_cell *)(r->cells +
+		(size_t)(pos & r->mask) * r->cell_size);
+}
+
+struct mpmc_ring *
+mpmc_ring_create(unsigned capacity, size_t msg_size)
+{
+	struct mpmc_ring *r;
+	size_t cell_size;
+	unsigned i;
+
+	capacity = round_capacity(capacity);
+	cell_size = (sizeof(struct mpmc_cell) + msg_size + 7) & ~7UL;
+	r = create_shared_memory_area(sizeof(*r) + capacity * cell_size);
+	r->mask = capacity - 1;
+	r->msg_size = msg_size;
+	r->cell_size = cell_size;
+	for (i = 0; i < capacity; i++)
+		mpmc_cell(r, i)->seq = i;
+
+	return r;
+}
+
+int
+mpmc_ring_try_send(struct mpmc_ring *r, const void *msg)
+{
+	struct mpmc_cell *cell;
+	uint32_t pos, seq;
+	int32_t dif;
+
+	pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = mpmc_cell(r, pos);
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return 0;	/* a lap behind: full */
+		else
+			pos = __atomic_load_n(&r->enqueue_pos,
+				__ATOMIC_RELAXED);
+	}
+
+	memcpy(cell->data, msg, r->msg_size);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	wake_sleepers(&r->not_empty);
+
+	return 1;
+}
+
+int
+mpmc_ring_try_recv(struct mpmc_ring *r, void *msg)
+{
+	struct mpmc_cell *cell;
+	uint32_t pos, seq;
+	int32_t dif;
+
+	pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = mpmc_cell(r, pos);
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return 0;	/* not written yet: empty */
+		else
+			pos = __atomic_load_n(&r->dequeue_pos,
+				__ATOMIC_RELAXED);
+	}
+
+	memcpy(msg, cell->data, r->msg_size);
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	wake_sleepers(&r->not_full);
+
+	return 1;
+}
+
+static int
+mpmc_try_send(void *r, void *msg)
+{
+	return mpmc_ring_try_send(r, msg);
+}
+
+static int
+mpmc_try_recv(void *r, void *msg)
+{
+	return mpmc_ring_try_recv(r, msg);
+}
+
+int
+mpmc_ring_send(struct mpmc_ring *r, const void *msg)
+{
+	if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return 0;
+	if (mpmc_ring_try_send(r, msg))
+		return 1;
+
+	return wait_for(&r->not_full, &r->closed, 1, mpmc_try_send, r,
+		(void *)msg);
+}
+
+int
+mpmc_ring_recv(struct mpmc_ring *r, void *msg)
+{
+	if (mpmc_ring_try_recv(r, msg))
+		return 1;
+
+	return wait_for(&r->not_empty, &r->closed, 0, mpmc_try_recv, r, msg);
+}
+
+void
+mpmc_ring_close(struct mpmc_ring *r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+	wake_all(&r->not_full);
+	wake_all(&r->not_empty);
+}
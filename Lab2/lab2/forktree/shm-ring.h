@@ -0,0 +1,49 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+
+/******************************************************************************
+ * Ring buffers for passing fixed-size messages between processes.
+ *
+ * The rings live in create_shared_memory_area() memory, so create them
+ * before fork(). Sending or receiving a message is a copy into or out
+ * of shared memory, with no system call. A process blocks on a futex
+ * only when the ring is full (sender) or empty (receiver), and the other
+ * side makes the wake-up system call only if someone is actually asleep.
+ *
+ * spsc_ring: exactly one sending and one receiving process.
+ * mpmc_ring: any number of both (Vyukov's bounded queue: every cell
+ *            carries a sequence number telling whose turn it is).
+ *
+ * The capacity is rounded up to a power of two. After *_ring_close(),
+ * sends fail and receives drain what is left, then fail: like writing
+ * to a pipe with no readers and reading a pipe with no writers.
+ */
+
+struct spsc_ring;
+struct mpmc_ring;
+
+struct spsc_ring *spsc_ring_create(unsigned capacity, size_t msg_size);
+
+/* Non-blocking: return 1 on success, 0 if the ring is full/empty. */
+int spsc_ring_try_send(struct spsc_ring *r, const void *msg);
+int spsc_ring_try_recv(struct spsc_ring *r, void *msg);
+
+/* Blocking: return 1 on success, 0 if the ring has been closed. */
+int spsc_ring_send(struct spsc_ring *r, const void *msg);
+int spsc_ring_recv(struct spsc_ring *r, void *msg);
+
+void spsc_ring_close(struct spsc_ring *r);
+
+struct mpmc_ring *mpmc_ring_create(unsigned capacity, size_t msg_size);
+
+int mpmc_ring_try_send(struct mpmc_ring *r, const void *msg);
+int mpmc_ring_try_recv(struct mpmc_ring *r, void *msg);
+
+int mpmc_ring_send(struct mpmc_ring *r, const void *msg);
+int mpmc_ring_recv(struct mpmc_ring *r, void *msg);
+
+void mpmc_ring_close(struct mpmc_ring *r);
+
+#endif /* SHM_RING_H */
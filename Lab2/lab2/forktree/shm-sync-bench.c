@@ -0,0 +1,367 @@
+/*
+ * shm-sync-bench.c
+ *
+ * Contended microbenchmarks for shm-sync, next to the process-shared
+ * pthread objects that do the same job (PTHREAD_PROCESS_SHARED, and
+ * sem_init() with pshared = 1).
+ *
+ *   mutex    every process increments a shared counter under the lock
+ *   rwlock   the same, but 9 in 10 operations only read the counter
+ *   sem      a semaphore of value 1 used as the lock
+ *   barrier  all processes go through the barrier, round after round
+ *   cond     a token goes round the processes; each waits on the
+ *            condition variable for its turn
+ *   robust   a process dies holding the mutex; how long until another
+ *            one gets it, flagged as owner-dead
+ *
+ * The counter is checked at the end of each run, so a lock that lets
+ * two processes in at once shows up as an error.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "proc-common.h"
+#include "shm-sync.h"
+
+struct shared {
+	struct shm_barrier start;
+	long counter;
+	int turn;
+
+	struct shm_mutex m;
+	struct shm_rwlock rw;
+	struct shm_sem sem;
+	struct shm_barrier bar;
+	struct shm_cond cond;
+
+	pthread_mutex_t pm;
+	pthread_rwlock_t prw;
+	sem_t psem;
+	pthread_barrier_t pbar;
+	pthread_cond_t pcond;
+};
+
+static struct shared *sh;
+static int use_pthread;
+static int nprocs;
+static long iters;
+
+static void
+init_shared(void)
+{
+	pthread_mutexattr_t ma;
+	pthread_rwlockattr_t ra;
+	pthread_barrierattr_t ba;
+	pthread_condattr_t ca;
+
+	sh = create_shared_memory_area(sizeof(*sh));
+	shm_barrier_init(&sh->start, nprocs + 1);
+	shm_sem_init(&sh->sem, 1);
+	shm_barrier_init(&sh->bar, nprocs);
+
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&sh->pm, &ma);
+	pthread_rwlockattr_init(&ra);
+	pthread_rwlockattr_setpshared(&ra, PTHREAD_PROCESS_SHARED);
+	pthread_rwlock_init(&sh->prw, &ra);
+	sem_init(&sh->psem, 1, 1);
+	pthread_barrierattr_init(&ba);
+	pthread_barrierattr_setpshared(&ba, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->pbar, &ba, nprocs);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&sh->pcond, &ca);
+}
+
+static void
+lock(void)
+{
+	if (use_pthread)
+		pthread_mutex_lock(&sh->pm);
+	else
+		shm_mutex_lock(&sh->m);
+}
+
+static void
+unlock(void)
+{
+	if (use_pthread)
+		pthread_mutex_unlock(&sh->pm);
+	else
+		shm_mutex_unlock(&sh->m);
+}
+
+static void
+run_mutex(int id)
+{
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		lock();
+		sh->counter++;
+		unlock();
+	}
+
+}
+
+static void
+run_rwlock(int id)
+{
+	volatile long sink;
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		if (i % 10 == 0) {
+			if (use_pthread)
+				pthread_rwlock_wrlock(&sh->prw);
+			else
+				shm_rwlock_wrlock(&sh->rw);
+			sh->counter++;
+		} else {
+			if (use_pthread)
+				pthread_rwlock_rdlock(&sh->prw);
+			else
+				shm_rwlock_rdlock(&sh->rw);
+			sink = sh->counter;
+		}
+		if (use_pthread)
+			pthread_rwlock_unlock(&sh->prw);
+		else
+			shm_rwlock_unlock(&sh->rw);
+	}
+	(void)sink;
+
+}
+
+static void
+run_sem(int id)
+{
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		if (use_pthread)
+			while (sem_wait(&sh->psem) < 0 && errno == EINTR)
+				;
+		else
+			shm_sem_wait(&sh->sem);
+		sh->counter++;
+		if (use_pthread)
+			sem_post(&sh->psem);
+		else
+			shm_sem_post(&sh->sem);
+	}
+
+}
+
+static void
+run_barrier(int id)
+{
+	long i, rounds = iters / 100;
+
+	for (i = 0; i < rounds; i++)
+		if (use_pthread ?
+		    pthread_barrier_wait(&sh->pbar) == PTHREAD_BARRIER_SERIAL_THREAD :
+		    shm_barrier_wait(&sh->bar))
+			sh->counter++;
+
+}
+
+static void
+run_cond(int id)
+{
+	long i, rounds = iters / 100;
+
+	for (i = 0; i < rounds; i++) {
+		lock();
+		while (sh->turn != id)
+			if (use_pthread)
+				pthread_cond_wait(&sh->pcond, &sh->pm);
+			else
+				shm_cond_wait(&sh->cond, &sh->m);
+		sh->counter++;
+		sh->turn = (id + 1) % nprocs;
+		if (use_pthread)
+			pthread_cond_broadcast(&sh->pcond);
+		else
+			shm_cond_broadcast(&sh->cond);
+		unlock();
+	}
+
+}
+
+struct test {
+	const char *name;
+	void (*run)(int id);
+	long (*expected)(void);    /* final value of the counter */
+	long (*ops)(void);         /* operations, for the rate */
+};
+
+static long
+all_ops(void)
+{
+	return nprocs * iters;
+}
+
+static long
+rw_writes(void)
+{
+	return nprocs * ((iters + 9) / 10);
+}
+
+static long
+barrier_rounds(void)
+{
+	return iters / 100;
+}
+
+static long
+cond_rounds(void)
+{
+	return nprocs * (iters / 100);
+}
+
+static struct test tests[] = {
+	{ "mutex", run_mutex, all_ops, all_ops },
+	{ "rwlock", run_rwlock, rw_writes, all_ops },
+	{ "sem", run_sem, all_ops, all_ops },
+	{ "barrier", run_barrier, barrier_rounds, barrier_rounds },
+	{ "cond", run_cond, cond_rounds, cond_rounds },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+wait_all(int n)
+{
+	int status;
+	pid_t p;
+
+	while (n-- > 0) {
+		p = wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			explain_wait_status(p, status);
+			exit(1);
+		}
+	}
+}
+
+static void
+run_test(struct test *t)
+{
+	double t0, sec;
+	long ops;
+	int i;
+
+	sh->counter = 0;
+	sh->turn = 0;
+	for (i = 0; i < nprocs; i++)
+		if (fork() == 0) {
+			shm_barrier_wait(&sh->start);
+			t->run(i);
+			exit(0);
+		}
+
+	/* Arrive last, so the clock starts when the children do */
+	while (__atomic_load_n(&sh->start.arrived, __ATOMIC_ACQUIRE) < nprocs)
+		usleep(1000);
+	t0 = now();
+	shm_barrier_wait(&sh->start);
+	wait_all(nprocs);
+	sec = now() - t0;
+
+	if (sh->counter != t->expected()) {
+		fprintf(stderr, "%s (%s): counter is %ld, expected %ld\n",
+			t->name, use_pthread ? "pthread" : "shm", sh->counter,
+			t->expected());
+		exit(1);
+	}
+
+	ops = t->ops();
+	printf("%-8s %-8s %6d %12.0f %10.1f\n", t->name,
+		use_pthread ? "pthread" : "shm", nprocs, ops / sec,
+		sec * 1e9 / ops);
+}
+
+/* A child takes the mutex and dies; time how long the parent waits */
+static void
+run_robust(void)
+{
+	double t0;
+	pid_t p;
+	int ret;
+
+	p = fork();
+	if (p < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (p == 0) {
+		lock();
+		_exit(0);
+	}
+	wait_all(1);
+
+	t0 = now();
+	if (use_pthread) {
+		ret = pthread_mutex_lock(&sh->pm) == EOWNERDEAD;
+		if (ret)
+			pthread_mutex_consistent(&sh->pm);
+	} else
+		ret = shm_mutex_lock(&sh->m) == SHM_OWNER_DEAD;
+	printf("%-8s %-8s %6d %12s %10.1f  (owner-dead %s, ns to recover)\n",
+		"robust", use_pthread ? "pthread" : "shm", 2, "-",
+		(now() - t0) * 1e9, ret ? "reported" : "NOT reported");
+	unlock();
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned i;
+
+	nprocs = 4;
+	iters = 200000;
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [<procs> [<iterations>]]\n\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 1)
+		nprocs = atoi(argv[1]);
+	if (argc > 2)
+		iters = atol(argv[2]);
+	if (nprocs < 1 || iters < 100) {
+		fprintf(stderr, "need at least 1 process and 100 iterations\n");
+		exit(1);
+	}
+
+	init_shared();
+
+	/* Make sure nothing buffered is inherited by the children */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("%-8s %-8s %6s %12s %10s\n", "#test", "impl", "procs",
+		"ops/s", "ns/op");
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+		for (use_pthread = 0; use_pthread < 2; use_pthread++)
+			run_test(&tests[i]);
+	for (use_pthread = 0; use_pthread < 2; use_pthread++)
+		run_robust();
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "futex.h"
+#include "shm-sync.h"
+
+/* Spins before sleeping, on machines with more than one CPU */
+#define SPIN_LIMIT 100
+
+/* How often a process sleeping on a mutex checks that the owner lives */
+#define ROBUST_POLL_NSEC 10000000
+
+static int spin_limit;
+static pid_t self;
+
+/* getpid() is a system call; keep our PID, and renew it after fork() */
+static void
+reset_self(void)
+{
+	self = getpid();
+}
+
+static void __attribute__((constructor))
+shm_sync_init(void)
+{
+	/* spinning on a single CPU only delays the owner */
+	spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+	reset_self();
+	pthread_atfork(NULL, NULL, reset_self);
+}
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/******************************************************************************
+ * Mutex
+ */
+
+static int
+owner_dead(struct shm_mutex *m, pid_t *owner)
+{
+	*owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+
+	return *owner != 0 && kill(*owner, 0) < 0 && errno == ESRCH;
+}
+
+int
+shm_mutex_trylock(struct shm_mutex *m)
+{
+	int c = 0;
+
+	if (!__atomic_compare_exchange_n(&m->state, &c, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	__atomic_store_n(&m->owner, self, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+int
+shm_mutex_lock(struct shm_mutex *m)
+{
+	struct timespec poll = { 0, ROBUST_POLL_NSEC };
+	pid_t dead;
+	int i, c;
+
+	if (shm_mutex_trylock(m))
+		return 0;
+	for (i = 0; i < spin_limit; i++) {
+		cpu_relax();
+		if (__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0 &&
+		    shm_mutex_trylock(m))
+			return 0;
+	}
+
+	/* From now on state is 2, so that the unlocker wakes us up */
+	c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		if (futex_wait(&m->state, 2, &poll) < 0 && errno == ETIMEDOUT &&
+		    owner_dead(m, &dead) &&
+		    __atomic_compare_exchange_n(&m->owner, &dead, self, 0,
+			    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			/* only one of the waiters wins the owner CAS */
+			__atomic_store_n(&m->state, 2, __ATOMIC_RELAXED);
+			return SHM_OWNER_DEAD;
+		}
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	}
+	__atomic_store_n(&m->owner, self, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void
+shm_mutex_unlock(struct shm_mutex *m)
+{
+	__atomic_store_n(&m->owner, 0, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+		futex_wake(&m->state, 1);
+}
+
+/******************************************************************************
+ * Condition variable
+ *
+ * seq is read with the mutex held, so a signal sent after the waiter
+ * drops the mutex changes it and the futex_wait() returns at once.
+ * Signals with nobody waiting skip the system call.
+ */
+
+int
+shm_cond_wait(struct shm_cond *c, struct shm_mutex *m)
+{
+	int seq;
+
+	__atomic_add_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+	shm_mutex_unlock(m);
+	futex_wait(&c->seq, seq, NULL);
+	__atomic_sub_fetch(&c->waiters, 1, __ATOMIC_RELAXED);
+
+	return shm_mutex_lock(m);
+}
+
+static void
+cond_wake(struct shm_cond *c, int nr)
+{
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&c->seq, nr);
+}
+
+void
+shm_cond_signal(struct shm_cond *c)
+{
+	cond_wake(c, 1);
+}
+
+void
+shm_cond_broadcast(struct shm_cond *c)
+{
+	cond_wake(c, INT_MAX);
+}
+
+/******************************************************************************
+ * Semaphore
+ *
+ * Sleepers count themselves before their last look at value, posters
+ * look at sleepers after changing value, so a post never misses one.
+ */
+
+void
+shm_sem_init(struct shm_sem *s, int value)
+{
+	s->value = value;
+	s->sleepers = 0;
+}
+
+int
+shm_sem_trywait(struct shm_sem *s)
+{
+	int v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+
+	while (v > 0)
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+
+	return 0;
+}
+
+void
+shm_sem_wait(struct shm_sem *s)
+{
+	int i;
+
+	for (i = 0; i <= spin_limit; i++) {
+		if (shm_sem_trywait(s))
+			return;
+		cpu_relax();
+	}
+
+	__atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (!shm_sem_trywait(s))
+		futex_wait(&s->value, 0, NULL);
+	__atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+void
+shm_sem_post(struct shm_sem *s)
+{
+	__atomic_add_fetch(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&s->value, 1);
+}
+
+/******************************************************************************
+ * Barrier
+ *
+ * The last process to arrive resets arrived and then starts a new
+ * generation, which is what the others sleep on.
+ */
+
+void
+shm_barrier_init(struct shm_barrier *b, int count)
+{
+	b->count = count;
+	b->arrived = 0;
+	b->generation = 0;
+}
+
+int
+shm_barrier_wait(struct shm_barrier *b)
+{
+	int gen, i;
+
+	gen = __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE);
+	if (__atomic_add_fetch(&b->arrived, 1, __ATOMIC_ACQ_REL) == b->count) {
+		__atomic_store_n(&b->arrived, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&b->generation, 1, __ATOMIC_RELEASE);
+		futex_wake(&b->generation, INT_MAX);
+		return 1;
+	}
+
+	for (i = 0; i < spin_limit; i++) {
+		if (__atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) != gen)
+			return 0;
+		cpu_relax();
+	}
+	while (__atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) == gen)
+		futex_wait(&b->generation, gen, NULL);
+
+	return 0;
+}
+
+/******************************************************************************
+ * Reader-writer lock
+ *
+ * Everyone who has to wait sleeps on seq. An unlock that leaves the
+ * lock free bumps seq and wakes all sleepers, if there are any; they
+ * then race for it again.
+ */
+
+static int
+rw_tryrdlock(struct shm_rwlock *rw)
+{
+	int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+	while (s >= 0 &&
+	       __atomic_load_n(&rw->writers_waiting, __ATOMIC_RELAXED) == 0)
+		if (__atomic_compare_exchange_n(&rw->state, &s, s + 1, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+
+	return 0;
+}
+
+static int
+rw_trywrlock(struct shm_rwlock *rw)
+{
+	int s = 0;
+
+	return __atomic_compare_exchange_n(&rw->state, &s, SHM_RW_WRITER, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void
+rw_lock(struct shm_rwlock *rw, int (*try)(struct shm_rwlock *))
+{
+	int i, seq;
+
+	for (i = 0; i <= spin_limit; i++) {
+		if (try(rw))
+			return;
+		cpu_relax();
+	}
+
+	for (;;) {
+		__atomic_add_fetch(&rw->sleepers, 1, __ATOMIC_SEQ_CST);
+		seq = __atomic_load_n(&rw->seq, __ATOMIC_SEQ_CST);
+		if (try(rw)) {
+			__atomic_sub_fetch(&rw->sleepers, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		futex_wait(&rw->seq, seq, NULL);
+		__atomic_sub_fetch(&rw->sleepers, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+shm_rwlock_rdlock(struct shm_rwlock *rw)
+{
+	rw_lock(rw, rw_tryrdlock);
+}
+
+void
+shm_rwlock_wrlock(struct shm_rwlock *rw)
+{
+	__atomic_add_fetch(&rw->writers_waiting, 1, __ATOMIC_RELAXED);
+	rw_lock(rw, rw_trywrlock);
+	__atomic_sub_fetch(&rw->writers_waiting, 1, __ATOMIC_RELAXED);
+}
+
+void
+shm_rwlock_unlock(struct shm_rwlock *rw)
+{
+	int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+	if (s == SHM_RW_WRITER)
+		__atomic_store_n(&rw->state, 0, __ATOMIC_RELEASE);
+	else
+		s = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE);
+
+	if (s == SHM_RW_WRITER || s == 0) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&rw->sleepers, __ATOMIC_RELAXED) != 0) {
+			__atomic_add_fetch(&rw->seq, 1, __ATOMIC_RELEASE);
+			futex_wake(&rw->seq, INT_MAX);
+		}
+	}
+}
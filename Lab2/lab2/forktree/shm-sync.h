@@ -0,0 +1,87 @@
+#ifndef SHM_SYNC_H
+#define SHM_SYNC_H
+
+#include <sys/types.h>
+
+/******************************************************************************
+ * Synchronization between processes, over shared memory and futexes.
+ *
+ * Every object is a few ints in create_shared_memory_area() memory,
+ * initialized to zero (shm_sem and shm_barrier need an init call), so
+ * allocate them before fork(). Uncontended operations are a single atomic
+ * instruction. Under contention a process spins for a short while, on
+ * machines with more than one CPU, and then sleeps on a futex.
+ */
+
+/* Returned by shm_mutex_lock(), as EOWNERDEAD by pthreads */
+#define SHM_OWNER_DEAD 1
+
+/*
+ * Mutex. state is 0 (unlocked), 1 (locked) or 2 (locked, maybe with
+ * sleepers). The owner's PID is kept next to it: a process that has
+ * slept for a while on a mutex whose owner no longer exists takes the
+ * mutex over, and shm_mutex_lock() returns SHM_OWNER_DEAD so that it can
+ * repair the data the mutex protects. (A process that dies between
+ * taking the mutex and recording its PID is not detected, and neither
+ * is an owner whose PID has been reused.)
+ */
+struct shm_mutex {
+	int state;
+	pid_t owner;
+};
+
+int shm_mutex_lock(struct shm_mutex *m);
+int shm_mutex_trylock(struct shm_mutex *m);    /* 1 if taken */
+void shm_mutex_unlock(struct shm_mutex *m);
+
+/* Condition variable, used with a shm_mutex. */
+struct shm_cond {
+	int seq;
+	int waiters;
+};
+
+/* Returns what shm_mutex_lock() returned on the way out. */
+int shm_cond_wait(struct shm_cond *c, struct shm_mutex *m);
+void shm_cond_signal(struct shm_cond *c);
+void shm_cond_broadcast(struct shm_cond *c);
+
+/* Counting semaphore. */
+struct shm_sem {
+	int value;
+	int sleepers;
+};
+
+void shm_sem_init(struct shm_sem *s, int value);
+void shm_sem_wait(struct shm_sem *s);
+int shm_sem_trywait(struct shm_sem *s);        /* 1 if decremented */
+void shm_sem_post(struct shm_sem *s);
+
+/* Barrier for count processes, reusable. */
+struct shm_barrier {
+	int count;
+	int arrived;
+	int generation;
+};
+
+void shm_barrier_init(struct shm_barrier *b, int count);
+/* Returns 1 in exactly one of the processes of each round. */
+int shm_barrier_wait(struct shm_barrier *b);
+
+/*
+ * Reader-writer lock. Writers have priority: once a writer waits,
+ * new readers wait too.
+ */
+#define SHM_RW_WRITER (-1)
+
+struct shm_rwlock {
+	int state;             /* number of readers, or SHM_RW_WRITER */
+	int writers_waiting;
+	int seq;               /* bumped to wake sleepers */
+	int sleepers;
+};
+
+void shm_rwlock_rdlock(struct shm_rwlock *rw);
+void shm_rwlock_wrlock(struct shm_rwlock *rw);
+void shm_rwlock_unlock(struct shm_rwlock *rw);
+
+#endif /* SHM_SYNC_H */
@@ -0,0 +1,503 @@
+/*
+ * tree-eval.c
+ *
+ * Evaluate the expression trees of ask2-pipes without any processes.
+ *
+ * The tree is turned into a DAG, folding constant operands and sharing
+ * identical subtrees (common subexpression elimination). The DAG is then
+ * compiled to bytecode for a small register machine, which is run by a
+ * dispatch loop using computed gotos.
+ *
+ * Leaves are either integer constants or variables named $N, bound to
+ * column N (counting from 1) of every row read from standard input.
+ *
+ * Usage: tree-eval [-d] [-b count] <tree_file>
+ *    -d:       dump the compiled bytecode to stderr
+ *    -b count: evaluate count times with synthetic bindings and
+ *              report the time per evaluation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define MAX_VARS 64
+#define LINE_SIZE 1024
+
+/******************************************************************************
+ * Expression DAG
+ */
+
+enum dag_op { DAG_CONST, DAG_VAR, DAG_ADD, DAG_MUL };
+
+struct dag_node {
+	enum dag_op op;
+	int val;	/* constant value, or variable index */
+	int a, b;	/* operands of DAG_ADD / DAG_MUL */
+	int k;		/* constant folded into DAG_ADD / DAG_MUL, or -1 */
+};
+
+static struct dag_node *dag;
+static int dag_len, dag_size;
+
+/* open addressing hash table of dag indices, for hash-consing */
+static int *hash_tab;
+static unsigned hash_size;
+
+static void *
+safe_realloc(void *p, size_t size)
+{
+	if ((p = realloc(p, size)) == NULL) {
+		fprintf(stderr, "Out of memory, failed to allocate %zd bytes\n",
+			size);
+		exit(1);
+	}
+
+	return p;
+}
+
+static unsigned
+dag_hash(const struct dag_node *n)
+{
+	unsigned h = n->op;
+
+	h = h * 31 + n->val;
+	h = h * 31 + n->a;
+	h = h * 31 + n->b;
+	h = h * 31 + n->k;
+
+	return h * 2654435761u;
+}
+
+static int
+dag_equal(const struct dag_node *x, const struct dag_node *y)
+{
+	return x->op == y->op && x->val == y->val &&
+		x->a == y->a && x->b == y->b && x->k == y->k;
+}
+
+static void
+hash_grow(void)
+{
+	unsigned i, j;
+
+	hash_size = hash_size ? hash_size * 2 : 1024;
+	free(hash_tab);
+	hash_tab = safe_realloc(NULL, hash_size * sizeof(*hash_tab));
+	memset(hash_tab, -1, hash_size * sizeof(*hash_tab));
+
+	for (i = 0; i < dag_len; i++) {
+		j = dag_hash(&dag[i]) & (hash_size - 1);
+		while (hash_tab[j] >= 0)
+			j = (j + 1) & (hash_size - 1);
+		hash_tab[j] = i;
+	}
+}
+
+/* Return the index of an identical node, creating it if needed */
+static int
+dag_intern(enum dag_op op, int val, int a, int b, int k)
+{
+	struct dag_node n = { op, val, a, b, k };
+	unsigned j;
+
+	if (2 * (dag_len + 1) > hash_size)
+		hash_grow();
+
+	j = dag_hash(&n) & (hash_size - 1);
+	while (hash_tab[j] >= 0) {
+		if (dag_equal(&dag[hash_tab[j]], &n))
+			return hash_tab[j];
+		j = (j + 1) & (hash_size - 1);
+	}
+
+	if (dag_len == dag_size) {
+		dag_size = dag_size ? dag_size * 2 : 1024;
+		dag = safe_realloc(dag, dag_size * sizeof(*dag));
+	}
+	dag[dag_len] = n;
+	hash_tab[j] = dag_len;
+
+	return dag_len++;
+}
+
+static int
+dag_const(int val)
+{
+	return dag_intern(DAG_CONST, val, -1, -1, -1);
+}
+
+static int
+cmp_int(const void *x, const void *y)
+{
+	return *(const int *)x - *(const int *)y;
+}
+
+/*
+ * Build the DAG for a tree node, bottom up.
+ *
+ * Constant operands of an operator are folded into a single constant.
+ * The other operands are sorted, so that a + b and b + a end up
+ * as the same node, and chained into binary operations.
+ */
+static int
+dag_build(struct tree_node *node, int *nvars)
+{
+	enum dag_op op;
+	int ops[node->nr_children];
+	int i, n, acc, c;
+
+	if (node->nr_children == 0) {
+		if (node->name[0] == '$') {
+			i = atoi(node->name + 1);
+			if (i < 1 || i > MAX_VARS) {
+				fprintf(stderr, "%s: bad variable name\n", node->name);
+				exit(1);
+			}
+			if (i > *nvars)
+				*nvars = i;
+			return dag_intern(DAG_VAR, i - 1, -1, -1, -1);
+		}
+		return dag_const(atoi(node->name));
+	}
+
+	if (strcmp(node->name, "+") == 0)
+		op = DAG_ADD;
+	else if (strcmp(node->name, "*") == 0)
+		op = DAG_MUL;
+	else {
+		fprintf(stderr, "%s: unknown operator\n", node->name);
+		exit(1);
+	}
+
+	c = (op == DAG_ADD) ? 0 : 1;
+	for (i = n = 0; i < node->nr_children; i++) {
+		acc = dag_build(node->children + i, nvars);
+		if (dag[acc].op == DAG_CONST)
+			c = (op == DAG_ADD) ? c + dag[acc].val : c * dag[acc].val;
+		else
+			ops[n++] = acc;
+	}
+
+	if (n == 0 || (op == DAG_MUL && c == 0))
+		return dag_const(c);
+
+	qsort(ops, n, sizeof(ops[0]), cmp_int);
+	acc = ops[0];
+	for (i = 1; i < n; i++)
+		acc = dag_intern(op, 0, acc, ops[i], -1);
+
+	/* x + 0 and x * 1 need no instruction */
+	if (c != ((op == DAG_ADD) ? 0 : 1))
+		acc = dag_intern(op, 0, acc, -1, c);
+
+	return acc;
+}
+
+/******************************************************************************
+ * Register machine
+ */
+
+enum vm_op { VM_LOADK, VM_LOADV, VM_ADD, VM_MUL, VM_ADDK, VM_MULK, VM_RET };
+
+static const char *vm_op_names[] = {
+	"loadk", "loadv", "add", "mul", "addk", "mulk", "ret"
+};
+
+struct insn {
+	uint16_t op;
+	uint16_t dst;
+	uint16_t a;
+	uint16_t b;
+	int32_t k;
+};
+
+struct program {
+	struct insn *code;
+	int len;
+	int nregs;
+	int nvars;
+};
+
+/*
+ * Compile the live part of the DAG rooted at root.
+ *
+ * DAG nodes are created after their operands, so walking them in index
+ * order is a valid schedule. Registers are freed after the last use of
+ * the value they hold, which keeps the register file small.
+ */
+static void
+compile(int root, struct program *prog)
+{
+	int *live, *last_use, *reg, *free_regs;
+	int i, nfree = 0, next_reg = 0;
+	struct insn *in;
+
+	live = calloc(dag_len, sizeof(int));
+	last_use = calloc(dag_len, sizeof(int));
+	reg = calloc(dag_len, sizeof(int));
+	free_regs = calloc(dag_len, sizeof(int));
+	prog->code = calloc(dag_len + 1, sizeof(struct insn));
+	if (!live || !last_use || !reg || !free_regs || !prog->code) {
+		fprintf(stderr, "compile: out of memory\n");
+		exit(1);
+	}
+
+	live[root] = 1;
+	last_use[root] = dag_len;
+	for (i = root; i >= 0; i--) {
+		if (!live[i])
+			continue;
+		if (dag[i].a >= 0) {
+			live[dag[i].a] = 1;
+			if (last_use[dag[i].a] < i)
+				last_use[dag[i].a] = i;
+		}
+		if (dag[i].b >= 0) {
+			live[dag[i].b] = 1;
+			if (last_use[dag[i].b] < i)
+				last_use[dag[i].b] = i;
+		}
+	}
+
+	prog->len = 0;
+	for (i = 0; i <= root; i++) {
+		if (!live[i])
+			continue;
+
+		in = &prog->code[prog->len++];
+		switch (dag[i].op) {
+		case DAG_CONST:
+			in->op = VM_LOADK;
+			in->k = dag[i].val;
+			break;
+		case DAG_VAR:
+			in->op = VM_LOADV;
+			in->a = dag[i].val;
+			break;
+		case DAG_ADD:
+		case DAG_MUL:
+			in->a = reg[dag[i].a];
+			if (dag[i].b >= 0) {
+				in->op = (dag[i].op == DAG_ADD) ? VM_ADD : VM_MUL;
+				in->b = reg[dag[i].b];
+			} else {
+				in->op = (dag[i].op == DAG_ADD) ? VM_ADDK : VM_MULK;
+				in->k = dag[i].k;
+			}
+			break;
+		}
+
+		/* operands whose last use is this instruction give back
+		 * their registers, which the result may reuse right away */
+		if (dag[i].a >= 0 && last_use[dag[i].a] == i)
+			free_regs[nfree++] = reg[dag[i].a];
+		if (dag[i].b >= 0 && dag[i].b != dag[i].a &&
+		    last_use[dag[i].b] == i)
+			free_regs[nfree++] = reg[dag[i].b];
+
+		reg[i] = nfree ? free_regs[--nfree] : next_reg++;
+		in->dst = reg[i];
+	}
+
+	if (next_reg > UINT16_MAX) {
+		fprintf(stderr, "compile: expression needs too many registers\n");
+		exit(1);
+	}
+
+	in = &prog->code[prog->len++];
+	in->op = VM_RET;
+	in->a = reg[root];
+	prog->nregs = next_reg;
+
+	free(live);
+	free(last_use);
+	free(reg);
+	free(free_regs);
+}
+
+static void
+dump_program(const struct program *prog)
+{
+	int i;
+	const struct insn *in;
+
+	fprintf(stderr, "%d instructions, %d registers, %d variables\n",
+		prog->len, prog->nregs, prog->nvars);
+	for (i = 0; i < prog->len; i++) {
+		in = &prog->code[i];
+		fprintf(stderr, "%4d: %-6s", i, vm_op_names[in->op]);
+		switch (in->op) {
+		case VM_LOADK:
+			fprintf(stderr, "r%d, %d\n", in->dst, in->k);
+			break;
+		case VM_LOADV:
+			fprintf(stderr, "r%d, $%d\n", in->dst, in->a + 1);
+			break;
+		case VM_ADD:
+		case VM_MUL:
+			fprintf(stderr, "r%d, r%d, r%d\n", in->dst, in->a, in->b);
+			break;
+		case VM_ADDK:
+		case VM_MULK:
+			fprintf(stderr, "r%d, r%d, %d\n", in->dst, in->a, in->k);
+			break;
+		case VM_RET:
+			fprintf(stderr, "r%d\n", in->a);
+			break;
+		}
+	}
+}
+
+/*
+ * Run a program. Every handler jumps straight to the handler of the
+ * next instruction, there is no central switch to go back to.
+ */
+static int
+run(const struct insn *pc, int *restrict r, const int *restrict vars)
+{
+	static void *dispatch[] = {
+		[VM_LOADK] = &&do_loadk, [VM_LOADV] = &&do_loadv,
+		[VM_ADD] = &&do_add, [VM_MUL] = &&do_mul,
+		[VM_ADDK] = &&do_addk, [VM_MULK] = &&do_mulk,
+		[VM_RET] = &&do_ret,
+	};
+
+#define NEXT() goto *dispatch[(++pc)->op]
+
+	goto *dispatch[pc->op];
+
+do_loadk:
+	r[pc->dst] = pc->k;
+	NEXT();
+do_loadv:
+	r[pc->dst] = vars[pc->a];
+	NEXT();
+do_add:
+	r[pc->dst] = r[pc->a] + r[pc->b];
+	NEXT();
+do_mul:
+	r[pc->dst] = r[pc->a] * r[pc->b];
+	NEXT();
+do_addk:
+	r[pc->dst] = r[pc->a] + pc->k;
+	NEXT();
+do_mulk:
+	r[pc->dst] = r[pc->a] * pc->k;
+	NEXT();
+do_ret:
+	return r[pc->a];
+
+#undef NEXT
+}
+
+/* Parse up to n whitespace separated integers from line */
+static int
+parse_row(char *line, int *vars, int n)
+{
+	char *tok, *save;
+	int i;
+
+	tok = strtok_r(line, " \t\n", &save);
+	for (i = 0; tok != NULL && i < n; i++) {
+		vars[i] = atoi(tok);
+		tok = strtok_r(NULL, " \t\n", &save);
+	}
+
+	return i;
+}
+
+static void
+usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-d] [-b count] <tree_file>\n\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, dump = 0, root, i;
+	long count = 0, n;
+	int vars[MAX_VARS] = { 0 };
+	int *regs;
+	char line[LINE_SIZE];
+	struct tree_node *tree;
+	struct program prog;
+	struct timespec start, end;
+	double ns;
+	unsigned sum;
+
+	while ((opt = getopt(argc, argv, "db:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dump = 1;
+			break;
+		case 'b':
+			count = atol(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	tree = get_tree_from_file(argv[optind]);
+	if (tree == NULL) {
+		fprintf(stderr, "%s: empty tree\n", argv[optind]);
+		exit(1);
+	}
+
+	prog.nvars = 0;
+	root = dag_build(tree, &prog.nvars);
+	compile(root, &prog);
+	regs = calloc(prog.nregs + 1, sizeof(int));
+	if (regs == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (dump) {
+		fprintf(stderr, "%u tree nodes, %d dag nodes\n",
+			tree_count_nodes(tree), dag_len);
+		dump_program(&prog);
+	}
+
+	if (count > 0) {
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < count; n++) {
+			for (i = 0; i < prog.nvars; i++)
+				vars[i] = n + i;
+			sum += run(prog.code, regs, vars);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (end.tv_sec - start.tv_sec) * 1e9 +
+			(end.tv_nsec - start.tv_nsec);
+		printf("%ld evaluations, %.2f ns per evaluation (checksum %u)\n",
+			count, ns / count, sum);
+		return 0;
+	}
+
+	if (prog.nvars == 0) {
+		printf("%d\n", run(prog.code, regs, vars));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (parse_row(line, vars, prog.nvars) < prog.nvars) {
+			fprintf(stderr, "expecting %d columns\n", prog.nvars);
+			exit(1);
+		}
+		printf("%d\n", run(prog.code, regs, vars));
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "proc-common.h"
+#include "tree-stats.h"
+
+struct node_stats *
+create_tree_stats(struct tree_node *root)
+{
+	/* anonymous shared mappings are zero-filled */
+	return create_shared_memory_area(tree_count_nodes(root) *
+		sizeof(struct node_stats));
+}
+
+unsigned
+tree_stats_child(struct tree_node *node, unsigned idx, unsigned i)
+{
+	unsigned j;
+
+	idx++;
+	for (j = 0; j < i; j++)
+		idx += tree_count_nodes(node->children + j);
+
+	return idx;
+}
+
+void
+tree_stats_spawn(struct node_stats *st)
+{
+	clock_gettime(CLOCK_MONOTONIC, &st->spawn);
+}
+
+void
+tree_stats_exit(struct node_stats *st)
+{
+	getrusage(RUSAGE_SELF, &st->self);
+	clock_gettime(CLOCK_MONOTONIC, &st->exit);
+}
+
+pid_t
+tree_stats_wait(struct node_stats *stats, struct tree_node *node,
+	unsigned idx, pid_t pid, int *status, int options)
+{
+	struct rusage ru;
+	unsigned i, c;
+	pid_t p;
+
+	p = wait4(pid, status, options, &ru);
+	if (p < 0) {
+		perror("wait4");
+		exit(1);
+	}
+	if (p == 0)
+		return 0;
+
+	/*
+	 * The PIDs are stored by the parent after fork(), so only
+	 * the children of this node need to be searched.
+	 */
+	if (node == NULL) {
+		stats[0].subtree = ru;
+		return p;
+	}
+	for (i = 0, c = idx + 1; i < node->nr_children;
+	     c += tree_count_nodes(node->children + i), i++)
+		if (stats[c].pid == p) {
+			stats[c].subtree = ru;
+			break;
+		}
+
+	return p;
+}
+
+static double
+tv_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double
+lifetime_ms(struct node_stats *st)
+{
+	return (st->exit.tv_sec - st->spawn.tv_sec) * 1e3 +
+		(st->exit.tv_nsec - st->spawn.tv_nsec) / 1e6;
+}
+
+static void
+print_usage(FILE *fp, struct rusage *ru)
+{
+	fprintf(fp, "%.3fu %.3fs %ldK %ld/%ldcs %ld/%ldflt",
+		tv_sec(&ru->ru_utime), tv_sec(&ru->ru_stime), ru->ru_maxrss,
+		ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+}
+
+static void
+print_usage_json(FILE *fp, struct rusage *ru)
+{
+	fprintf(fp, "{\"utime\": %.6f, \"stime\": %.6f, \"maxrss_kb\": %ld, "
+		"\"nvcsw\": %ld, \"nivcsw\": %ld, \"minflt\": %ld, \"majflt\": %ld}",
+		tv_sec(&ru->ru_utime), tv_sec(&ru->ru_stime), ru->ru_maxrss,
+		ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+}
+
+static unsigned
+__print_tree_stats(FILE *fp, struct tree_node *node, struct node_stats *stats,
+	unsigned idx, int level)
+{
+	struct node_stats *st = &stats[idx];
+	unsigned i, next = idx + 1;
+
+	for (i = 0; i < level; i++)
+		fprintf(fp, "\t");
+	fprintf(fp, "%s (%ld): self ", node->name, (long)st->pid);
+	print_usage(fp, &st->self);
+	fprintf(fp, ", subtree ");
+	print_usage(fp, &st->subtree);
+	fprintf(fp, ", %.1f ms\n", lifetime_ms(st));
+
+	for (i = 0; i < node->nr_children; i++)
+		next = __print_tree_stats(fp, node->children + i, stats, next,
+			level + 1);
+
+	return next;
+}
+
+static unsigned
+__print_tree_stats_json(FILE *fp, struct tree_node *node,
+	struct node_stats *stats, unsigned idx)
+{
+	struct node_stats *st = &stats[idx];
+	unsigned i, next = idx + 1;
+
+	fprintf(fp, "{\"name\": ");
+	print_json_string(fp, node->name);
+	fprintf(fp, ", \"pid\": %ld, \"lifetime_ms\": %.3f, \"self\": ",
+		(long)st->pid, lifetime_ms(st));
+	print_usage_json(fp, &st->self);
+	fprintf(fp, ", \"subtree\": ");
+	print_usage_json(fp, &st->subtree);
+	fprintf(fp, ", \"children\": [");
+	for (i = 0; i < node->nr_children; i++) {
+		if (i > 0)
+			fprintf(fp, ", ");
+		next = __print_tree_stats_json(fp, node->children + i, stats,
+			next);
+	}
+	fprintf(fp, "]}");
+
+	return next;
+}
+
+/*
+ * Columns: user and system CPU seconds, max RSS,
+ * voluntary/involuntary context switches, minor/major page faults,
+ * then the time from fork() to exit().
+ */
+void
+print_tree_stats(FILE *fp, struct tree_node *root, struct node_stats *stats,
+	int json)
+{
+	if (json) {
+		__print_tree_stats_json(fp, root, stats, 0);
+		fprintf(fp, "\n");
+	} else
+		__print_tree_stats(fp, root, stats, 0, 0);
+	fflush(fp);
+}
@@ -0,0 +1,51 @@
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "tree.h"
+
+/******************************************************************************
+ * Per-node resource accounting for process trees.
+ *
+ * There is one record per tree node, in DFS (preorder) order, in memory
+ * shared by the whole process tree: the root is record 0 and the first
+ * child of node i is record i + 1.
+ */
+
+struct node_stats {
+	pid_t pid;
+	struct timespec spawn;   /* set by the parent, right before fork() */
+	struct timespec exit;    /* set by the node, right before exit() */
+	struct rusage self;      /* getrusage(RUSAGE_SELF) of the node at exit */
+	struct rusage subtree;   /* from wait4(): the node and its descendants */
+};
+
+/* Create zeroed records for every node of the tree. */
+struct node_stats *create_tree_stats(struct tree_node *root);
+
+/* Index of the i-th child of the node with index idx. */
+unsigned tree_stats_child(struct tree_node *node, unsigned idx, unsigned i);
+
+/* Record the spawn time of a node; call in the parent before fork(). */
+void tree_stats_spawn(struct node_stats *st);
+
+/* Record the exit time and own usage of a node; call right before exit(). */
+void tree_stats_exit(struct node_stats *st);
+
+/*
+ * wait4() for a child (pid, or -1 for any) of the node with index idx
+ * and store its subtree usage. If node is NULL, the child is the root.
+ * options are passed to wait4(); with WNOHANG, 0 means none has exited.
+ */
+pid_t tree_stats_wait(struct node_stats *stats, struct tree_node *node,
+	unsigned idx, pid_t pid, int *status, int options);
+
+/* print_tree(), with every node annotated with its cost; or JSON. */
+void print_tree_stats(FILE *fp, struct tree_node *root,
+	struct node_stats *stats, int json);
+
+#endif /* TREE_STATS_H */
@@ -29,6 +29,17 @@ print_tree(struct tree_node *root)
 	__print_tree(root, 0);
 }
 
+unsigned
+tree_count_nodes(struct tree_node *root)
+{
+	unsigned i, cnt = 1;
+
+	for (i=0; i < root->nr_children; i++)
+		cnt += tree_count_nodes(root->children + i);
+
+	return cnt;
+}
+
 static char *
 read_line(FILE *file, char *buff, size_t buff_size)
 {
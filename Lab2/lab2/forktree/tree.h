@@ -23,4 +23,7 @@ struct tree_node *get_tree_from_file(const char *filename);
 
 void print_tree(struct tree_node *root);
 
+/* returns the number of nodes in the subtree rooted at root */
+unsigned tree_count_nodes(struct tree_node *root);
+
 #endif /* TREE_H */
@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# bench-counters.sh
+#
+# Scaling curves of the simplesync variants: the time per update of the
+# shared variable, for a growing number of threads, as CSV.
+#
+# Usage: ./bench-counters.sh [thread_count ...]
+#
+
+# By default 2, 4, 8, ... threads, up to two per online CPU
+THREADS=$@
+if [ -z "$THREADS" ]; then
+	MAX=$((2 * $(getconf _NPROCESSORS_ONLN)))
+	for ((t = 2; t < MAX; t *= 2)); do
+		THREADS="$THREADS $t"
+	done
+	THREADS="$THREADS $MAX"
+fi
+ITERATIONS=${ITERATIONS:-2000000}
+
+echo "variant,threads,seconds,ns_per_update"
+for n in $THREADS; do
+	for v in mutex atomic sharded percpu approx; do
+		./simplesync-$v $n $ITERATIONS 2>&1 >/dev/null |
+		awk -v v=$v '/ns per update/ { print v "," $1 "," $3 "," $5 }'
+	done
+done
@@ -0,0 +1,195 @@
+/*
+ * counters.h
+ *
+ * Shared counters that scale with the number of threads updating them,
+ * by not having all of them write the same cache line:
+ *
+ *   sharded   one cache-line-sized shard per thread; a thread only ever
+ *             writes its own, and a read sums them all.
+ *   percpu    one shard per CPU, picked with sched_getcpu(). Threads
+ *             running on the same CPU share a shard, and one may be
+ *             migrated between picking a shard and writing it, so the
+ *             update is atomic, but the line stays in that CPU's cache.
+ *   approx    a global value plus a per-thread delta, which is folded
+ *             into the global one whenever it reaches the threshold.
+ *             Reading the global value is as cheap as reading a single
+ *             counter, and it is off by less than threads * threshold.
+ *
+ * Reads may run concurrently with updates, and see a value that was
+ * true at some point during the read. approx_counter_sync() must only
+ * be called once the updating threads have stopped.
+ */
+
+#ifndef COUNTERS_H__
+#define COUNTERS_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define COUNTER_CACHE_LINE 64
+
+struct counter_shard {
+	long value;
+} __attribute__((aligned(COUNTER_CACHE_LINE)));
+
+static inline struct counter_shard *
+counter_alloc_shards(int n)
+{
+	struct counter_shard *s;
+
+	if (posix_memalign((void **)&s, COUNTER_CACHE_LINE,
+			n * sizeof(*s)) != 0) {
+		fprintf(stderr, "Out of memory, failed to allocate %d shards\n", n);
+		exit(1);
+	}
+	while (n-- > 0)
+		s[n].value = 0;
+
+	return s;
+}
+
+static inline long
+counter_sum_shards(struct counter_shard *s, int n)
+{
+	long sum = 0;
+
+	while (n-- > 0)
+		sum += __atomic_load_n(&s[n].value, __ATOMIC_RELAXED);
+
+	return sum;
+}
+
+/******************************************************************************
+ * Per-thread shards. id is in [0, nthreads) and unique to the thread.
+ */
+struct sharded_counter {
+	int nshards;
+	struct counter_shard *shard;
+};
+
+static inline void
+sharded_counter_init(struct sharded_counter *c, int nthreads)
+{
+	c->nshards = nthreads;
+	c->shard = counter_alloc_shards(nthreads);
+}
+
+static inline void
+sharded_counter_add(struct sharded_counter *c, int id, long delta)
+{
+	struct counter_shard *s = &c->shard[id];
+
+	/* We are the only writer; the atomic store is for the readers */
+	__atomic_store_n(&s->value, s->value + delta, __ATOMIC_RELAXED);
+}
+
+static inline long
+sharded_counter_read(struct sharded_counter *c)
+{
+	return counter_sum_shards(c->shard, c->nshards);
+}
+
+static inline void
+sharded_counter_destroy(struct sharded_counter *c)
+{
+	free(c->shard);
+}
+
+/******************************************************************************
+ * Per-CPU shards.
+ */
+struct percpu_counter {
+	int nshards;
+	struct counter_shard *shard;
+};
+
+static inline void
+percpu_counter_init(struct percpu_counter *c)
+{
+	c->nshards = sysconf(_SC_NPROCESSORS_CONF);
+	if (c->nshards < 1)
+		c->nshards = 1;
+	c->shard = counter_alloc_shards(c->nshards);
+}
+
+static inline void
+percpu_counter_add(struct percpu_counter *c, long delta)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || cpu >= c->nshards)
+		cpu = 0;
+	__atomic_add_fetch(&c->shard[cpu].value, delta, __ATOMIC_RELAXED);
+}
+
+static inline long
+percpu_counter_read(struct percpu_counter *c)
+{
+	return counter_sum_shards(c->shard, c->nshards);
+}
+
+static inline void
+percpu_counter_destroy(struct percpu_counter *c)
+{
+	free(c->shard);
+}
+
+/******************************************************************************
+ * Approximate counter, with a per-thread delta of less than threshold.
+ */
+struct approx_counter {
+	struct counter_shard global;
+	long threshold;
+	int nthreads;
+	struct counter_shard *local;
+};
+
+static inline void
+approx_counter_init(struct approx_counter *c, int nthreads, long threshold)
+{
+	c->global.value = 0;
+	c->threshold = threshold;
+	c->nthreads = nthreads;
+	c->local = counter_alloc_shards(nthreads);
+}
+
+static inline void
+approx_counter_add(struct approx_counter *c, int id, long delta)
+{
+	struct counter_shard *l = &c->local[id];
+	long v = l->value + delta;
+
+	if (v >= c->threshold || v <= -c->threshold) {
+		__atomic_add_fetch(&c->global.value, v, __ATOMIC_RELAXED);
+		v = 0;
+	}
+	l->value = v;
+}
+
+static inline long
+approx_counter_read(struct approx_counter *c)
+{
+	return __atomic_load_n(&c->global.value, __ATOMIC_RELAXED);
+}
+
+/* Fold every thread's delta in, so that the global value is exact */
+static inline void
+approx_counter_sync(struct approx_counter *c)
+{
+	int i;
+
+	for (i = 0; i < c->nthreads; i++) {
+		c->global.value += c->local[i].value;
+		c->local[i].value = 0;
+	}
+}
+
+static inline void
+approx_counter_destroy(struct approx_counter *c)
+{
+	free(c->local);
+}
+
+#endif /* COUNTERS_H__ */
@@ -19,11 +19,17 @@
 #include <time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "trace.h"
+#include "vtsim.h"
+
 /* 
  * POSIX thread functions do not return error numbers in errno,
  * but in the actual return value of the function call instead.
@@ -32,6 +38,65 @@
 #define perror_pthread(ret, msg) \
 	do { errno = ret; perror(msg); } while (0)
 
+/*
+ * Simulation mode (-s seed): the threads run on the virtual clock of
+ * vtsim.c instead of sleeping, for sim_ops_limit enter/exit operations.
+ * See sim_report() for what is reported.
+ */
+static int sim_mode;
+static long sim_ops, sim_ops_limit = 1000000;
+static long sim_violations;
+
+/*
+ * Every state change is recorded in the thread's trace ring (trace.h),
+ * and printed to stderr as it happens only with -v. The rings are
+ * dumped at the end of a simulation, or when a real run is interrupted.
+ * Each child event is followed by its teacher version, see EV_ROLE().
+ */
+enum {
+	EV_START,
+	EV_VERIFY,
+	EV_CHILD_ENTERING, EV_TEACHER_ENTERING,
+	EV_CHILD_ENTERED, EV_TEACHER_ENTERED,
+	EV_CHILD_EXITING, EV_TEACHER_EXITING,
+	EV_CHILD_EXITED, EV_TEACHER_EXITED,
+	EV_END
+};
+
+#define EV_ROLE(thr, ev) ((ev) + !(thr)->is_child)
+
+static const struct trace_type kg_events[] = {
+	[EV_START] = { "start", 'i', "Thread %d of %d. START.", { NULL } },
+	[EV_VERIFY] = { "kindergarten", 'C',
+		"            Thread %d: Teachers: %d, Children: %d",
+		{ "teachers", "children" } },
+	[EV_CHILD_ENTERING] = { "enter", 'B', "Thread %d [Child]: Entering.", { NULL } },
+	[EV_TEACHER_ENTERING] = { "enter", 'B', "Thread %d [Teacher]: Entering.", { NULL } },
+	[EV_CHILD_ENTERED] = { "enter", 'E', "Thread %d [Child]: Entered.", { NULL } },
+	[EV_TEACHER_ENTERED] = { "enter", 'E', "Thread %d [Teacher]: Entered.", { NULL } },
+	[EV_CHILD_EXITING] = { "exit", 'B', "Thread %d [Child]: Exiting.", { NULL } },
+	[EV_TEACHER_EXITING] = { "exit", 'B', "Thread %d [Teacher]: Exiting.", { NULL } },
+	[EV_CHILD_EXITED] = { "exit", 'E', "Thread %d [Child]: Exited.", { NULL } },
+	[EV_TEACHER_EXITED] = { "exit", 'E', "Thread %d [Teacher]: Exited.", { NULL } },
+	[EV_END] = { "end", 'i', "Thread %d of %d. END.", { NULL } },
+};
+
+static struct trace *trace;
+static int verbose;
+static unsigned long trace_events = 1024;      /* per thread */
+static char *trace_text, *trace_json;          /* where to dump */
+
+/* Waiting times, in microseconds, in power-of-two buckets */
+#define WAIT_BUCKETS 64
+
+struct wait_hist {
+	long count;
+	unsigned long max;
+	long bucket[WAIT_BUCKETS];
+};
+
+static struct wait_hist child_enter_wait, teacher_exit_wait;
+
 /* A virtual kindergarten */
 struct kgarten_struct {
 
@@ -40,7 +105,34 @@ struct kgarten_struct {
 	 * you may need.
 	 */
 
-	/* ... */
+	/*
+	 * Children wait on child_cond for room, teachers on teacher_cond
+	 * for leaving not to break the ratio; both under mutex. Keeping
+	 * them apart, and counting who waits, lets every state change
+	 * signal only the threads it may let through.
+	 */
+	pthread_cond_t child_cond;
+	pthread_cond_t teacher_cond;
+	int child_waiters;
+	int teacher_waiters;
+
+	/* What the condition variables are in simulation mode */
+	struct vtsim_waitq child_q;
+	struct vtsim_waitq teacher_q;
+
+	/*
+	 * vt << 32 | vc, stored under mutex after every change, so that
+	 * verify() reads a consistent pair with a single load, unlocked.
+	 */
+	uint64_t state;
+
+	/* POLICY_*, and for POLICY_FIFO tickets and a slot per thread */
+	int policy;
+	unsigned long next_ticket, serving;
+	int nslots;
+	pthread_cond_t *slot_cond;
+	struct vtsim_waitq *slot_q;
+	int *slot_is_child;
 
 	/*
 	 * You may NOT modify anything in the structure below this
@@ -66,6 +158,15 @@ struct thread_info_struct {
 	int thrid;     /* Application-defined thread id */
 	int thrcnt;
 	unsigned int rseed;
+
+	struct trace_ring *trace;
+	unsigned long reads;    /* by a reader of the -b benchmark */
+
+	/* Times waited to get in and out, in us, under kg->mutex */
+	long enters, exits;
+	unsigned long enter_wait, exit_wait, max_wait;
+	int waiting;            /* blocked in admit() since wait_start */
+	unsigned long wait_start;
 };
 
 int safe_atoi(char *s, int *val)
@@ -96,12 +197,29 @@ void *safe_malloc(size_t size)
 
 void usage(char *argv0)
 {
-	fprintf(stderr, "Usage: %s thread_count child_threads c_t_ratio\n\n"
-		"Exactly two argument required:\n"
+	fprintf(stderr, "Usage: %s [-s seed [-n ops]] [-p policy] [-v] [-t file] [-j file]\n"
+		"       [-e events] [-b max_readers] thread_count child_threads c_t_ratio\n\n"
+		"Exactly three arguments required:\n"
 		"    thread_count: Total number of threads to create.\n"
 		"    child_threads: The number of threads simulating children.\n"
-		"    c_t_ratio: The allowed ratio of children to teachers.\n\n",
-		argv0);
+		"    c_t_ratio: The allowed ratio of children to teachers.\n\n"
+		"Options:\n"
+		"    -s seed: Simulate, on a virtual clock, with the interleaving\n"
+		"             given by seed, instead of running for real.\n"
+		"    -n ops: Stop the simulation after ops enter/exit operations\n"
+		"            (default %ld).\n"
+		"    -p policy: Who goes first among children waiting to enter\n"
+		"            and teachers waiting to leave: child (default),\n"
+		"            teacher, or fifo for first come, first served.\n"
+		"    -v: Print every event to stderr as it happens.\n"
+		"    -t file, -j file: Dump the trace to file, as text or as\n"
+		"            Chrome trace JSON, at the end of the simulation or\n"
+		"            on SIGINT / SIGTERM.\n"
+		"    -e events: Keep the last events of each thread (default %lu).\n"
+		"    -b max_readers: Benchmark verify()'s read of the state,\n"
+		"            locked and lock-free, with up to max_readers readers\n"
+		"            while the teacher threads enter and leave.\n\n",
+		argv0, sim_ops_limit, trace_events);
 	exit(1);
 }
 
@@ -148,23 +266,289 @@ void bad_thing(int thrid, int children, int teachers)
 	printf("%s", buf);
 }
 
+/*
+ * The blocking operations, real or simulated.
+ */
+static unsigned long kg_clock_ns(void)
+{
+	struct timespec ts;
+
+	if (sim_mode)
+		return vtsim_now() * 1000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long kg_clock(void)
+{
+	return kg_clock_ns() / 1000;
+}
+
+static void kg_trace(struct thread_info_struct *thr, int type, int a, int b)
+{
+	struct trace_event e = { kg_clock_ns(), type, thr->thrid, { a, b } };
+
+	trace_record(thr->trace, e.ts_ns, type, thr->thrid, a, b);
+	if (verbose)
+		trace_print_event(trace, &e, stderr);
+}
+
+static void kg_sleep(unsigned long us)
+{
+	if (sim_mode)
+		vtsim_sleep(us);
+	else
+		usleep(us);
+}
+
+static void kg_wait(struct kgarten_struct *kg, pthread_cond_t *cond,
+	struct vtsim_waitq *q)
+{
+	if (sim_mode) {
+		pthread_mutex_unlock(&kg->mutex);
+		vtsim_block(q);
+		pthread_mutex_lock(&kg->mutex);
+	} else
+		pthread_cond_wait(cond, &kg->mutex);
+}
+
+static void kg_signal(pthread_cond_t *cond, struct vtsim_waitq *q)
+{
+	if (sim_mode)
+		vtsim_wake_one(q);
+	else
+		pthread_cond_signal(cond);
+}
+
+/* Called with kg->mutex held */
+static void wait_hist_add(struct wait_hist *h, unsigned long us)
+{
+	int b = us ? 64 - __builtin_clzl(us) : 0;
+
+	h->count++;
+	h->bucket[b < WAIT_BUCKETS ? b : WAIT_BUCKETS - 1]++;
+	if (us > h->max)
+		h->max = us;
+}
+
+/* The upper bound of the bucket the p-th percentile falls in */
+static unsigned long wait_hist_percentile(struct wait_hist *h, double p)
+{
+	long seen = 0;
+	int b;
+
+	for (b = 0; b < WAIT_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen > h->count * p)
+			break;
+	}
+
+	return b ? (1UL << b) - 1 : 0;
+}
+
+static void sim_count_op(void)
+{
+	if (sim_mode && ++sim_ops == sim_ops_limit)
+		vtsim_stop();
+}
+
+/* Called with kg->mutex held, after changing vt or vc */
+static void publish_state(struct kgarten_struct *kg)
+{
+	__atomic_store_n(&kg->state,
+		(uint64_t)(unsigned int)kg->vt << 32 | (unsigned int)kg->vc,
+		__ATOMIC_RELEASE);
+}
+
+static void read_state(struct kgarten_struct *kg, int *t, int *c)
+{
+	uint64_t s = __atomic_load_n(&kg->state, __ATOMIC_ACQUIRE);
+
+	*t = (int)(s >> 32);
+	*c = (int)(unsigned int)s;
+}
+
+/*
+ * Admission control. All of these are called with kg->mutex held.
+ *
+ * Children block to enter and teachers to exit; the policy decides,
+ * among those whose turn would keep the ratio, who goes first:
+ *
+ *   child    children never wait for teachers, and a teacher does not
+ *            leave while children wait for room
+ *   teacher  no child enters while a teacher waits to leave, so the
+ *            children inside drain out and the teacher can go
+ *   fifo     whoever blocked first goes first: each blocking request
+ *            takes a ticket and waits on the slot of its ticket
+ *
+ * A woken thread re-checks its condition, since a thread that was not
+ * waiting may have taken the room first; one that gets in passes any
+ * room left on to the next waiter. So a state change only needs to
+ * signal as many waiters as it can let through, never all of them.
+ */
+enum { POLICY_CHILD, POLICY_TEACHER, POLICY_FIFO };
+
+static const char *policy_names[] = { "child", "teacher", "fifo" };
+
+static int child_can_enter(struct kgarten_struct *kg)
+{
+	return kg->vc < kg->vt * kg->ratio;
+}
+
+static int teacher_can_exit(struct kgarten_struct *kg)
+{
+	return kg->vc <= (kg->vt - 1) * kg->ratio;
+}
+
+/* Whether the policy lets a child in (is_child) or a teacher out now */
+static int may_go(struct kgarten_struct *kg, int is_child)
+{
+	if (is_child)
+		return child_can_enter(kg) &&
+			!(kg->policy == POLICY_TEACHER && kg->teacher_waiters > 0);
+	return teacher_can_exit(kg) &&
+		!(kg->policy == POLICY_CHILD && kg->child_waiters > 0);
+}
+
+static void wake_children(struct kgarten_struct *kg, int room)
+{
+	int n;
+
+	if (!may_go(kg, 1))
+		return;
+	n = kg->vt * kg->ratio - kg->vc;
+	if (n > room)
+		n = room;
+	if (n > kg->child_waiters)
+		n = kg->child_waiters;
+	while (n-- > 0)
+		kg_signal(&kg->child_cond, &kg->child_q);
+}
+
+static void wake_teacher(struct kgarten_struct *kg)
+{
+	if (kg->teacher_waiters > 0 && may_go(kg, 0))
+		kg_signal(&kg->teacher_cond, &kg->teacher_q);
+}
+
+/* After any change: signal whoever it may let through, up to room children */
+static void wake_waiters(struct kgarten_struct *kg, int room)
+{
+	unsigned long head = kg->serving % kg->nslots;
+
+	if (kg->policy != POLICY_FIFO) {
+		wake_children(kg, room);
+		wake_teacher(kg);
+	} else if (kg->next_ticket != kg->serving &&
+		   may_go(kg, kg->slot_is_child[head]))
+		kg_signal(&kg->slot_cond[head], &kg->slot_q[head]);
+}
+
+/*
+ * Block until a child may enter or a teacher may leave, having asked
+ * to at t0; the wait is on record meanwhile, for the fairness report.
+ */
+static void admit(struct kgarten_struct *kg, struct thread_info_struct *thr,
+	unsigned long t0)
+{
+	unsigned long ticket, slot;
+	int is_child = thr->is_child;
+	int *waiters = is_child ? &kg->child_waiters : &kg->teacher_waiters;
+
+	thr->waiting = 1;
+	thr->wait_start = t0;
+
+	if (kg->policy == POLICY_FIFO) {
+		/* Nobody waits for a turn: go, without a ticket */
+		if (kg->next_ticket == kg->serving && may_go(kg, is_child))
+			return;
+		ticket = kg->next_ticket++;
+		slot = ticket % kg->nslots;
+		kg->slot_is_child[slot] = is_child;
+		while (kg->serving != ticket || !may_go(kg, is_child))
+			kg_wait(kg, &kg->slot_cond[slot], &kg->slot_q[slot]);
+		kg->serving++;
+		return;
+	}
+
+	while (!may_go(kg, is_child)) {
+		(*waiters)++;
+		kg_wait(kg, is_child ? &kg->child_cond : &kg->teacher_cond,
+			is_child ? &kg->child_q : &kg->teacher_q);
+		(*waiters)--;
+	}
+}
+
+/* Add a wait of w us to the totals of thr and the histograms */
+static void add_wait(struct thread_info_struct *thr, unsigned long w,
+	int entering)
+{
+	if (entering)
+		thr->enter_wait += w;
+	else
+		thr->exit_wait += w;
+	if (w > thr->max_wait)
+		thr->max_wait = w;
+	if (thr->is_child && entering)
+		wait_hist_add(&child_enter_wait, w);
+	if (!thr->is_child && !entering)
+		wait_hist_add(&teacher_exit_wait, w);
+}
+
+/* Called with kg->mutex held, once the thread is in (or out) */
+static void account_wait(struct thread_info_struct *thr, unsigned long t0,
+	int entering)
+{
+	if (entering)
+		thr->enters++;
+	else
+		thr->exits++;
+	add_wait(thr, kg_clock() - t0, entering);
+	thr->waiting = 0;
+}
+
+/*
+ * At report time, with kg->mutex held: the threads still blocked have
+ * waited until now so far, which counts as much as a wait that ended.
+ * Called once, the threads are not going to get anywhere after that.
+ */
+static void account_blocked(struct thread_info_struct *thr, int n)
+{
+	unsigned long now = kg_clock();
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (thr[i].waiting)
+			add_wait(&thr[i], now - thr[i].wait_start,
+				thr[i].is_child);
+}
+
 void child_enter(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+	unsigned long t0;
+
 	if (!thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Teacher thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: CHILD ENTER\n", thr->thrid);
-
-	pthread_mutex_lock(&thr->kg->mutex);
-	++(thr->kg->vc);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	t0 = kg_clock();
+	pthread_mutex_lock(&kg->mutex);
+	admit(kg, thr, t0);
+	++(kg->vc);
+	publish_state(kg);
+	account_wait(thr, t0, 1);
+	/* We may have been woken up for more room than we took */
+	wake_waiters(kg, 1);
+	pthread_mutex_unlock(&kg->mutex);
 }
 
 void child_exit(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+	unsigned long t0;
 
 	if (!thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Teacher thread.\n",
@@ -172,61 +556,83 @@ void child_exit(struct thread_info_struct *thr)
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: CHILD EXIT\n", thr->thrid);
-	
-	pthread_mutex_lock(&thr->kg->mutex);
-	--(thr->kg->vc);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	t0 = kg_clock();
+	pthread_mutex_lock(&kg->mutex);
+	--(kg->vc);
+	publish_state(kg);
+	account_wait(thr, t0, 0);
+	wake_waiters(kg, 1);
+	pthread_mutex_unlock(&kg->mutex);
 }
 
 void teacher_enter(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+	unsigned long t0;
+
 	if (thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Child thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: TEACHER ENTER\n", thr->thrid);
-
-	pthread_mutex_lock(&thr->kg->mutex);
-	++(thr->kg->vt);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	t0 = kg_clock();
+	pthread_mutex_lock(&kg->mutex);
+	++(kg->vt);
+	publish_state(kg);
+	account_wait(thr, t0, 1);
+	wake_waiters(kg, kg->ratio);
+	pthread_mutex_unlock(&kg->mutex);
 }
 
 void teacher_exit(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+	unsigned long t0;
+
 	if (thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Child thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: TEACHER EXIT\n", thr->thrid);
-
-	pthread_mutex_lock(&thr->kg->mutex);
-	--(thr->kg->vt);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	t0 = kg_clock();
+	pthread_mutex_lock(&kg->mutex);
+	admit(kg, thr, t0);
+	--(kg->vt);
+	publish_state(kg);
+	account_wait(thr, t0, 0);
+	/*
+	 * With few children around, the next teacher may go too; with
+	 * teacher priority, children held back for us may now come in.
+	 */
+	wake_waiters(kg, kg->vt * kg->ratio);
+	pthread_mutex_unlock(&kg->mutex);
 }
 
 /*
  * Verify the state of the kindergarten.
+ * It needs no lock: the state is read as a single word.
  */
 void verify(struct thread_info_struct *thr)
 {
         struct kgarten_struct *kg = thr->kg;
         int t, c, r;
 
-        c = kg->vc;
-        t = kg->vt;
+        read_state(kg, &t, &c);
         r = kg->ratio;
 
-        fprintf(stderr, "            Thread %d: Teachers: %d, Children: %d\n",
-                thr->thrid, t, c);
+        kg_trace(thr, EV_VERIFY, t, c);
 
         if (c > t * r) {
+                /* A simulation goes on, to count them */
+                if (sim_mode && sim_violations++ > 0)
+                        return;
                 bad_thing(thr->thrid, c, t);
-                exit(1);
+                if (sim_mode)
+                        printf("*** (at virtual time %lu us)\n", vtsim_now());
+                else
+                        exit(1);
         }
 }
 
@@ -239,32 +645,29 @@ void *thread_start_fn(void *arg)
 {
 	/* We know arg points to an instance of thread_info_struct */
 	struct thread_info_struct *thr = arg;
-	char *nstr;
 
-	fprintf(stderr, "Thread %d of %d. START.\n", thr->thrid, thr->thrcnt);
+	kg_trace(thr, EV_START, thr->thrcnt, 0);
 	
-	nstr = thr->is_child ? "Child" : "Teacher";
 	for (;;) {
-		fprintf(stderr, "Thread %d [%s]: Entering.\n", thr->thrid, nstr);
+		kg_trace(thr, EV_ROLE(thr, EV_CHILD_ENTERING), 0, 0);
 		if (thr->is_child)
 			child_enter(thr);
 		else
 			teacher_enter(thr);
 	
-		fprintf(stderr, "Thread %d [%s]: Entered.\n", thr->thrid, nstr);
+		kg_trace(thr, EV_ROLE(thr, EV_CHILD_ENTERED), 0, 0);
+		sim_count_op();
 
 		/*
 		 * We're inside the critical section,
 		 * just sleep for a while.
 		 */
 		/* usleep(rand_r(&thr->rseed) % 1000000 / (thr->is_child ? 10000 : 1)); */
-        	pthread_mutex_lock(&thr->kg->mutex);
 		verify(thr);
-        	pthread_mutex_unlock(&thr->kg->mutex);
 
-		usleep(rand_r(&thr->rseed) % 1000000);
+		kg_sleep(rand_r(&thr->rseed) % 1000000);
 
-		fprintf(stderr, "Thread %d [%s]: Exiting.\n", thr->thrid, nstr);
+		kg_trace(thr, EV_ROLE(thr, EV_CHILD_EXITING), 0, 0);
 		/* CRITICAL SECTION END */
 
 		if (thr->is_child)
@@ -272,33 +675,301 @@ void *thread_start_fn(void *arg)
 		else
 			teacher_exit(thr);
 
-		fprintf(stderr, "Thread %d [%s]: Exited.\n", thr->thrid, nstr);
+		kg_trace(thr, EV_ROLE(thr, EV_CHILD_EXITED), 0, 0);
+		sim_count_op();
 
 		/* Sleep for a while before re-entering */
 		/* usleep(rand_r(&thr->rseed) % 100000 * (thr->is_child ? 100 : 1)); */
-		usleep(rand_r(&thr->rseed) % 100000);
+		kg_sleep(rand_r(&thr->rseed) % 100000);
 
-        	pthread_mutex_lock(&thr->kg->mutex);
 		verify(thr);
-        	pthread_mutex_unlock(&thr->kg->mutex);
 	}
 
-	fprintf(stderr, "Thread %d of %d. END.\n", thr->thrid, thr->thrcnt);
+	kg_trace(thr, EV_END, thr->thrcnt, 0);
 	
 	return NULL;
 }
 
 
+static void dump_trace(void)
+{
+	FILE *f;
+
+	if (trace_text) {
+		if ((f = fopen(trace_text, "w")) == NULL) {
+			perror(trace_text);
+			exit(1);
+		}
+		trace_dump_text(trace, f);
+		fclose(f);
+	}
+	if (trace_json) {
+		if ((f = fopen(trace_json, "w")) == NULL) {
+			perror(trace_json);
+			exit(1);
+		}
+		trace_dump_json(trace, f);
+		fclose(f);
+	}
+}
+
+/*
+ * A real run never ends; the threads run with SIGINT and SIGTERM
+ * blocked, and main() waits for one of them to report and dump.
+ */
+static void block_stop_signals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, set, NULL);
+}
+
+/*
+ * Reader scaling benchmark (-b max_readers): 1, 2, 4, ... reader
+ * threads read the state and check it in a loop, while the teacher
+ * threads enter and leave without sleeping. Each count of readers runs
+ * twice: reading under the mutex, as verify() used to, and lock-free.
+ */
+#define BENCH_USEC 500000
+
+static int bench_stop, bench_locked;
+
+static void *bench_reader_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	struct kgarten_struct *kg = thr->kg;
+	unsigned long n = 0;
+	int t, c;
+
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+		if (bench_locked) {
+			pthread_mutex_lock(&kg->mutex);
+			t = kg->vt;
+			c = kg->vc;
+			pthread_mutex_unlock(&kg->mutex);
+		} else
+			read_state(kg, &t, &c);
+		if (c > t * kg->ratio) {
+			bad_thing(thr->thrid, c, t);
+			exit(1);
+		}
+		n++;
+	}
+	thr->reads = n;
+
+	return NULL;
+}
+
+static void *bench_writer_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+		teacher_enter(thr);
+		teacher_exit(thr);
+	}
+
+	return NULL;
+}
+
+static double bench_run(struct thread_info_struct *writers, int nwriters,
+	struct thread_info_struct *readers, int nreaders, int locked)
+{
+	unsigned long reads = 0;
+	int i, ret;
+
+	bench_stop = 0;
+	bench_locked = locked;
+	for (i = 0; i < nwriters + nreaders; i++) {
+		if (i < nwriters)
+			ret = pthread_create(&writers[i].tid, NULL,
+				bench_writer_fn, &writers[i]);
+		else
+			ret = pthread_create(&readers[i - nwriters].tid, NULL,
+				bench_reader_fn, &readers[i - nwriters]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+	}
+
+	usleep(BENCH_USEC);
+	__atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nwriters + nreaders; i++) {
+		ret = pthread_join(i < nwriters ? writers[i].tid :
+			readers[i - nwriters].tid, NULL);
+		if (ret) {
+			perror_pthread(ret, "pthread_join");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nreaders; i++)
+		reads += readers[i].reads;
+
+	return reads * 1e6 / BENCH_USEC;
+}
+
+static void reader_bench(struct kgarten_struct *kg,
+	struct thread_info_struct *writers, int nwriters, int max_readers)
+{
+	struct thread_info_struct *readers;
+	double locked, lockfree;
+	int i, n;
+
+	readers = safe_malloc(max_readers * sizeof(*readers));
+	for (i = 0; i < max_readers; i++) {
+		readers[i].kg = kg;
+		readers[i].thrid = nwriters + i;
+	}
+
+	printf("%d writer threads\n%8s %16s %16s %8s\n", nwriters,
+		"readers", "locked reads/s", "lock-free reads/s", "speedup");
+	for (n = 1; ; n *= 2) {
+		if (n > max_readers)
+			n = max_readers;
+		locked = bench_run(writers, nwriters, readers, n, 1);
+		lockfree = bench_run(writers, nwriters, readers, n, 0);
+		printf("%8d %16.0f %16.0f %8.1f\n", n, locked, lockfree,
+			lockfree / locked);
+		if (n == max_readers)
+			break;
+	}
+	free(readers);
+}
+
+static void sim_thread_fn(void *arg)
+{
+	thread_start_fn(arg);
+}
+
+static void print_wait_hist(const char *what, struct wait_hist *h)
+{
+	printf("%-14s %10ld waits, p50 %8lu us, p99 %8lu us, "
+		"p99.9 %8lu us, max %8lu us\n", what, h->count,
+		wait_hist_percentile(h, 0.50), wait_hist_percentile(h, 0.99),
+		wait_hist_percentile(h, 0.999), h->max);
+}
+
+/*
+ * Fairness among the threads of one kind: Jain's index over the number
+ * of times each got in (children) or out (teachers), which is 1 when
+ * all did equally well and 1/n when one thread did everything, how long
+ * they waited on average, the longest single wait and who saw it, and
+ * the threads that never made it once. A wait still going on counts.
+ */
+static void print_fairness(const char *what, struct thread_info_struct *thr,
+	int n, int is_child)
+{
+	double sum = 0, sumsq = 0, x;
+	unsigned long wait = 0, max_wait = 0;
+	long ops = 0;
+	int i, worst = -1, starved = 0;
+
+	if (n == 0)
+		return;
+	for (i = 0; i < n; i++) {
+		x = is_child ? thr[i].enters : thr[i].exits;
+		sum += x;
+		sumsq += x * x;
+		ops += thr[i].enters + thr[i].exits + thr[i].waiting;
+		wait += thr[i].enter_wait + thr[i].exit_wait;
+		if (worst < 0 || thr[i].max_wait > max_wait) {
+			max_wait = thr[i].max_wait;
+			worst = thr[i].thrid;
+		}
+		if (x == 0)
+			starved++;
+	}
+	/* Nobody made it at all: that is no fairness, not perfect fairness */
+	printf("%-9s %4d threads, Jain's index %.4f, mean wait %8.1f us, "
+		"max wait %8lu us (thread %d), %d starved\n", what, n,
+		sumsq ? sum * sum / (n * sumsq) : 0.0,
+		ops ? (double)wait / ops : 0.0, max_wait, worst, starved);
+}
+
+static void fairness_report(struct kgarten_struct *kg,
+	struct thread_info_struct *thr, int thrcnt, int chldcnt)
+{
+	printf("Policy %s:\n", policy_names[kg->policy]);
+	print_fairness("children", thr, chldcnt, 1);
+	print_fairness("teachers", thr + chldcnt, thrcnt - chldcnt, 0);
+}
+
+static void sim_report(struct kgarten_struct *kg,
+	struct thread_info_struct *thr, int thrcnt, int chldcnt, int blocked,
+	unsigned int seed, double sec)
+{
+	printf("Seed %u: %ld operations in %.3f s (%.0f ops/s), "
+		"%.3f s of virtual time\n", seed, sim_ops, sec, sim_ops / sec,
+		vtsim_now() / 1e6);
+	account_blocked(thr, thrcnt);
+	print_wait_hist("child enter", &child_enter_wait);
+	print_wait_hist("teacher exit", &teacher_exit_wait);
+	fairness_report(kg, thr, thrcnt, chldcnt);
+	if (blocked)
+		printf("DEADLOCK: all %d remaining threads blocked, "
+			"teachers %d, children %d\n", blocked, kg->vt, kg->vc);
+	printf("%s, %ld violations.\n", sim_violations || blocked ?
+		"NOT OK" : "OK", sim_violations);
+}
+
 int main(int argc, char *argv[])
 {
-	int i, ret, thrcnt, chldcnt, ratio;
+	int i, ret, thrcnt, chldcnt, ratio, opt, ops, blocked, seed = 0, sig;
+	int bench_readers = 0, policy = POLICY_CHILD;
+	sigset_t stop_set;
 	struct thread_info_struct *thr;
 	struct kgarten_struct *kg;
+	struct timespec t0, t1;
 
 	/*
 	 * Parse the command line
 	 */
-	if (argc != 4)
+	while ((opt = getopt(argc, argv, "s:n:p:vt:j:e:b:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (safe_atoi(optarg, &seed) < 0)
+				usage(argv[0]);
+			sim_mode = 1;
+			break;
+		case 'n':
+			if (safe_atoi(optarg, &ops) < 0 || ops < 1)
+				usage(argv[0]);
+			sim_ops_limit = ops;
+			break;
+		case 'p':
+			for (policy = 0; policy < 3; policy++)
+				if (strcmp(optarg, policy_names[policy]) == 0)
+					break;
+			if (policy == 3)
+				usage(argv[0]);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			trace_text = optarg;
+			break;
+		case 'j':
+			trace_json = optarg;
+			break;
+		case 'e':
+			if (safe_atoi(optarg, &ops) < 0 || ops < 1)
+				usage(argv[0]);
+			trace_events = ops;
+			break;
+		case 'b':
+			if (safe_atoi(optarg, &bench_readers) < 0 ||
+			    bench_readers < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argv += optind - 1;
+	if (argc - optind != 3)
 		usage(argv[0]);
 	if (safe_atoi(argv[1], &thrcnt) < 0 || thrcnt <= 0) {
 		fprintf(stderr, "`%s' is not valid for `thread_count'\n", argv[1]);
@@ -317,10 +988,11 @@ int main(int argc, char *argv[])
 	/*
 	 * Initialize kindergarten and random number generator 
 	 */
-	srand(time(NULL));
+	srand(sim_mode ? seed : time(NULL));
 
 	kg = safe_malloc(sizeof(*kg));
 	kg->vt = kg->vc = 0;
+	kg->state = 0;
 	kg->ratio = ratio;
 
 	ret = pthread_mutex_init(&kg->mutex, NULL);
@@ -329,12 +1001,38 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* ... */
+	kg->child_waiters = kg->teacher_waiters = 0;
+	kg->child_q.head = kg->child_q.tail = NULL;
+	kg->teacher_q.head = kg->teacher_q.tail = NULL;
+	ret = pthread_cond_init(&kg->child_cond, NULL);
+	if (!ret)
+		ret = pthread_cond_init(&kg->teacher_cond, NULL);
+
+	/* At most one blocked request per thread, so one slot each */
+	kg->policy = policy;
+	kg->next_ticket = kg->serving = 0;
+	kg->nslots = thrcnt;
+	kg->slot_cond = safe_malloc(thrcnt * sizeof(*kg->slot_cond));
+	kg->slot_q = safe_malloc(thrcnt * sizeof(*kg->slot_q));
+	kg->slot_is_child = safe_malloc(thrcnt * sizeof(*kg->slot_is_child));
+	for (i = 0; !ret && i < thrcnt; i++) {
+		kg->slot_q[i].head = kg->slot_q[i].tail = NULL;
+		ret = pthread_cond_init(&kg->slot_cond[i], NULL);
+	}
+	if (ret) {
+		perror_pthread(ret, "pthread_cond_init");
+		exit(1);
+	}
 
 	/*
 	 * Create threads
 	 */
 	thr = safe_malloc(thrcnt * sizeof(*thr));
+	trace = trace_create(thrcnt, trace_events, kg_events);
+	if (sim_mode)
+		vtsim_init(seed);
+	else
+		block_stop_signals(&stop_set);
 
 	for (i = 0; i < thrcnt; i++) {
 		/* Initialize per-thread structure */
@@ -343,6 +1041,18 @@ int main(int argc, char *argv[])
 		thr[i].thrcnt = thrcnt;
 		thr[i].is_child = (i < chldcnt);
 		thr[i].rseed = rand();
+		thr[i].trace = &trace->ring[i];
+		thr[i].enters = thr[i].exits = 0;
+		thr[i].enter_wait = thr[i].exit_wait = thr[i].max_wait = 0;
+		thr[i].waiting = 0;
+
+		if (bench_readers)
+			continue;
+
+		if (sim_mode) {
+			vtsim_spawn(sim_thread_fn, &thr[i]);
+			continue;
+		}
 
 		/* Spawn new thread */
 		ret = pthread_create(&thr[i].tid, NULL, thread_start_fn, &thr[i]);
@@ -352,18 +1062,32 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/*
-	 * Wait for all threads to terminate
-	 */
-	for (i = 0; i < thrcnt; i++) {
-		ret = pthread_join(thr[i].tid, NULL);
-		if (ret) {
-			perror_pthread(ret, "pthread_join");
-			exit(1);
-		}
+	if (bench_readers) {
+		reader_bench(kg, thr + chldcnt, thrcnt - chldcnt, bench_readers);
+		return 0;
 	}
 
-	printf("OK.\n");
+	if (sim_mode) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		blocked = vtsim_run();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sim_report(kg, thr, thrcnt, chldcnt, blocked, seed, (t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) / 1e9);
+		dump_trace();
+		return sim_violations || blocked;
+	}
+
+	/*
+	 * The threads run forever: report on how fair the kindergarten
+	 * was when interrupted, dumping the trace too if asked to.
+	 */
+	sigwait(&stop_set, &sig);
+	fprintf(stderr, "Got signal %d.\n", sig);
+	dump_trace();
+	pthread_mutex_lock(&kg->mutex);
+	account_blocked(thr, thrcnt);
+	fairness_report(kg, thr, thrcnt, chldcnt);
+	pthread_mutex_unlock(&kg->mutex);
 
 	return 0;
 }
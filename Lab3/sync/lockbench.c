@@ -0,0 +1,494 @@
+/*
+ * lockbench.c
+ *
+ * simplesync.c, grown into a benchmark: a number of threads increment
+ * a shared counter inside a critical section, for a fixed time, under
+ * each of the locks of locks.h, a pthread spinlock and a pthread mutex.
+ * For comparison, the counter is also incremented without a lock, with
+ * C11 atomic_fetch_add() at several memory orders (on x86 all of them
+ * compile to the same locked instruction; elsewhere they do not).
+ *
+ * Each run is reported as a line of CSV on stdout:
+ *
+ *   lock,threads,cs,ncs,ops,ops_per_sec,jain,min_share,max_share,
+ *   p50_ns,p99_ns,p999_ns,max_ns
+ *
+ *   cs, ncs      iterations of work inside / outside the critical
+ *                section; the former writes a few shared cache lines,
+ *                the latter only thread-local data
+ *   jain         Jain's fairness index of the operations per thread,
+ *                1 when all threads got the same share, 1/threads when
+ *                one thread got everything
+ *   min_share,   operations of the least / most lucky thread, over the
+ *   max_share    mean
+ *   p*_ns        percentiles of the time it took to acquire the lock
+ *                (for the atomics, to do the increment)
+ *
+ * The counter is checked after every run, so a broken lock shows up.
+ * Spinning locks with more threads than CPUs are measured too, but
+ * their numbers mostly show what happens when the lock holder, or the
+ * next in line, is preempted.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "locks.h"
+
+/*
+ * POSIX thread functions do not return error numbers in errno,
+ * but in the actual return value of the function call instead.
+ * This macro helps with error reporting in this case.
+ */
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+#define MAX_THREADS 1024
+#define CS_LINES    4                   /* cache lines written in the CS */
+
+/* Latency histogram: 8 linear buckets per power of two */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  (64 << HIST_SUB_BITS)
+
+struct thread_info_struct {
+	pthread_t tid;
+	int thrid;
+
+	struct lock_node node;
+	unsigned long ops;
+	unsigned long hist[HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* All the locks, each on a cache line of its own */
+static struct {
+	struct tas_lock tas;
+	struct ttas_lock ttas;
+	struct ticket_lock ticket;
+	struct mcs_lock mcs;
+	struct clh_lock clh;
+	struct futex_lock futex;
+	pthread_spinlock_t spin __attribute__((aligned(CACHE_LINE)));
+	pthread_mutex_t mutex __attribute__((aligned(CACHE_LINE)));
+} locks;
+
+static struct {
+	unsigned long counter;
+	unsigned long data[CS_LINES][CACHE_LINE / sizeof(unsigned long)];
+} shared __attribute__((aligned(CACHE_LINE)));
+
+static _Atomic unsigned long atomic_counter __attribute__((aligned(CACHE_LINE)));
+
+static int stop __attribute__((aligned(CACHE_LINE)));
+static pthread_barrier_t start;
+static int cs_len = 10, ncs_len = 50, pin;
+
+/******************************************************************************
+ * The contenders
+ *
+ * A lock type either has lock()/unlock(), around a critical section that
+ * increments shared.counter, or only inc(), which replaces the whole
+ * critical section by an atomic increment of atomic_counter.
+ */
+struct lock_type {
+	const char *name;
+	void (*init)(void);
+	void (*lock)(struct lock_node *n);
+	void (*unlock)(struct lock_node *n);
+	void (*inc)(void);
+};
+
+#define LOCKS_H_WRAPPERS(x)                                              \
+static void x##_do_init(void) { x##_init(&locks.x); }                    \
+static void x##_do_lock(struct lock_node *n) { x##_lock(&locks.x, n); }  \
+static void x##_do_unlock(struct lock_node *n) { x##_unlock(&locks.x, n); }
+
+LOCKS_H_WRAPPERS(tas)
+LOCKS_H_WRAPPERS(ttas)
+LOCKS_H_WRAPPERS(ticket)
+LOCKS_H_WRAPPERS(mcs)
+LOCKS_H_WRAPPERS(clh)
+LOCKS_H_WRAPPERS(futex)
+
+static void
+spin_do_init(void)
+{
+	pthread_spin_init(&locks.spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void
+spin_do_lock(struct lock_node *n)
+{
+	pthread_spin_lock(&locks.spin);
+}
+
+static void
+spin_do_unlock(struct lock_node *n)
+{
+	pthread_spin_unlock(&locks.spin);
+}
+
+static void
+mutex_do_init(void)
+{
+	pthread_mutex_init(&locks.mutex, NULL);
+}
+
+static void
+mutex_do_lock(struct lock_node *n)
+{
+	pthread_mutex_lock(&locks.mutex);
+}
+
+static void
+mutex_do_unlock(struct lock_node *n)
+{
+	pthread_mutex_unlock(&locks.mutex);
+}
+
+static void
+atomic_do_init(void)
+{
+	atomic_store(&atomic_counter, 0);
+}
+
+static void
+atomic_relaxed_inc(void)
+{
+	atomic_fetch_add_explicit(&atomic_counter, 1, memory_order_relaxed);
+}
+
+static void
+atomic_acq_rel_inc(void)
+{
+	atomic_fetch_add_explicit(&atomic_counter, 1, memory_order_acq_rel);
+}
+
+static void
+atomic_seq_cst_inc(void)
+{
+	atomic_fetch_add_explicit(&atomic_counter, 1, memory_order_seq_cst);
+}
+
+static struct lock_type lock_types[] = {
+	{ "tas", tas_do_init, tas_do_lock, tas_do_unlock, NULL },
+	{ "ttas", ttas_do_init, ttas_do_lock, ttas_do_unlock, NULL },
+	{ "ticket", ticket_do_init, ticket_do_lock, ticket_do_unlock, NULL },
+	{ "mcs", mcs_do_init, mcs_do_lock, mcs_do_unlock, NULL },
+	{ "clh", clh_do_init, clh_do_lock, clh_do_unlock, NULL },
+	{ "futex", futex_do_init, futex_do_lock, futex_do_unlock, NULL },
+	{ "pthread-spin", spin_do_init, spin_do_lock, spin_do_unlock, NULL },
+	{ "pthread-mutex", mutex_do_init, mutex_do_lock, mutex_do_unlock, NULL },
+	{ "atomic-relaxed", atomic_do_init, NULL, NULL, atomic_relaxed_inc },
+	{ "atomic-acq-rel", atomic_do_init, NULL, NULL, atomic_acq_rel_inc },
+	{ "atomic-seq-cst", atomic_do_init, NULL, NULL, atomic_seq_cst_inc },
+};
+
+#define NR_LOCK_TYPES (sizeof(lock_types) / sizeof(lock_types[0]))
+
+/******************************************************************************
+ * Measurement
+ */
+
+static inline unsigned long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline int
+hist_bucket(unsigned long v)
+{
+	int e;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+	e = 63 - __builtin_clzl(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* The largest value that falls in bucket b */
+static unsigned long
+hist_value(int b)
+{
+	int e, sub;
+
+	if (b < (1 << HIST_SUB_BITS))
+		return b;
+	e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = b & ((1 << HIST_SUB_BITS) - 1);
+	return ((((1UL << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS))) - 1;
+}
+
+static unsigned long
+hist_percentile(unsigned long *hist, unsigned long total, double p)
+{
+	unsigned long seen = 0, want = total * p;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > want)
+			return hist_value(b);
+	}
+
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static inline void
+work(volatile unsigned long *p, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		p[(i % CS_LINES) * (CACHE_LINE / sizeof(unsigned long))]++;
+}
+
+static struct lock_type *cur;
+
+void *bench_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	unsigned long local[CS_LINES][CACHE_LINE / sizeof(unsigned long)];
+	unsigned long t0, t1;
+	cpu_set_t set;
+	int ret;
+
+	if (pin) {
+		CPU_ZERO(&set);
+		CPU_SET(thr->thrid % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret)
+			perror_pthread(ret, "pthread_setaffinity_np");
+	}
+	memset(local, 0, sizeof(local));
+
+	pthread_barrier_wait(&start);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		t0 = now_ns();
+		if (cur->inc) {
+			cur->inc();
+			t1 = now_ns();
+		} else {
+			cur->lock(&thr->node);
+			t1 = now_ns();
+			shared.counter++;
+			work(&shared.data[0][0], cs_len);
+			cur->unlock(&thr->node);
+		}
+		thr->hist[hist_bucket(t1 - t0)]++;
+		thr->ops++;
+		work(&local[0][0], ncs_len);
+	}
+
+	return NULL;
+}
+
+static void
+run(struct lock_type *t, struct thread_info_struct *thr, int nthr,
+	int duration_ms)
+{
+	static unsigned long hist[HIST_BUCKETS];
+	struct timespec ts = { duration_ms / 1000, duration_ms % 1000 * 1000000L };
+	unsigned long total = 0, counter, t0, t1, lo = ~0UL, hi = 0, maxlat = 0;
+	double sumsq = 0, mean, sec;
+	int i, b, ret;
+
+	cur = t;
+	t->init();
+	shared.counter = 0;
+	stop = 0;
+	memset(hist, 0, sizeof(hist));
+	pthread_barrier_init(&start, NULL, nthr + 1);
+
+	for (i = 0; i < nthr; i++) {
+		memset(&thr[i], 0, sizeof(thr[i]));
+		thr[i].thrid = i;
+		if (t->lock == clh_do_lock)
+			clh_node_init(&thr[i].node);
+		ret = pthread_create(&thr[i].tid, NULL, bench_fn, &thr[i]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	nanosleep(&ts, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nthr; i++) {
+		ret = pthread_join(thr[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
+	t1 = now_ns();
+	pthread_barrier_destroy(&start);
+
+	for (i = 0; i < nthr; i++) {
+		total += thr[i].ops;
+		sumsq += (double)thr[i].ops * thr[i].ops;
+		if (thr[i].ops < lo)
+			lo = thr[i].ops;
+		if (thr[i].ops > hi)
+			hi = thr[i].ops;
+		for (b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += thr[i].hist[b];
+		/* The queue node a CLH thread ends up with is its to free */
+		if (t->lock == clh_do_lock)
+			free(thr[i].node.clh_mine);
+	}
+	if (t->lock == clh_do_lock)
+		free(locks.clh.tail);
+	for (b = HIST_BUCKETS - 1; b >= 0; b--)
+		if (hist[b]) {
+			maxlat = hist_value(b);
+			break;
+		}
+
+	counter = t->inc ? atomic_load(&atomic_counter) : shared.counter;
+	if (counter != total) {
+		fprintf(stderr, "%s, %d threads: counter is %lu, expected %lu\n",
+			t->name, nthr, counter, total);
+		exit(1);
+	}
+
+	sec = (t1 - t0) / 1e9;
+	mean = (double)total / nthr;
+	printf("%s,%d,%d,%d,%lu,%.0f,%.4f,%.3f,%.3f,%lu,%lu,%lu,%lu\n",
+		t->name, nthr, cs_len, ncs_len, total, total / sec,
+		sumsq > 0 ? (double)total * total / (nthr * sumsq) : 0,
+		lo / mean, hi / mean,
+		hist_percentile(hist, total, 0.50),
+		hist_percentile(hist, total, 0.99),
+		hist_percentile(hist, total, 0.999), maxlat);
+	fflush(stdout);
+}
+
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0') {
+		*val = l;
+		return 0;
+	} else
+		return -1;
+}
+
+void usage(char *argv0)
+{
+	unsigned i;
+
+	fprintf(stderr, "Usage: %s [-t max_threads] [-c cs] [-n ncs] "
+		"[-d duration_ms] [-l lock,...] [-p]\n\n"
+		"    -t  run with 1, 2, 4, ... up to max_threads threads\n"
+		"        (default: the number of online CPUs)\n"
+		"    -c  work iterations inside the critical section (%d)\n"
+		"    -n  work iterations outside it (%d)\n"
+		"    -d  duration of each run, in ms (200)\n"
+		"    -l  the locks to run, out of:\n       ",
+		argv0, cs_len, ncs_len);
+	for (i = 0; i < NR_LOCK_TYPES; i++)
+		fprintf(stderr, " %s", lock_types[i].name);
+	fprintf(stderr, "\n    -p  pin thread i to CPU i (mod CPUs)\n\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct thread_info_struct *thr;
+	int selected[NR_LOCK_TYPES];
+	int ncpus, max_threads, duration_ms = 200, nthr, opt;
+	unsigned i;
+	char *name;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	max_threads = ncpus;
+	for (i = 0; i < NR_LOCK_TYPES; i++)
+		selected[i] = 1;
+
+	while ((opt = getopt(argc, argv, "t:c:n:d:l:p")) != -1) {
+		switch (opt) {
+		case 't':
+			if (safe_atoi(optarg, &max_threads) < 0 ||
+			    max_threads < 1 || max_threads > MAX_THREADS)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if (safe_atoi(optarg, &cs_len) < 0 || cs_len < 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			if (safe_atoi(optarg, &ncs_len) < 0 || ncs_len < 0)
+				usage(argv[0]);
+			break;
+		case 'd':
+			if (safe_atoi(optarg, &duration_ms) < 0 || duration_ms < 1)
+				usage(argv[0]);
+			break;
+		case 'l':
+			memset(selected, 0, sizeof(selected));
+			for (name = strtok(optarg, ","); name;
+			     name = strtok(NULL, ",")) {
+				for (i = 0; i < NR_LOCK_TYPES; i++)
+					if (strcmp(name, lock_types[i].name) == 0)
+						break;
+				if (i == NR_LOCK_TYPES) {
+					fprintf(stderr, "Unknown lock: %s\n", name);
+					usage(argv[0]);
+				}
+				selected[i] = 1;
+			}
+			break;
+		case 'p':
+			pin = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (posix_memalign((void **)&thr, CACHE_LINE,
+			max_threads * sizeof(*thr)) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (max_threads > ncpus)
+		fprintf(stderr, "Warning: %d threads on %d CPUs; spinning "
+			"locks will be slowed down by preemption\n",
+			max_threads, ncpus);
+
+	printf("lock,threads,cs,ncs,ops,ops_per_sec,jain,min_share,max_share,"
+		"p50_ns,p99_ns,p999_ns,max_ns\n");
+	for (i = 0; i < NR_LOCK_TYPES; i++) {
+		if (!selected[i])
+			continue;
+		for (nthr = 1; ; nthr *= 2) {
+			if (nthr > max_threads)
+				nthr = max_threads;
+			run(&lock_types[i], thr, nthr, duration_ms);
+			if (nthr == max_threads)
+				break;
+		}
+	}
+	free(thr);
+
+	return 0;
+}
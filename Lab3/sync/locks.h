@@ -0,0 +1,298 @@
+/*
+ * locks.h
+ *
+ * A collection of spinning and sleeping mutual exclusion locks,
+ * for comparing them with each other and with pthread_mutex_t.
+ *
+ * Every lock has the same interface:
+ *
+ *     void X_init(struct X_lock *l);
+ *     void X_lock(struct X_lock *l, struct lock_node *n);
+ *     void X_unlock(struct X_lock *l, struct lock_node *n);
+ *
+ * where n is owned by the calling thread. Only the queue locks (MCS and
+ * CLH) use it; every other lock ignores it. A thread must pass the same
+ * node to lock() and the matching unlock(), and it may hold only one
+ * queue lock per node at a time.
+ *
+ * CLH also needs clh_node_init() on each thread's node; see below.
+ */
+
+#ifndef LOCKS_H__
+#define LOCKS_H__
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE 64
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/*
+ * Per-thread queue node. Each one sits on a cache line of its own,
+ * since a waiter spins on it while its neighbour in the queue writes it.
+ */
+struct lock_node {
+	struct lock_node *next;             /* MCS: our successor */
+	int locked;
+	struct lock_node *clh_mine;         /* CLH: the node we enqueue */
+	struct lock_node *clh_pred;         /* CLH: the one we waited on */
+} __attribute__((aligned(CACHE_LINE)));
+
+/******************************************************************************
+ * Test-and-set: everyone spins on the exchange itself, so each try
+ * takes the cache line in exclusive mode.
+ */
+struct tas_lock {
+	int locked;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+tas_init(struct tas_lock *l)
+{
+	l->locked = 0;
+}
+
+static inline void
+tas_lock(struct tas_lock *l, struct lock_node *n)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline void
+tas_unlock(struct tas_lock *l, struct lock_node *n)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Test-and-test-and-set with exponential backoff: spin reading the
+ * (shared) line until the lock looks free, and after a failed exchange
+ * wait twice as long as last time before trying again.
+ */
+#define TTAS_BACKOFF_MIN 4
+#define TTAS_BACKOFF_MAX 1024
+
+struct ttas_lock {
+	int locked;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+ttas_init(struct ttas_lock *l)
+{
+	l->locked = 0;
+}
+
+static inline void
+ttas_lock(struct ttas_lock *l, struct lock_node *n)
+{
+	unsigned backoff = TTAS_BACKOFF_MIN, i;
+
+	for (;;) {
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+			cpu_relax();
+		if (!__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+			return;
+		for (i = 0; i < backoff; i++)
+			cpu_relax();
+		if (backoff < TTAS_BACKOFF_MAX)
+			backoff <<= 1;
+	}
+}
+
+static inline void
+ttas_unlock(struct ttas_lock *l, struct lock_node *n)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Ticket lock: FIFO. Each thread takes a ticket and waits until it is
+ * being served; the unlock hands the lock to the next ticket. Everyone
+ * still spins on the same line.
+ */
+struct ticket_lock {
+	unsigned next;
+	unsigned serving;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+ticket_init(struct ticket_lock *l)
+{
+	l->next = 0;
+	l->serving = 0;
+}
+
+static inline void
+ticket_lock(struct ticket_lock *l, struct lock_node *n)
+{
+	unsigned me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+
+	while (__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) != me)
+		cpu_relax();
+}
+
+static inline void
+ticket_unlock(struct ticket_lock *l, struct lock_node *n)
+{
+	__atomic_store_n(&l->serving, l->serving + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * MCS queue lock: FIFO, and each waiter spins on its own node, which its
+ * predecessor writes exactly once to hand the lock over.
+ */
+struct mcs_lock {
+	struct lock_node *tail;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+mcs_init(struct mcs_lock *l)
+{
+	l->tail = NULL;
+}
+
+static inline void
+mcs_lock(struct mcs_lock *l, struct lock_node *n)
+{
+	struct lock_node *pred;
+
+	n->next = NULL;
+	n->locked = 1;
+	pred = __atomic_exchange_n(&l->tail, n, __ATOMIC_ACQ_REL);
+	if (pred == NULL)
+		return;
+
+	__atomic_store_n(&pred->next, n, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&n->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline void
+mcs_unlock(struct mcs_lock *l, struct lock_node *n)
+{
+	struct lock_node *next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+	struct lock_node *me = n;
+
+	if (next == NULL) {
+		/* Nobody after us, unless one is between its xchg and link */
+		if (__atomic_compare_exchange_n(&l->tail, &me, NULL, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		while ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * CLH queue lock: FIFO, an implicit queue. Each waiter spins on the node
+ * of its predecessor, and on unlock keeps that node for its next
+ * acquisition, leaving its own one to its successor. So nodes migrate
+ * between threads; lock_node only holds the one the thread owns now.
+ * When the lock is free, there is one node more than threads: the one
+ * at the tail belongs to nobody.
+ */
+struct clh_lock {
+	struct lock_node *tail;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline struct lock_node *
+clh_alloc_node(void)
+{
+	struct lock_node *n;
+
+	if (posix_memalign((void **)&n, CACHE_LINE, sizeof(*n)) != 0)
+		abort();
+	n->locked = 0;
+
+	return n;
+}
+
+static inline void
+clh_init(struct clh_lock *l)
+{
+	l->tail = clh_alloc_node();
+}
+
+/* Every thread needs a node of its own before its first clh_lock() */
+static inline void
+clh_node_init(struct lock_node *n)
+{
+	n->clh_mine = clh_alloc_node();
+	n->clh_pred = NULL;
+}
+
+static inline void
+clh_lock(struct clh_lock *l, struct lock_node *n)
+{
+	struct lock_node *mine = n->clh_mine, *pred;
+
+	__atomic_store_n(&mine->locked, 1, __ATOMIC_RELAXED);
+	pred = __atomic_exchange_n(&l->tail, mine, __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(&pred->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	n->clh_pred = pred;
+}
+
+static inline void
+clh_unlock(struct clh_lock *l, struct lock_node *n)
+{
+	struct lock_node *mine = n->clh_mine;
+
+	n->clh_mine = n->clh_pred;
+	__atomic_store_n(&mine->locked, 0, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Futex mutex: 0 unlocked, 1 locked, 2 locked and maybe contended.
+ * Waiters sleep in the kernel instead of spinning, and the unlocker only
+ * makes a system call when the lock was contended.
+ */
+struct futex_lock {
+	int state;
+} __attribute__((aligned(CACHE_LINE)));
+
+static inline void
+futex_init(struct futex_lock *l)
+{
+	l->state = 0;
+}
+
+static inline void
+futex_lock(struct futex_lock *l, struct lock_node *n)
+{
+	int c = 0;
+
+	if (__atomic_compare_exchange_n(&l->state, &c, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if (c != 2)
+		c = __atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		syscall(SYS_futex, &l->state, FUTEX_WAIT_PRIVATE, 2, NULL,
+			NULL, 0);
+		c = __atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static inline void
+futex_unlock(struct futex_lock *l, struct lock_node *n)
+{
+	if (__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, &l->state, FUTEX_WAKE_PRIVATE, 1, NULL,
+			NULL, 0);
+}
+
+#endif /* LOCKS_H__ */
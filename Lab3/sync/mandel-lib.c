@@ -12,380 +12,36 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <pthread.h>
 
-#include "mandel-lib.h"
-
-/*****************************************
- *                                       *
- * Functions to manage a 256-color xterm *
- *                                       *
- *****************************************/
-
-/* 3 functions to convert between RGB colors and the corresponding xterm-256 values
- * Wolfgang Frisch, xororand@frexx.de */
-
-
-// whole colortable, filled by maketable()
-static int initialized=0;
-static unsigned char colortable[254][3];
+#if defined(__x86_64__) || defined(__i386__)
+#define MANDEL_X86
+#include <immintrin.h>
+#endif
 
-// the 6 value iterations en the xterm color cube
-static const unsigned char valuerange[] = { 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF };
+#include "mandel-lib.h"
+#include "palette.h"
 
-// 16 basic colors
-static const unsigned char basic16[16][3] =
-{
-	{ 0x00, 0x00, 0x00 }, // 0
-	{ 0xCD, 0x00, 0x00 }, // 1
-	{ 0x00, 0xCD, 0x00 }, // 2
-	{ 0xCD, 0xCD, 0x00 }, // 3
-	{ 0x00, 0x00, 0xEE }, // 4
-	{ 0xCD, 0x00, 0xCD }, // 5
-	{ 0x00, 0xCD, 0xCD }, // 6
-	{ 0xE5, 0xE5, 0xE5 }, // 7
-	{ 0x7F, 0x7F, 0x7F }, // 8
-	{ 0xFF, 0x00, 0x00 }, // 9
-	{ 0x00, 0xFF, 0x00 }, // 10
-	{ 0xFF, 0xFF, 0x00 }, // 11
-	{ 0x5C, 0x5C, 0xFF }, // 12
-	{ 0xFF, 0x00, 0xFF }, // 13
-	{ 0x00, 0xFF, 0xFF }, // 14
-	{ 0xFF, 0xFF, 0xFF }  // 15
-};
+/*
+ * The palettes, generated by mkpalette.c: for each color value,
+ * its 24-bit color and the nearest color of a 256-color xterm.
+ */
+static const struct mandel_palette *palette = &mandel_palettes[0];
 
-// convert an xterm color value (0-253) to 3 unsigned chars rgb
-static void xterm2rgb(unsigned char color, unsigned char* rgb)
+/* Select a palette by name; -1 if there is none by that name */
+int mandel_set_palette(const char *name)
 {
-	// 16 basic colors
-	if(color<16)
-	{
-		rgb[0] = basic16[color][0];
-		rgb[1] = basic16[color][1];
-		rgb[2] = basic16[color][2];
-	}
-	
-	// color cube color
-	if(color>=16 && color<=232)
-	{
-		color-=16;
-		rgb[0] = valuerange[(color/36)%6];
-		rgb[1] = valuerange[(color/6)%6];
-		rgb[2] = valuerange[color%6];
-	}
-	
-	// gray tone
-	if(color>=233 && color<=253)
-	{
-		rgb[0]=rgb[1]=rgb[2] = 8+(color-232)*0x0a;
-	}
-}
+	int i;
 
-// fill the colortable for use with rgb2xterm
-static void maketable()
-{
-	unsigned char c, rgb[3] = {0, 0, 0};
-	for(c=0;c<=253;c++)
-	{
-		xterm2rgb(c,rgb);
-		colortable[c][0] = rgb[0];
-		colortable[c][1] = rgb[1];
-		colortable[c][2] = rgb[2];
-	}
-}
-
-// selects the nearest xterm color for a 3xBYTE rgb value
-static unsigned char rgb2xterm(unsigned char* rgb)
-{
-	unsigned char c, best_match=0;
-	double d, smallest_distance;
-
-	if(!initialized)
-		maketable();
-
-	smallest_distance = 10000000000.0;
-	
-	for(c=0;c<=253;c++)
-	{
-		d = pow(colortable[c][0]-rgb[0],2.0) + 
-			pow(colortable[c][1]-rgb[1],2.0) + 
-			pow(colortable[c][2]-rgb[2],2.0);
-		if(d<smallest_distance)
-		{
-			smallest_distance = d;
-			best_match=c;
+	for (i = 0; i < MANDEL_NPALETTES; i++)
+		if (strcmp(name, mandel_palettes[i].name) == 0) {
+			palette = &mandel_palettes[i];
+			return 0;
 		}
-	}
 
-	return best_match;
+	return -1;
 }
 
-
-/*******************************************
- *                                         *
- * A nice 256-color palette for drawing    *
- * the Mandelbrot Set.                     *
- *                                         *
- *******************************************/
-
-static struct { double red; double green; double blue; } mandel256[] = {
-	{0.000,0.000,0.734},
-	{0.000,0.300,0.734},
-	{0.000,0.734,0.000},
-	{0.734,0.734,0.000},
-	{0.734,0.000,0.000},
-	{0.734,0.000,0.734},
-	{0.000,0.734,0.734},
-	{0.750,0.750,0.750},
-	{0.750,0.859,0.750},
-	{0.641,0.781,0.938},
-	{0.500,0.000,0.000},
-	{0.000,0.500,0.000},
-	{0.500,0.500,0.000},
-	{0.000,0.000,0.500},
-	{0.500,0.000,0.500},
-	{0.000,0.500,0.500},
-	{0.234,0.359,0.234},
-	{0.359,0.359,0.234},
-	{0.484,0.359,0.234},
-	{0.609,0.359,0.234},
-	{0.734,0.359,0.234},
-	{0.859,0.359,0.234},
-	{0.984,0.359,0.234},
-	{0.234,0.484,0.234},
-	{0.359,0.484,0.234},
-	{0.484,0.484,0.234},
-	{0.609,0.484,0.234},
-	{0.734,0.484,0.234},
-	{0.859,0.484,0.234},
-	{0.984,0.484,0.234},
-	{0.234,0.609,0.234},
-	{0.359,0.609,0.234},
-	{0.484,0.609,0.234},
-	{0.609,0.609,0.234},
-	{0.734,0.609,0.234},
-	{0.859,0.609,0.234},
-	{0.984,0.609,0.234},
-	{0.234,0.734,0.234},
-	{0.359,0.734,0.234},
-	{0.484,0.734,0.234},
-	{0.609,0.734,0.234},
-	{0.734,0.734,0.234},
-	{0.859,0.734,0.234},
-	{0.984,0.734,0.234},
-	{0.234,0.859,0.234},
-	{0.359,0.859,0.234},
-	{0.484,0.859,0.234},
-	{0.609,0.859,0.234},
-	{0.734,0.859,0.234},
-	{0.859,0.859,0.234},
-	{0.984,0.859,0.234},
-	{0.234,0.984,0.234},
-	{0.359,0.984,0.234},
-	{0.484,0.984,0.234},
-	{0.609,0.984,0.234},
-	{0.734,0.984,0.234},
-	{0.859,0.984,0.234},
-	{0.984,0.984,0.234},
-	{0.234,0.234,0.359},
-	{0.359,0.234,0.359},
-	{0.484,0.234,0.359},
-	{0.609,0.234,0.359},
-	{0.734,0.234,0.359},
-	{0.859,0.234,0.359},
-	{0.984,0.234,0.359},
-	{0.234,0.359,0.359},
-	{0.359,0.359,0.359},
-	{0.484,0.359,0.359},
-	{0.609,0.359,0.359},
-	{0.734,0.359,0.359},
-	{0.859,0.359,0.359},
-	{0.984,0.359,0.359},
-	{0.234,0.484,0.359},
-	{0.359,0.484,0.359},
-	{0.484,0.484,0.359},
-	{0.609,0.484,0.359},
-	{0.734,0.484,0.359},
-	{0.859,0.484,0.359},
-	{0.984,0.484,0.359},
-	{0.234,0.609,0.359},
-	{0.359,0.609,0.359},
-	{0.484,0.609,0.359},
-	{0.609,0.609,0.359},
-	{0.734,0.609,0.359},
-	{0.859,0.609,0.359},
-	{0.984,0.609,0.359},
-	{0.234,0.734,0.359},
-	{0.359,0.734,0.359},
-	{0.484,0.734,0.359},
-	{0.609,0.734,0.359},
-	{0.734,0.734,0.359},
-	{0.859,0.734,0.359},
-	{0.984,0.734,0.359},
-	{0.234,0.859,0.359},
-	{0.359,0.859,0.359},
-	{0.484,0.859,0.359},
-	{0.609,0.859,0.359},
-	{0.734,0.859,0.359},
-	{0.859,0.859,0.359},
-	{0.984,0.859,0.359},
-	{0.234,0.984,0.359},
-	{0.359,0.984,0.359},
-	{0.484,0.984,0.359},
-	{0.609,0.984,0.359},
-	{0.734,0.984,0.359},
-	{0.859,0.984,0.359},
-	{0.984,0.984,0.359},
-	{0.234,0.234,0.484},
-	{0.359,0.234,0.484},
-	{0.484,0.234,0.484},
-	{0.609,0.234,0.484},
-	{0.734,0.234,0.484},
-	{0.859,0.234,0.484},
-	{0.984,0.234,0.484},
-	{0.234,0.359,0.484},
-	{0.359,0.359,0.484},
-	{0.484,0.359,0.484},
-	{0.609,0.359,0.484},
-	{0.734,0.359,0.484},
-	{0.859,0.359,0.484},
-	{0.984,0.359,0.484},
-	{0.234,0.484,0.484},
-	{0.359,0.484,0.484},
-	{0.484,0.484,0.484},
-	{0.609,0.484,0.484},
-	{0.734,0.484,0.484},
-	{0.859,0.484,0.484},
-	{0.984,0.484,0.484},
-	{0.234,0.609,0.484},
-	{0.359,0.609,0.484},
-	{0.484,0.609,0.484},
-	{0.609,0.609,0.484},
-	{0.734,0.609,0.484},
-	{0.859,0.609,0.484},
-	{0.984,0.609,0.484},
-	{0.234,0.734,0.484},
-	{0.359,0.734,0.484},
-	{0.484,0.734,0.484},
-	{0.609,0.734,0.484},
-	{0.734,0.734,0.484},
-	{0.859,0.734,0.484},
-	{0.984,0.734,0.484},
-	{0.234,0.859,0.484},
-	{0.359,0.859,0.484},
-	{0.484,0.859,0.484},
-	{0.609,0.859,0.484},
-	{0.734,0.859,0.484},
-	{0.859,0.859,0.484},
-	{0.984,0.859,0.484},
-	{0.234,0.984,0.484},
-	{0.359,0.984,0.484},
-	{0.484,0.984,0.484},
-	{0.609,0.984,0.484},
-	{0.734,0.984,0.484},
-	{0.859,0.984,0.484},
-	{0.984,0.984,0.484},
-	{0.234,0.234,0.609},
-	{0.359,0.234,0.609},
-	{0.484,0.234,0.609},
-	{0.609,0.234,0.609},
-	{0.734,0.234,0.609},
-	{0.859,0.234,0.609},
-	{0.984,0.234,0.609},
-	{0.234,0.359,0.609},
-	{0.359,0.359,0.609},
-	{0.484,0.359,0.609},
-	{0.609,0.359,0.609},
-	{0.734,0.359,0.609},
-	{0.859,0.359,0.609},
-	{0.984,0.359,0.609},
-	{0.234,0.484,0.609},
-	{0.359,0.484,0.609},
-	{0.484,0.484,0.609},
-	{0.609,0.484,0.609},
-	{0.734,0.484,0.609},
-	{0.859,0.484,0.609},
-	{0.984,0.484,0.609},
-	{0.234,0.609,0.609},
-	{0.359,0.609,0.609},
-	{0.484,0.609,0.609},
-	{0.609,0.609,0.609},
-	{0.734,0.609,0.609},
-	{0.859,0.609,0.609},
-	{0.984,0.609,0.609},
-	{0.234,0.734,0.609},
-	{0.359,0.734,0.609},
-	{0.484,0.734,0.609},
-	{0.609,0.734,0.609},
-	{0.734,0.734,0.609},
-	{0.859,0.734,0.609},
-	{0.984,0.734,0.609},
-	{0.234,0.859,0.609},
-	{0.359,0.859,0.609},
-	{0.484,0.859,0.609},
-	{0.609,0.859,0.609},
-	{0.734,0.859,0.609},
-	{0.859,0.859,0.609},
-	{0.984,0.859,0.609},
-	{0.234,0.984,0.609},
-	{0.359,0.984,0.609},
-	{0.484,0.984,0.609},
-	{0.609,0.984,0.609},
-	{0.734,0.984,0.609},
-	{0.859,0.984,0.609},
-	{0.984,0.984,0.609},
-	{0.234,0.234,0.734},
-	{0.359,0.234,0.734},
-	{0.484,0.234,0.734},
-	{0.609,0.234,0.734},
-	{0.734,0.234,0.734},
-	{0.859,0.234,0.734},
-	{0.984,0.234,0.734},
-	{0.234,0.359,0.734},
-	{0.359,0.359,0.734},
-	{0.484,0.359,0.734},
-	{0.609,0.359,0.734},
-	{0.734,0.359,0.734},
-	{0.859,0.359,0.734},
-	{0.984,0.359,0.734},
-	{0.234,0.484,0.734},
-	{0.359,0.484,0.734},
-	{0.484,0.484,0.734},
-	{0.609,0.484,0.734},
-	{0.734,0.484,0.734},
-	{0.859,0.484,0.734},
-	{0.984,0.484,0.734},
-	{0.234,0.609,0.734},
-	{0.359,0.609,0.734},
-	{0.484,0.609,0.734},
-	{0.609,0.609,0.734},
-	{0.734,0.609,0.734},
-	{0.859,0.609,0.734},
-	{0.984,0.609,0.734},
-	{0.234,0.734,0.734},
-	{0.359,0.734,0.734},
-	{0.484,0.734,0.734},
-	{0.609,0.734,0.734},
-	{0.734,0.734,0.734},
-	{0.859,0.734,0.734},
-	{0.984,0.734,0.734},
-	{0.234,0.859,0.734},
-	{0.359,0.859,0.734},
-	{0.484,0.859,0.734},
-	{0.609,0.859,0.734},
-	{0.734,0.859,0.734},
-	{0.859,0.859,0.734},
-	{0.984,0.969,0.938},
-	{0.625,0.625,0.641},
-	{0.500,0.500,0.500},
-	{0.984,0.000,0.000},
-	{0.000,0.984,0.000},
-	{0.984,0.984,0.000},
-	{0.000,0.000,0.984},
-	{0.984,0.000,0.984},
-	{0.000,0.984,0.984},
-	{0.000,0.000,0.000}
-};
-
 /*******************************************
  *                                         *
  * Functions to compute the Mandelbrot set *
@@ -417,25 +73,253 @@ int mandel_iterations_at_point(double x, double y, int max)
 }
 
 /*
- * This function takes a color value as returned
- * by mandelbrot_iterations() and uses the 256-color
- * palette defined above to return an approximation for 256-color
- * xterms.
+ * Vector versions of the same loop, for a few points of a line at once.
+ * Each lane runs the scalar iteration step for step, with the same
+ * operations in the same order (and no fused multiply-adds, see the
+ * Makefile), so its count is bit for bit that of the scalar function.
+ * A lane stays active while it has not escaped; once it has, it keeps
+ * iterating harmlessly, but is no longer counted. The loop ends when
+ * all lanes have escaped or reached max.
+ */
+#define MANDEL_MAX_LANES 8
+
+typedef void mandel_kernel_fn(const double *x, double y, int max, int *iter);
+
+static void kernel_scalar(const double *x, double y, int max, int *iter)
+{
+	iter[0] = mandel_iterations_at_point(x[0], y, max);
+}
+
+#ifdef MANDEL_X86
+__attribute__((target("sse2")))
+static void kernel_sse2(const double *px, double py, int max, int *iter)
+{
+	__m128d x0 = _mm_loadu_pd(px), y0 = _mm_set1_pd(py);
+	__m128d x = x0, y = y0, xx, yy, xt;
+	__m128d two = _mm_set1_pd(2.0), four = _mm_set1_pd(4.0);
+	__m128d one = _mm_set1_pd(1.0), count = _mm_setzero_pd();
+	__m128d active = _mm_cmpeq_pd(x0, x0);
+	double c[2];
+	int k;
+
+	for (k = 0; k < max; k++) {
+		xx = _mm_mul_pd(x, x);
+		yy = _mm_mul_pd(y, y);
+		active = _mm_and_pd(active, _mm_cmple_pd(_mm_add_pd(xx, yy), four));
+		if (_mm_movemask_pd(active) == 0)
+			break;
+		count = _mm_add_pd(count, _mm_and_pd(active, one));
+
+		xt = _mm_add_pd(_mm_sub_pd(xx, yy), x0);
+		y = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, x), y), y0);
+		x = xt;
+	}
+
+	_mm_storeu_pd(c, count);
+	iter[0] = c[0];
+	iter[1] = c[1];
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(const double *px, double py, int max, int *iter)
+{
+	__m256d x0 = _mm256_loadu_pd(px), y0 = _mm256_set1_pd(py);
+	__m256d x = x0, y = y0, xx, yy, xt;
+	__m256d two = _mm256_set1_pd(2.0), four = _mm256_set1_pd(4.0);
+	__m256d one = _mm256_set1_pd(1.0), count = _mm256_setzero_pd();
+	__m256d active = _mm256_cmp_pd(x0, x0, _CMP_EQ_OQ);
+	double c[4];
+	int i, k;
+
+	for (k = 0; k < max; k++) {
+		xx = _mm256_mul_pd(x, x);
+		yy = _mm256_mul_pd(y, y);
+		active = _mm256_and_pd(active, _mm256_cmp_pd(
+			_mm256_add_pd(xx, yy), four, _CMP_LE_OQ));
+		if (_mm256_movemask_pd(active) == 0)
+			break;
+		count = _mm256_add_pd(count, _mm256_and_pd(active, one));
+
+		xt = _mm256_add_pd(_mm256_sub_pd(xx, yy), x0);
+		y = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, x), y), y0);
+		x = xt;
+	}
+
+	_mm256_storeu_pd(c, count);
+	for (i = 0; i < 4; i++)
+		iter[i] = c[i];
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512(const double *px, double py, int max, int *iter)
+{
+	__m512d x0 = _mm512_loadu_pd(px), y0 = _mm512_set1_pd(py);
+	__m512d x = x0, y = y0, xx, yy, xt;
+	__m512d two = _mm512_set1_pd(2.0), four = _mm512_set1_pd(4.0);
+	__m512d one = _mm512_set1_pd(1.0), count = _mm512_setzero_pd();
+	__mmask8 active = 0xff;
+	double c[8];
+	int i, k;
+
+	for (k = 0; k < max; k++) {
+		xx = _mm512_mul_pd(x, x);
+		yy = _mm512_mul_pd(y, y);
+		active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(xx, yy),
+			four, _CMP_LE_OQ);
+		if (active == 0)
+			break;
+		count = _mm512_mask_add_pd(count, active, count, one);
+
+		xt = _mm512_add_pd(_mm512_sub_pd(xx, yy), x0);
+		y = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, x), y), y0);
+		x = xt;
+	}
+
+	_mm512_storeu_pd(c, count);
+	for (i = 0; i < 8; i++)
+		iter[i] = c[i];
+}
+
+static int have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static int have_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+/* Best first; the last one runs anywhere */
+static const struct mandel_kernel {
+	const char *name;
+	int lanes;
+	mandel_kernel_fn *fn;
+	int (*supported)(void);
+} mandel_kernels[] = {
+#ifdef MANDEL_X86
+	{ "avx512", 8, kernel_avx512, have_avx512 },
+	{ "avx2",   4, kernel_avx2,   have_avx2 },
+	{ "sse2",   2, kernel_sse2,   have_sse2 },
+#endif
+	{ "scalar", 1, kernel_scalar, NULL }
+};
+
+#define MANDEL_NKERNELS (sizeof(mandel_kernels) / sizeof(mandel_kernels[0]))
+
+static const struct mandel_kernel *mandel_kernel;
+static pthread_once_t mandel_kernel_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Pick the best kernel the CPU can run, or the one named in the
+ * MANDEL_KERNEL environment variable, if the CPU can run it.
+ */
+static void pick_mandel_kernel(void)
+{
+	const char *want = getenv("MANDEL_KERNEL");
+	const struct mandel_kernel *k;
+
+#ifdef MANDEL_X86
+	__builtin_cpu_init();
+#endif
+	for (k = mandel_kernels; k < mandel_kernels + MANDEL_NKERNELS; k++) {
+		if (want && strcmp(want, k->name) != 0)
+			continue;
+		if (k->supported == NULL || k->supported())
+			break;
+	}
+	if (k == mandel_kernels + MANDEL_NKERNELS) {
+		fprintf(stderr, "MANDEL_KERNEL=%s is not available, "
+			"using the scalar kernel\n", want);
+		k--;
+	}
+	mandel_kernel = k;
+}
+
+const char *mandel_kernel_name(void)
+{
+	pthread_once(&mandel_kernel_once, pick_mandel_kernel);
+	return mandel_kernel->name;
+}
+
+/*
+ * Compute mandel_iterations_at_point(x[i], y, max) into iter[i],
+ * for all n points of a line, a vector of them at a time.
+ */
+void mandel_iterations_on_line(const double x[], double y, int n, int max,
+	int iter[])
+{
+	const struct mandel_kernel *k;
+	double last_x[MANDEL_MAX_LANES];
+	int last_iter[MANDEL_MAX_LANES];
+	int i, j;
+
+	pthread_once(&mandel_kernel_once, pick_mandel_kernel);
+	k = mandel_kernel;
+
+	for (i = 0; i + k->lanes <= n; i += k->lanes)
+		k->fn(x + i, y, max, iter + i);
+
+	/* The last few points, padded up to a full vector */
+	if (i < n) {
+		for (j = 0; j < k->lanes; j++)
+			last_x[j] = x[i + j < n ? i + j : n - 1];
+		k->fn(last_x, y, max, last_iter);
+		memcpy(iter + i, last_iter, (n - i) * sizeof(*iter));
+	}
+}
+
+/*
+ * The color value of a point that took iter iterations to escape,
+ * or max if it did not: the iteration count itself, in a palette of
+ * bands, or in a continuous palette, the normalized iteration count
+ * of the point. The latter is fractional, and changes continuously
+ * across the bands, so the colors blend into each other; to find it,
+ * the point's iterations are run again, which costs no more than the
+ * point took to compute, as the interior points are left out.
+ */
+int mandel_color_index(double x, double y, int iter, int max)
+{
+	double x0 = x, y0 = y, xt, nu;
+	int i;
+
+	if (!palette->continuous)
+		return iter > 255 ? 255 : iter;
+	if (iter >= max)
+		return 255;
+
+	/* Two more iterations than needed to escape, for less error */
+	for (i = 0; i < iter + 2; i++) {
+		xt = x * x - y * y + x0;
+		y = 2 * x * y + y0;
+		x = xt;
+	}
+	nu = iter + 3 - log2(log(sqrt(x * x + y * y)));
+	if (nu < 0)
+		nu = 0;
+
+	/* Around one cycle of the palette per 10x the iterations */
+	return (int)(log(nu + 1) * 255 / log(10)) % 255;
+}
+
+/*
+ * This function takes a color value, as returned
+ * by mandel_color_index(), and returns its
+ * approximation in the palette of 256-color xterms.
  */
 unsigned char xterm_color(int color_val)
 {
-	unsigned char rgb[3];
+	if (color_val > 255)
+		color_val = 255;
+
+	return palette->xterm[color_val];
+}
 
+/*
+ * The 24-bit color of a color value, for truecolor terminals:
+ * the same palette entry xterm_color() approximates.
+ */
+void mandel_rgb(int color_val, unsigned char rgb[3])
+{
 	if (color_val > 255)
 		color_val = 255;
 
-	rgb[0] = 255.0 * mandel256[color_val].red;
-	rgb[1] = 255.0 * mandel256[color_val].green;
-	rgb[2] = 255.0 * mandel256[color_val].blue;
-	color_val = rgb2xterm(rgb);
-	
-	assert(0 <= color_val && color_val <= 255);
-	return color_val;
+	memcpy(rgb, palette->rgb[color_val], 3);
 }
 
 /*
@@ -484,3 +368,128 @@ void reset_xterm_color(int fd)
 		exit(1);
 	}
 }
+
+/*******************************************
+ *                                         *
+ * A buffered renderer                     *
+ *                                         *
+ *******************************************/
+
+void render_init(struct mandel_render *r, int truecolor, int half)
+{
+	r->truecolor = truecolor;
+	r->half = half;
+	r->len = 0;
+	r->size = 4096;
+	r->fg = r->bg = -1;
+	if ((r->buf = malloc(r->size)) == NULL) {
+		perror("render_init: malloc");
+		exit(1);
+	}
+}
+
+/* Make room for count more bytes in the buffer */
+static void render_reserve(struct mandel_render *r, size_t count)
+{
+	if (r->len + count <= r->size)
+		return;
+	while (r->len + count > r->size)
+		r->size *= 2;
+	if ((r->buf = realloc(r->buf, r->size)) == NULL) {
+		perror("render_reserve: realloc");
+		exit(1);
+	}
+}
+
+/* An xterm color index, or a truecolor one as 0xRRGGBB */
+static int render_color(struct mandel_render *r, int color_val)
+{
+	unsigned char rgb[3];
+
+	if (!r->truecolor)
+		return xterm_color(color_val);
+	mandel_rgb(color_val, rgb);
+	return rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+}
+
+/* Append the parameters of an SGR sequence setting color c, at 38 or 48 */
+static void render_sgr_color(struct mandel_render *r, int base, int c)
+{
+	if (r->truecolor)
+		r->len += sprintf(r->buf + r->len, "%d;2;%d;%d;%d", base,
+			c >> 16, (c >> 8) & 0xff, c & 0xff);
+	else
+		r->len += sprintf(r->buf + r->len, "%d;5;%d", base, c);
+}
+
+/* Set the foreground, and the background unless bg < 0, if they changed */
+static void render_set_colors(struct mandel_render *r, int fg, int bg)
+{
+	int set_fg = fg != r->fg, set_bg = bg >= 0 && bg != r->bg;
+
+	if (!set_fg && !set_bg)
+		return;
+
+	r->len += sprintf(r->buf + r->len, "\033[");
+	if (set_fg)
+		render_sgr_color(r, 38, fg);
+	if (set_fg && set_bg)
+		r->buf[r->len++] = ';';
+	if (set_bg)
+		render_sgr_color(r, 48, bg);
+	r->buf[r->len++] = 'm';
+
+	r->fg = fg;
+	if (set_bg)
+		r->bg = bg;
+}
+
+/*
+ * Append a row of n characters, for the color values in top[], and in
+ * bottom[] too with half blocks.
+ */
+void render_row(struct mandel_render *r, const int *top, const int *bottom,
+	int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* Room for two colors, a character and the end of the line */
+		render_reserve(r, 64);
+		if (r->half) {
+			render_set_colors(r, render_color(r, top[i]),
+				render_color(r, bottom[i]));
+			memcpy(r->buf + r->len, "\xe2\x96\x80", 3);  /* U+2580 */
+			r->len += 3;
+		} else {
+			render_set_colors(r, render_color(r, top[i]), -1);
+			r->buf[r->len++] = '@';
+		}
+	}
+
+	/* Do not let the background color spill over the end of the line */
+	render_reserve(r, 8);
+	if (r->half) {
+		memcpy(r->buf + r->len, "\033[0m", 4);
+		r->len += 4;
+		r->fg = r->bg = -1;
+	}
+	r->buf[r->len++] = '\n';
+}
+
+/* Write out everything rendered so far, with a single write() */
+void render_flush(struct mandel_render *r, int fd)
+{
+	if (r->len == 0)
+		return;
+	if (insist_write(fd, r->buf, r->len) != r->len) {
+		perror("render_flush: insist_write");
+		exit(1);
+	}
+	r->len = 0;
+}
+
+void render_destroy(struct mandel_render *r)
+{
+	free(r->buf);
+}
@@ -11,9 +11,40 @@
 
 /* Function prototypes */
 int mandel_iterations_at_point(double x, double y, int max);
+void mandel_iterations_on_line(const double x[], double y, int n, int max,
+	int iter[]);
+const char *mandel_kernel_name(void);
+int mandel_set_palette(const char *name);
+int mandel_color_index(double x, double y, int iter, int max);
 unsigned char xterm_color(int color_val);
 ssize_t insist_write(int fd, const char *buf, size_t count);
 void set_xterm_color(int fd, unsigned char color);
 void reset_xterm_color(int fd);
+void mandel_rgb(int color_val, unsigned char rgb[3]);
+
+/*
+ * A renderer, which draws rows of color values into a buffer in memory,
+ * to be written out in one go. A color escape is only output when the
+ * color changes. Colors are either xterm-256 ones, or 24-bit truecolor
+ * ones; and a row is either one line of '@', or, with half blocks, two
+ * lines: the upper half of each character in the color of the first
+ * line and the lower half in that of the second.
+ */
+struct mandel_render {
+	int truecolor;
+	int half;
+
+	char *buf;
+	size_t len;
+	size_t size;
+
+	int fg, bg;     /* colors currently set, -1 if unknown */
+};
+
+void render_init(struct mandel_render *r, int truecolor, int half);
+void render_row(struct mandel_render *r, const int *top, const int *bottom,
+	int n);
+void render_flush(struct mandel_render *r, int fd);
+void render_destroy(struct mandel_render *r);
 
 #endif /* MANDEL_LIB_H__ */
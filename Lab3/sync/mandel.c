@@ -13,9 +13,9 @@
 #include <stdlib.h>
 #include <errno.h>
 
-#include <semaphore.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #include "mandel-lib.h"
 
@@ -34,12 +34,54 @@ int NTHREADS = 1;
 typedef struct
 {
 	pthread_t tid; /* POSIX thread id, as returned by the library */
-	int line;
-	sem_t sem;
+	int thrid;
+
+	/* Seconds spent computing and blocked, and work items done */
+	double busy;
+	double blocked;
+	int items;
 } thread_info_struct;
 
 thread_info_struct *threads;
 
+/*
+ * Work is handed out in items of chunk lines by tile_w columns, line
+ * block by line block. With dynamic scheduling (the default) a thread
+ * takes the next item from an atomic counter whenever it is done with
+ * one, so no thread idles while another still has lines to go; with
+ * -s, thread t does items t, t + NTHREADS, ... as it used to.
+ */
+int chunk = 1;
+int tile_w;
+int static_sched;
+int report;
+
+int ntiles_x, nitems;
+int next_item;
+
+/*
+ * The reorder buffer: line l is computed into slot l % buf_lines of
+ * buf[], once the writer thread has written out line l - buf_lines,
+ * and remaining[] counts the tiles of the slot's line still to go.
+ * The writer writes the lines out in order, each as soon as it is
+ * complete, while the workers go on with later lines; a worker only
+ * waits when its item is too far ahead for the buffer.
+ *
+ * next_output and remaining[] are protected by buf_lock. Workers wait
+ * on buf_room for the writer to move on, the writer on buf_ready for
+ * the next line to be complete.
+ */
+int buf_lines;
+int *buf;
+int *remaining;
+int next_output;
+pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t buf_room = PTHREAD_COND_INITIALIZER;
+pthread_cond_t buf_ready = PTHREAD_COND_INITIALIZER;
+
+/* CPU time the writer spent writing out */
+double writer_output;
+
 // .................................
 
 /***************************
@@ -52,6 +94,16 @@ thread_info_struct *threads;
 int y_chars = 50;
 int x_chars = 90;
 
+/*
+ * Each row of output is row_lines computed lines: 2 with -H, which
+ * draws each character as two half blocks. nlines are computed in all.
+ */
+int row_lines = 1;
+int nlines;
+
+/* With -T, draw in 24-bit color instead of the xterm-256 palette */
+int truecolor;
+
 /*
  * The part of the complex plane to be drawn:
  * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
@@ -66,74 +118,55 @@ double ymin = -1.0, ymax = 1.0;
 double xstep;
 double ystep;
 
+/* The x value of every column, as stepping along a line from xmin */
+double *xs;
+
 /*
- * This function computes a line of output
- * as an array of x_char color values.
+ * This function computes count points of a line of output, from
+ * column first on, as color values in color_val[first] onwards.
  */
-void compute_mandel_line(int line, int color_val[])
+void compute_mandel_line(int line, int first, int count, int color_val[])
 {
-	/*
-	 * x and y traverse the complex plane.
-	 */
-	double x, y;
+	double y;
 
 	int n;
-	int val;
 
 	/* Find out the y value corresponding to this line */
 	y = ymax - ystep * line;
 
-	/* and iterate for all points on this line */
-	for (x = xmin, n = 0; n < x_chars; x += xstep, n++)
-	{
-
-		/* Compute the point's color value */
-		val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
-		if (val > 255)
-			val = 255;
-
-		/* And store it in the color_val[] array */
-		val = xterm_color(val);
-		color_val[n] = val;
-	}
-}
-
-/*
- * This function outputs an array of x_char color values
- * to a 256-color xterm.
- */
-void output_mandel_line(int fd, int color_val[])
-{
-	int i;
-
-	char point = '@';
-	char newline = '\n';
+	/* Compute the color values, several points at a time */
+	color_val += first;
+	mandel_iterations_on_line(xs + first, y, count, MANDEL_MAX_ITERATION,
+		color_val);
 
-	for (i = 0; i < x_chars; i++)
-	{
-		/* Set the current color, then output the point */
-		set_xterm_color(fd, color_val[i]);
-		if (write(fd, &point, 1) != 1)
-		{
-			perror("compute_and_output_mandel_line: write point");
-			exit(1);
-		}
-	}
-
-	/* Now that the line is done, output a newline character */
-	if (write(fd, &newline, 1) != 1)
-	{
-		perror("compute_and_output_mandel_line: write newline");
-		exit(1);
-	}
+	/* The renderer maps the color values to terminal colors */
+	for (n = 0; n < count; n++)
+		color_val[n] = mandel_color_index(xs[first + n], y, color_val[n],
+										  MANDEL_MAX_ITERATION);
 }
 
 // .................................
 void usage(char *argv0)
 {
-	fprintf(stderr, "Usage: %s NTHREADS\n\n"
+	fprintf(stderr, "Usage: %s [-c lines] [-w columns] [-b lines] [-s] [-r] [-T] [-H]\n"
+					"       [-p palette] NTHREADS\n\n"
 					"Exactly one argument required:\n"
-					"    NTHREADS: The number of threads.\n",
+					"    NTHREADS: The number of threads.\n\n"
+					"Options:\n"
+					"    -c lines: Lines per work item (default 1).\n"
+					"    -w columns: Columns per work item, for 2-D tiles\n"
+					"                (default the whole line).\n"
+					"    -b lines: Lines computed ahead of the output, at\n"
+					"              least -c, plus 1 with -H\n"
+					"              (default 2 x NTHREADS x -c).\n"
+					"    -s: Assign work items to threads round-robin,\n"
+					"        instead of on demand.\n"
+					"    -r: Report each thread's busy and idle time\n"
+					"        to stderr.\n"
+					"    -T: Use 24-bit truecolor.\n"
+					"    -H: Draw half blocks, for twice as many lines.\n"
+					"    -p palette: classic (default), or smooth or gray,\n"
+					"                which color continuously.\n",
 			argv0);
 	exit(1);
 }
@@ -181,41 +214,213 @@ void unexpectedSignal(int sign)
 	exit(1);
 }
 
-void *compute_and_output_mandel_line(void *argument)
+double seconds(clockid_t clock)
 {
+	struct timespec ts;
 
-	int line = *(int *)argument;
-	int i;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	/*
-	 * A temporary array, used to hold color values for the line being drawn
-	 */
-	int color_val[x_chars];
+/*
+ * Busy and output times are CPU time of the thread, so that threads
+ * sharing a CPU do not count each other's work as their own; blocked
+ * time is wall-clock time.
+ */
+double now(void)
+{
+	return seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* Whether all lines of the next row are complete, under buf_lock */
+int row_ready(void)
+{
+	int line;
 
-	for (i = line; i < y_chars; i += NTHREADS)
+	for (line = next_output; line < next_output + row_lines; line++)
+		if (remaining[line % buf_lines] > 0)
+			return 0;
+	return 1;
+}
+
+/*
+ * The writer thread: render the rows in order, as they complete,
+ * handing their slots back to the workers once they are rendered.
+ * Rendered rows are written out whenever the next one is not ready
+ * yet, so if the workers keep ahead, the frame goes out in one write.
+ */
+void *output_mandel_lines(void *argument)
+{
+	struct mandel_render r;
+	int line, *top, *bottom;
+	double t0;
+
+	render_init(&r, truecolor, row_lines == 2);
+
+	pthread_mutex_lock(&buf_lock);
+	while (next_output < nlines)
 	{
-		//compute mandel line
-		compute_mandel_line(i, color_val);
+		if (!row_ready())
+		{
+			if (r.len == 0)
+			{
+				pthread_cond_wait(&buf_ready, &buf_lock);
+				continue;
+			}
+			pthread_mutex_unlock(&buf_lock);
+			t0 = now();
+			render_flush(&r, STDOUT_FILENO);
+			writer_output += now() - t0;
+			pthread_mutex_lock(&buf_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&buf_lock);
+
+		t0 = now();
+		top = buf + next_output % buf_lines * x_chars;
+		bottom = buf + (next_output + row_lines - 1) % buf_lines * x_chars;
+		render_row(&r, top, bottom, x_chars);
+		writer_output += now() - t0;
+
+		pthread_mutex_lock(&buf_lock);
+		for (line = next_output; line < next_output + row_lines; line++)
+			remaining[line % buf_lines] = ntiles_x;
+		next_output += row_lines;
+		pthread_cond_broadcast(&buf_room);
+	}
+	pthread_mutex_unlock(&buf_lock);
+
+	//output mandel lines, STDOUT_FILENO for standard output
+	t0 = now();
+	render_flush(&r, STDOUT_FILENO);
+	writer_output += now() - t0;
+	render_destroy(&r);
 
-		//each thread should wait and so it uses sem_wait func
-		//with argument the semaphore referring to this particular thread
-		sem_wait(&threads[i % NTHREADS].sem);
+	return NULL;
+}
 
-		//output mandel line, STDOUT_FILENO for standard output
-		output_mandel_line(STDOUT_FILENO, color_val);
+void *compute_mandel_lines(void *argument)
+{
+	thread_info_struct *thr = argument;
+	int item, line, last, first, count;
+	struct timespec t0, t1;
+	double c0;
 
-		// send signal to the next thread
-		sem_post(&threads[((i % NTHREADS) + 1) % NTHREADS].sem);
+	for (item = thr->thrid;; item += NTHREADS)
+	{
+		//grab the next item, or the next of ours with -s
+		if (!static_sched)
+			item = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED);
+		if (item >= nitems)
+			break;
+
+		line = item / ntiles_x * chunk;
+		last = line + chunk < nlines ? line + chunk : nlines;
+		first = item % ntiles_x * tile_w;
+		count = first + tile_w < x_chars ? tile_w : x_chars - first;
+
+		//wait until all of our lines have a slot
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pthread_mutex_lock(&buf_lock);
+		while (last > next_output + buf_lines)
+			pthread_cond_wait(&buf_room, &buf_lock);
+		pthread_mutex_unlock(&buf_lock);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		thr->blocked += (t1.tv_sec - t0.tv_sec) +
+						(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+		c0 = now();
+		for (; line < last; line++)
+			compute_mandel_line(line, first, count,
+								buf + line % buf_lines * x_chars);
+		thr->busy += now() - c0;
+		thr->items++;
+
+		pthread_mutex_lock(&buf_lock);
+		for (line = item / ntiles_x * chunk; line < last; line++)
+			if (--remaining[line % buf_lines] == 0 &&
+				line < next_output + row_lines)
+				pthread_cond_signal(&buf_ready);
+		pthread_mutex_unlock(&buf_lock);
 	}
 
 	return NULL;
 }
 
+/*
+ * Idle is whatever part of the run a thread spent neither computing
+ * nor blocked on a full buffer: waiting at the end for the others to
+ * finish, or for a CPU.
+ */
+void report_load(double elapsed)
+{
+	double busy_max = 0, busy_sum = 0;
+	int i;
+
+	fprintf(stderr, "%s scheduling, %d x %d items, %.3f s\n",
+			static_sched ? "Static" : "Dynamic", chunk, tile_w, elapsed);
+	fprintf(stderr, "thread  items   busy (s) blocked (s)   idle (s)\n");
+	for (i = 0; i < NTHREADS; i++)
+	{
+		fprintf(stderr, "%6d %6d %10.3f %11.3f %10.3f\n", i,
+				threads[i].items, threads[i].busy, threads[i].blocked,
+				elapsed - threads[i].busy - threads[i].blocked);
+		busy_sum += threads[i].busy;
+		if (threads[i].busy > busy_max)
+			busy_max = threads[i].busy;
+	}
+	fprintf(stderr, "Load imbalance (max / mean busy): %.3f\n",
+			busy_sum > 0 ? busy_max * NTHREADS / busy_sum : 1.0);
+	fprintf(stderr, "Writer: %d lines through %d slots, output %.3f s\n",
+			nlines, buf_lines, writer_output);
+}
+
 int main(int argc, char *argv[])
 {
 
 	// .................................
-	if (argc != 2)
+	int opt;
+	double x, t0;
+	pthread_t writer;
+
+	while ((opt = getopt(argc, argv, "c:w:b:srTHp:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			if (safe_atoi(optarg, &chunk) < 0 || chunk <= 0)
+				usage(argv[0]);
+			break;
+		case 'w':
+			if (safe_atoi(optarg, &tile_w) < 0 || tile_w <= 0)
+				usage(argv[0]);
+			break;
+		case 'b':
+			if (safe_atoi(optarg, &buf_lines) < 0 || buf_lines <= 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			static_sched = 1;
+			break;
+		case 'r':
+			report = 1;
+			break;
+		case 'T':
+			truecolor = 1;
+			break;
+		case 'H':
+			row_lines = 2;
+			break;
+		case 'p':
+			if (mandel_set_palette(optarg) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argv += optind - 1;
+	if (argc - optind != 1)
 		usage(argv[0]);
 	if (safe_atoi(argv[1], &NTHREADS) < 0 || NTHREADS <= 0)
 	{
@@ -225,45 +430,67 @@ int main(int argc, char *argv[])
 
 	signal(SIGINT, unexpectedSignal);
 
+	nlines = y_chars * row_lines;
 	xstep = (xmax - xmin) / x_chars;
-	ystep = (ymax - ymin) / y_chars;
+	ystep = (ymax - ymin) / nlines;
 
 	int line;
 	// .................................
 
-	/* Create threads */
-	threads = safe_malloc(NTHREADS * sizeof(*threads));
+	xs = safe_malloc(x_chars * sizeof(*xs));
+	for (x = xmin, line = 0; line < x_chars; x += xstep, line++)
+		xs[line] = x;
+
+	/* Split the frame into work items */
+	if (tile_w == 0 || tile_w > x_chars)
+		tile_w = x_chars;
+	ntiles_x = (x_chars + tile_w - 1) / tile_w;
+	nitems = (nlines + chunk - 1) / chunk * ntiles_x;
 
-	// set the first semaphore as not asleep
-	if ((sem_init(&threads[0].sem, 0, 1)) == -1)
+	/*
+	 * The first unfinished item may start on the last line of the row
+	 * being waited for, and still needs a slot for each of its lines.
+	 */
+	if (buf_lines == 0)
+		buf_lines = 2 * NTHREADS * chunk;
+	if (buf_lines < chunk + row_lines - 1)
 	{
-		perror("initialization of semaphores");
+		fprintf(stderr, "-b %d is too small, %d lines needed\n",
+				buf_lines, chunk + row_lines - 1);
 		exit(1);
 	}
+	if (buf_lines > nlines)
+		buf_lines = nlines;
 
-	// set the rest of the semaphores to wait
-	for (line = 1; line < NTHREADS; ++line)
-	{
-		if ((sem_init(&threads[line].sem, 0, 0)) == -1)
-		{
-			perror("initialization of semaphores");
-			exit(1);
-		}
-	}
+	buf = safe_malloc(buf_lines * x_chars * sizeof(*buf));
+	remaining = safe_malloc(buf_lines * sizeof(*remaining));
+	for (line = 0; line < buf_lines; ++line)
+		remaining[line] = ntiles_x;
+
+	/* Create threads */
+	threads = safe_malloc(NTHREADS * sizeof(*threads));
 
 	/*
 	 * Create NTHREADS
 	*/
+	t0 = seconds(CLOCK_MONOTONIC);
 	for (line = 0; line < NTHREADS; ++line)
 	{
-		threads[line].line = line;
+		threads[line].thrid = line;
+		threads[line].busy = threads[line].blocked = 0;
+		threads[line].items = 0;
 		if ((
-				pthread_create(&threads[line].tid, NULL, compute_and_output_mandel_line, &threads[line].line)) != 0)
+				pthread_create(&threads[line].tid, NULL, compute_mandel_lines, &threads[line])) != 0)
 		{
 			perror("creation of threads");
 			exit(1);
 		}
 	}
+	if (pthread_create(&writer, NULL, output_mandel_lines, NULL) != 0)
+	{
+		perror("creation of the writer thread");
+		exit(1);
+	}
 
 	/*
 	 * Wait for all threads to terminate
@@ -277,16 +504,17 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 	}
+	pthread_join(writer, NULL);
 
-	// destroy all semaphores
-	for (line = 0; line < NTHREADS; ++line)
-	{
-		sem_destroy(&threads[line].sem);
-	}
+	reset_xterm_color(1);
+	if (report)
+		report_load(seconds(CLOCK_MONOTONIC) - t0);
 
 	// free allocated space
 	free(threads);
+	free(remaining);
+	free(buf);
+	free(xs);
 
-	reset_xterm_color(1);
 	return 0;
 }
@@ -0,0 +1,478 @@
+/*
+ * mkpalette.c
+ *
+ * Generates palette.h, the color lookup tables of mandel-lib.c:
+ * for each palette, the 24-bit color and the nearest xterm-256 color
+ * of each of the 256 color values. Finding the nearest xterm color is
+ * a search over the whole xterm palette, so it is done here, once at
+ * build time, instead of for every point drawn.
+ *
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+/*****************************************
+ *                                       *
+ * Functions to manage a 256-color xterm *
+ *                                       *
+ *****************************************/
+
+/* 3 functions to convert between RGB colors and the corresponding xterm-256 values
+ * Wolfgang Frisch, xororand@frexx.de */
+
+
+// whole colortable, filled by maketable()
+static int initialized=0;
+static unsigned char colortable[254][3];
+
+// the 6 value iterations en the xterm color cube
+static const unsigned char valuerange[] = { 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF };
+
+// 16 basic colors
+static const unsigned char basic16[16][3] =
+{
+	{ 0x00, 0x00, 0x00 }, // 0
+	{ 0xCD, 0x00, 0x00 }, // 1
+	{ 0x00, 0xCD, 0x00 }, // 2
+	{ 0xCD, 0xCD, 0x00 }, // 3
+	{ 0x00, 0x00, 0xEE }, // 4
+	{ 0xCD, 0x00, 0xCD }, // 5
+	{ 0x00, 0xCD, 0xCD }, // 6
+	{ 0xE5, 0xE5, 0xE5 }, // 7
+	{ 0x7F, 0x7F, 0x7F }, // 8
+	{ 0xFF, 0x00, 0x00 }, // 9
+	{ 0x00, 0xFF, 0x00 }, // 10
+	{ 0xFF, 0xFF, 0x00 }, // 11
+	{ 0x5C, 0x5C, 0xFF }, // 12
+	{ 0xFF, 0x00, 0xFF }, // 13
+	{ 0x00, 0xFF, 0xFF }, // 14
+	{ 0xFF, 0xFF, 0xFF }  // 15
+};
+
+// convert an xterm color value (0-253) to 3 unsigned chars rgb
+static void xterm2rgb(unsigned char color, unsigned char* rgb)
+{
+	// 16 basic colors
+	if(color<16)
+	{
+		rgb[0] = basic16[color][0];
+		rgb[1] = basic16[color][1];
+		rgb[2] = basic16[color][2];
+	}
+	
+	// color cube color
+	if(color>=16 && color<=232)
+	{
+		color-=16;
+		rgb[0] = valuerange[(color/36)%6];
+		rgb[1] = valuerange[(color/6)%6];
+		rgb[2] = valuerange[color%6];
+	}
+	
+	// gray tone
+	if(color>=233 && color<=253)
+	{
+		rgb[0]=rgb[1]=rgb[2] = 8+(color-232)*0x0a;
+	}
+}
+
+// fill the colortable for use with rgb2xterm
+static void maketable()
+{
+	unsigned char c, rgb[3] = {0, 0, 0};
+	for(c=0;c<=253;c++)
+	{
+		xterm2rgb(c,rgb);
+		colortable[c][0] = rgb[0];
+		colortable[c][1] = rgb[1];
+		colortable[c][2] = rgb[2];
+	}
+}
+
+// selects the nearest xterm color for a 3xBYTE rgb value
+static unsigned char rgb2xterm(unsigned char* rgb)
+{
+	unsigned char c, best_match=0;
+	double d, smallest_distance;
+
+	if(!initialized)
+	{
+		maketable();
+		initialized=1;
+	}
+
+	smallest_distance = 10000000000.0;
+	
+	for(c=0;c<=253;c++)
+	{
+		d = pow(colortable[c][0]-rgb[0],2.0) + 
+			pow(colortable[c][1]-rgb[1],2.0) + 
+			pow(colortable[c][2]-rgb[2],2.0);
+		if(d<smallest_distance)
+		{
+			smallest_distance = d;
+			best_match=c;
+		}
+	}
+
+	return best_match;
+}
+
+
+/*******************************************
+ *                                         *
+ * A nice 256-color palette for drawing    *
+ * the Mandelbrot Set.                     *
+ *                                         *
+ *******************************************/
+
+static struct { double red; double green; double blue; } mandel256[] = {
+	{0.000,0.000,0.734},
+	{0.000,0.300,0.734},
+	{0.000,0.734,0.000},
+	{0.734,0.734,0.000},
+	{0.734,0.000,0.000},
+	{0.734,0.000,0.734},
+	{0.000,0.734,0.734},
+	{0.750,0.750,0.750},
+	{0.750,0.859,0.750},
+	{0.641,0.781,0.938},
+	{0.500,0.000,0.000},
+	{0.000,0.500,0.000},
+	{0.500,0.500,0.000},
+	{0.000,0.000,0.500},
+	{0.500,0.000,0.500},
+	{0.000,0.500,0.500},
+	{0.234,0.359,0.234},
+	{0.359,0.359,0.234},
+	{0.484,0.359,0.234},
+	{0.609,0.359,0.234},
+	{0.734,0.359,0.234},
+	{0.859,0.359,0.234},
+	{0.984,0.359,0.234},
+	{0.234,0.484,0.234},
+	{0.359,0.484,0.234},
+	{0.484,0.484,0.234},
+	{0.609,0.484,0.234},
+	{0.734,0.484,0.234},
+	{0.859,0.484,0.234},
+	{0.984,0.484,0.234},
+	{0.234,0.609,0.234},
+	{0.359,0.609,0.234},
+	{0.484,0.609,0.234},
+	{0.609,0.609,0.234},
+	{0.734,0.609,0.234},
+	{0.859,0.609,0.234},
+	{0.984,0.609,0.234},
+	{0.234,0.734,0.234},
+	{0.359,0.734,0.234},
+	{0.484,0.734,0.234},
+	{0.609,0.734,0.234},
+	{0.734,0.734,0.234},
+	{0.859,0.734,0.234},
+	{0.984,0.734,0.234},
+	{0.234,0.859,0.234},
+	{0.359,0.859,0.234},
+	{0.484,0.859,0.234},
+	{0.609,0.859,0.234},
+	{0.734,0.859,0.234},
+	{0.859,0.859,0.234},
+	{0.984,0.859,0.234},
+	{0.234,0.984,0.234},
+	{0.359,0.984,0.234},
+	{0.484,0.984,0.234},
+	{0.609,0.984,0.234},
+	{0.734,0.984,0.234},
+	{0.859,0.984,0.234},
+	{0.984,0.984,0.234},
+	{0.234,0.234,0.359},
+	{0.359,0.234,0.359},
+	{0.484,0.234,0.359},
+	{0.609,0.234,0.359},
+	{0.734,0.234,0.359},
+	{0.859,0.234,0.359},
+	{0.984,0.234,0.359},
+	{0.234,0.359,0.359},
+	{0.359,0.359,0.359},
+	{0.484,0.359,0.359},
+	{0.609,0.359,0.359},
+	{0.734,0.359,0.359},
+	{0.859,0.359,0.359},
+	{0.984,0.359,0.359},
+	{0.234,0.484,0.359},
+	{0.359,0.484,0.359},
+	{0.484,0.484,0.359},
+	{0.609,0.484,0.359},
+	{0.734,0.484,0.359},
+	{0.859,0.484,0.359},
+	{0.984,0.484,0.359},
+	{0.234,0.609,0.359},
+	{0.359,0.609,0.359},
+	{0.484,0.609,0.359},
+	{0.609,0.609,0.359},
+	{0.734,0.609,0.359},
+	{0.859,0.609,0.359},
+	{0.984,0.609,0.359},
+	{0.234,0.734,0.359},
+	{0.359,0.734,0.359},
+	{0.484,0.734,0.359},
+	{0.609,0.734,0.359},
+	{0.734,0.734,0.359},
+	{0.859,0.734,0.359},
+	{0.984,0.734,0.359},
+	{0.234,0.859,0.359},
+	{0.359,0.859,0.359},
+	{0.484,0.859,0.359},
+	{0.609,0.859,0.359},
+	{0.734,0.859,0.359},
+	{0.859,0.859,0.359},
+	{0.984,0.859,0.359},
+	{0.234,0.984,0.359},
+	{0.359,0.984,0.359},
+	{0.484,0.984,0.359},
+	{0.609,0.984,0.359},
+	{0.734,0.984,0.359},
+	{0.859,0.984,0.359},
+	{0.984,0.984,0.359},
+	{0.234,0.234,0.484},
+	{0.359,0.234,0.484},
+	{0.484,0.234,0.484},
+	{0.609,0.234,0.484},
+	{0.734,0.234,0.484},
+	{0.859,0.234,0.484},
+	{0.984,0.234,0.484},
+	{0.234,0.359,0.484},
+	{0.359,0.359,0.484},
+	{0.484,0.359,0.484},
+	{0.609,0.359,0.484},
+	{0.734,0.359,0.484},
+	{0.859,0.359,0.484},
+	{0.984,0.359,0.484},
+	{0.234,0.484,0.484},
+	{0.359,0.484,0.484},
+	{0.484,0.484,0.484},
+	{0.609,0.484,0.484},
+	{0.734,0.484,0.484},
+	{0.859,0.484,0.484},
+	{0.984,0.484,0.484},
+	{0.234,0.609,0.484},
+	{0.359,0.609,0.484},
+	{0.484,0.609,0.484},
+	{0.609,0.609,0.484},
+	{0.734,0.609,0.484},
+	{0.859,0.609,0.484},
+	{0.984,0.609,0.484},
+	{0.234,0.734,0.484},
+	{0.359,0.734,0.484},
+	{0.484,0.734,0.484},
+	{0.609,0.734,0.484},
+	{0.734,0.734,0.484},
+	{0.859,0.734,0.484},
+	{0.984,0.734,0.484},
+	{0.234,0.859,0.484},
+	{0.359,0.859,0.484},
+	{0.484,0.859,0.484},
+	{0.609,0.859,0.484},
+	{0.734,0.859,0.484},
+	{0.859,0.859,0.484},
+	{0.984,0.859,0.484},
+	{0.234,0.984,0.484},
+	{0.359,0.984,0.484},
+	{0.484,0.984,0.484},
+	{0.609,0.984,0.484},
+	{0.734,0.984,0.484},
+	{0.859,0.984,0.484},
+	{0.984,0.984,0.484},
+	{0.234,0.234,0.609},
+	{0.359,0.234,0.609},
+	{0.484,0.234,0.609},
+	{0.609,0.234,0.609},
+	{0.734,0.234,0.609},
+	{0.859,0.234,0.609},
+	{0.984,0.234,0.609},
+	{0.234,0.359,0.609},
+	{0.359,0.359,0.609},
+	{0.484,0.359,0.609},
+	{0.609,0.359,0.609},
+	{0.734,0.359,0.609},
+	{0.859,0.359,0.609},
+	{0.984,0.359,0.609},
+	{0.234,0.484,0.609},
+	{0.359,0.484,0.609},
+	{0.484,0.484,0.609},
+	{0.609,0.484,0.609},
+	{0.734,0.484,0.609},
+	{0.859,0.484,0.609},
+	{0.984,0.484,0.609},
+	{0.234,0.609,0.609},
+	{0.359,0.609,0.609},
+	{0.484,0.609,0.609},
+	{0.609,0.609,0.609},
+	{0.734,0.609,0.609},
+	{0.859,0.609,0.609},
+	{0.984,0.609,0.609},
+	{0.234,0.734,0.609},
+	{0.359,0.734,0.609},
+	{0.484,0.734,0.609},
+	{0.609,0.734,0.609},
+	{0.734,0.734,0.609},
+	{0.859,0.734,0.609},
+	{0.984,0.734,0.609},
+	{0.234,0.859,0.609},
+	{0.359,0.859,0.609},
+	{0.484,0.859,0.609},
+	{0.609,0.859,0.609},
+	{0.734,0.859,0.609},
+	{0.859,0.859,0.609},
+	{0.984,0.859,0.609},
+	{0.234,0.984,0.609},
+	{0.359,0.984,0.609},
+	{0.484,0.984,0.609},
+	{0.609,0.984,0.609},
+	{0.734,0.984,0.609},
+	{0.859,0.984,0.609},
+	{0.984,0.984,0.609},
+	{0.234,0.234,0.734},
+	{0.359,0.234,0.734},
+	{0.484,0.234,0.734},
+	{0.609,0.234,0.734},
+	{0.734,0.234,0.734},
+	{0.859,0.234,0.734},
+	{0.984,0.234,0.734},
+	{0.234,0.359,0.734},
+	{0.359,0.359,0.734},
+	{0.484,0.359,0.734},
+	{0.609,0.359,0.734},
+	{0.734,0.359,0.734},
+	{0.859,0.359,0.734},
+	{0.984,0.359,0.734},
+	{0.234,0.484,0.734},
+	{0.359,0.484,0.734},
+	{0.484,0.484,0.734},
+	{0.609,0.484,0.734},
+	{0.734,0.484,0.734},
+	{0.859,0.484,0.734},
+	{0.984,0.484,0.734},
+	{0.234,0.609,0.734},
+	{0.359,0.609,0.734},
+	{0.484,0.609,0.734},
+	{0.609,0.609,0.734},
+	{0.734,0.609,0.734},
+	{0.859,0.609,0.734},
+	{0.984,0.609,0.734},
+	{0.234,0.734,0.734},
+	{0.359,0.734,0.734},
+	{0.484,0.734,0.734},
+	{0.609,0.734,0.734},
+	{0.734,0.734,0.734},
+	{0.859,0.734,0.734},
+	{0.984,0.734,0.734},
+	{0.234,0.859,0.734},
+	{0.359,0.859,0.734},
+	{0.484,0.859,0.734},
+	{0.609,0.859,0.734},
+	{0.734,0.859,0.734},
+	{0.859,0.859,0.734},
+	{0.984,0.969,0.938},
+	{0.625,0.625,0.641},
+	{0.500,0.500,0.500},
+	{0.984,0.000,0.000},
+	{0.000,0.984,0.000},
+	{0.984,0.984,0.000},
+	{0.000,0.000,0.984},
+	{0.984,0.000,0.984},
+	{0.000,0.984,0.984},
+	{0.000,0.000,0.000}
+};
+
+/*******************************************
+ *                                         *
+ * The palettes                            *
+ *                                         *
+ *******************************************/
+
+/*
+ * Color value 255 is for points that never escaped, and always black
+ * in the continuous palettes, whose other 255 entries cycle.
+ */
+#define NCOLORS 256
+
+static void classic(int i, unsigned char *rgb)
+{
+	rgb[0] = 255.0 * mandel256[i].red;
+	rgb[1] = 255.0 * mandel256[i].green;
+	rgb[2] = 255.0 * mandel256[i].blue;
+}
+
+/* A cosine gradient through blue, white and orange, back to blue */
+static void smooth(int i, unsigned char *rgb)
+{
+	static const double phase[3] = { 0.60, 0.70, 0.80 };
+	double t = (double)i / (NCOLORS - 1);
+	int c;
+
+	for (c = 0; c < 3; c++)
+		rgb[c] = i == NCOLORS - 1 ? 0 :
+			255.0 * (0.5 + 0.5 * cos(2 * M_PI * (t + phase[c])));
+}
+
+/* Dark to light and back */
+static void gray(int i, unsigned char *rgb)
+{
+	double t = (double)i / (NCOLORS - 1);
+
+	rgb[0] = rgb[1] = rgb[2] = i == NCOLORS - 1 ? 0 :
+		255.0 * (0.5 - 0.5 * cos(2 * M_PI * t));
+}
+
+static const struct {
+	const char *name;
+	int continuous;         /* see mandel_color_index() */
+	void (*color)(int i, unsigned char *rgb);
+} palettes[] = {
+	{ "classic", 0, classic },
+	{ "smooth",  1, smooth },
+	{ "gray",    1, gray }
+};
+
+#define NPALETTES (sizeof(palettes) / sizeof(palettes[0]))
+
+int main(void)
+{
+	unsigned char rgb[3];
+	unsigned p, i;
+
+	printf("/*\n * palette.h\n *\n * Generated by mkpalette, do not edit.\n */\n\n");
+	printf("#ifndef PALETTE_H__\n#define PALETTE_H__\n\n");
+	printf("#define MANDEL_NPALETTES %u\n\n", (unsigned)NPALETTES);
+	printf("static const struct mandel_palette {\n"
+		"\tconst char *name;\n"
+		"\tint continuous;\n"
+		"\tunsigned char rgb[%d][3];\n"
+		"\tunsigned char xterm[%d];\n"
+		"} mandel_palettes[MANDEL_NPALETTES] = {\n", NCOLORS, NCOLORS);
+
+	for (p = 0; p < NPALETTES; p++) {
+		printf("\t{ \"%s\", %d,\n\t  {", palettes[p].name,
+			palettes[p].continuous);
+		for (i = 0; i < NCOLORS; i++) {
+			palettes[p].color(i, rgb);
+			printf("%s{%d,%d,%d}", i % 8 ? " " : "\n\t\t",
+				rgb[0], rgb[1], rgb[2]);
+			if (i + 1 < NCOLORS)
+				putchar(',');
+		}
+		printf(" },\n\t  {");
+		for (i = 0; i < NCOLORS; i++) {
+			palettes[p].color(i, rgb);
+			printf("%s%d", i % 16 ? " " : "\n\t\t", rgb2xterm(rgb));
+			if (i + 1 < NCOLORS)
+				putchar(',');
+		}
+		printf(" } }%s\n", p + 1 < NPALETTES ? "," : "");
+	}
+	printf("};\n\n#endif /* PALETTE_H__ */\n");
+
+	return 0;
+}
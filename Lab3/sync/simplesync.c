@@ -8,11 +8,16 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+
+#include "counters.h"
 
 /*
  * POSIX thread functions do not return error numbers in errno,
@@ -28,12 +33,16 @@
 
 #define N 10000000
 
+/* Largest per-thread delta of the approximate counter */
+#define APPROX_THRESHOLD 1024
+
 /* Dots indicate lines where you are free to insert code at will */
 /*...*/
 pthread_mutex_t mutex;
 
-#if defined(SYNC_ATOMIC) ^ defined(SYNC_MUTEX) == 0
-#error You must #define exactly one of SYNC_ATOMIC or SYNC_MUTEX.
+#if defined(SYNC_ATOMIC) + defined(SYNC_MUTEX) + defined(SYNC_SHARDED) + \
+	defined(SYNC_PERCPU) + defined(SYNC_APPROX) != 1
+#error You must #define exactly one of SYNC_ATOMIC, SYNC_MUTEX, SYNC_SHARDED, SYNC_PERCPU or SYNC_APPROX.
 #endif
 
 #if defined(SYNC_ATOMIC)
@@ -42,15 +51,65 @@ pthread_mutex_t mutex;
 #define USE_ATOMIC_OPS 0
 #endif
 
+/*
+ * The counters of counters.h do not update the variable itself: each
+ * thread adds to its part of the counter, and main() reads the total
+ * into the variable once all threads are done.
+ */
+#if defined(SYNC_SHARDED)
+#define USE_COUNTER 1
+struct sharded_counter counter;
+#define counter_init(nthr) sharded_counter_init(&counter, nthr)
+#define counter_add(id, d) sharded_counter_add(&counter, id, d)
+#define counter_final() sharded_counter_read(&counter)
+#elif defined(SYNC_PERCPU)
+#define USE_COUNTER 1
+struct percpu_counter counter;
+#define counter_init(nthr) percpu_counter_init(&counter)
+#define counter_add(id, d) percpu_counter_add(&counter, d)
+#define counter_final() percpu_counter_read(&counter)
+#elif defined(SYNC_APPROX)
+#define USE_COUNTER 1
+struct approx_counter counter;
+#define counter_init(nthr) approx_counter_init(&counter, nthr, APPROX_THRESHOLD)
+#define counter_add(id, d) approx_counter_add(&counter, id, d)
+#define counter_final() (approx_counter_sync(&counter), \
+	approx_counter_read(&counter))
+#else
+#define USE_COUNTER 0
+#define counter_init(nthr) do { } while (0)
+#define counter_add(id, d) do { } while (0)
+#define counter_final() 0
+#endif
+
+/*
+ * A (distinct) instance of this structure
+ * is passed to each thread
+ */
+struct thread_info_struct
+{
+	pthread_t tid; /* POSIX thread id, as returned by the library */
+
+	volatile int *ip;
+	int thrid; /* Application-defined thread id */
+};
+
+int iterations = N;
+
 void *increase_fn(void *arg)
 {
 	int i, ret;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 
-	fprintf(stderr, "About to increase variable %d times\n", N);
-	for (i = 0; i < N; i++)
+	fprintf(stderr, "About to increase variable %d times\n", iterations);
+	for (i = 0; i < iterations; i++)
 	{
-		if (USE_ATOMIC_OPS)
+		if (USE_COUNTER)
+		{
+			counter_add(thr->thrid, 1);
+		}
+		else if (USE_ATOMIC_OPS)
 		{
 			/* ... */
 			/* You can modify the following line */
@@ -89,12 +148,17 @@ void *increase_fn(void *arg)
 void *decrease_fn(void *arg)
 {
 	int i, ret;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 
-	fprintf(stderr, "About to decrease variable %d times\n", N);
-	for (i = 0; i < N; i++)
+	fprintf(stderr, "About to decrease variable %d times\n", iterations);
+	for (i = 0; i < iterations; i++)
 	{
-		if (USE_ATOMIC_OPS)
+		if (USE_COUNTER)
+		{
+			counter_add(thr->thrid, -1);
+		}
+		else if (USE_ATOMIC_OPS)
 		{
 			/* ... */
 			/* You can modify the following line */
@@ -127,10 +191,54 @@ void *decrease_fn(void *arg)
 	return NULL;
 }
 
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0')
+	{
+		*val = l;
+		return 0;
+	}
+	else
+		return -1;
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [thread_count [iterations]]\n\n"
+		"    thread_count: Total number of threads, an even number (2).\n"
+		"        Half of them increase the variable, half decrease it.\n"
+		"    iterations: How many times each thread does so, at least\n"
+		"        once (%d).\n\n",
+		argv0, N);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	int val, ret, ok;
-	pthread_t t1, t2;
+	int val, ret, ok, i, nthr;
+	struct thread_info_struct *thr;
+	struct timespec t0, t1;
+	double sec;
+
+	nthr = 2;
+	if (argc > 3)
+		usage(argv[0]);
+	if (argc > 1 && (safe_atoi(argv[1], &nthr) < 0 || nthr < 2 || nthr % 2))
+		usage(argv[0]);
+	if (argc > 2 && (safe_atoi(argv[2], &iterations) < 0 || iterations < 1))
+		usage(argv[0]);
+
+	thr = calloc(nthr, sizeof(*thr));
+	if (thr == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	counter_init(nthr);
 
 	/*
 	 * Initial value
@@ -140,28 +248,32 @@ int main(int argc, char *argv[])
 	/*
 	 * Create threads
 	 */
-	ret = pthread_create(&t1, NULL, increase_fn, &val);
-	if (ret)
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthr; i++)
 	{
-		perror_pthread(ret, "pthread_create");
-		exit(1);
-	}
-	ret = pthread_create(&t2, NULL, decrease_fn, &val);
-	if (ret)
-	{
-		perror_pthread(ret, "pthread_create");
-		exit(1);
+		thr[i].ip = &val;
+		thr[i].thrid = i;
+		ret = pthread_create(&thr[i].tid, NULL,
+			i % 2 ? decrease_fn : increase_fn, &thr[i]);
+		if (ret)
+		{
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
 	}
 
 	/*
 	 * Wait for threads to terminate
 	 */
-	ret = pthread_join(t1, NULL);
-	if (ret)
-		perror_pthread(ret, "pthread_join");
-	ret = pthread_join(t2, NULL);
-	if (ret)
-		perror_pthread(ret, "pthread_join");
+	for (i = 0; i < nthr; i++)
+	{
+		ret = pthread_join(thr[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (USE_COUNTER)
+		val = counter_final();
 
 	/*
 	 * Is everything OK?
@@ -170,5 +282,9 @@ int main(int argc, char *argv[])
 
 	printf("%sOK, val = %d.\n", ok ? "" : "NOT ", val);
 
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "%d threads, %.3f s, %.1f ns per update\n", nthr, sec,
+		sec * 1e9 / ((double)nthr * iterations));
+
 	return ok;
 }
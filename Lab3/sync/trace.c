@@ -0,0 +1,175 @@
+/*
+ * trace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void *xmalloc(size_t size)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		fprintf(stderr, "trace: out of memory, failed to allocate "
+			"%zd bytes\n", size);
+		exit(1);
+	}
+
+	return p;
+}
+
+struct trace *trace_create(int nrings, unsigned long events_per_ring,
+	const struct trace_type *types)
+{
+	struct trace *t = xmalloc(sizeof(*t));
+	unsigned long n = 1;
+	int i;
+
+	while (n < events_per_ring)
+		n <<= 1;
+
+	t->nrings = nrings;
+	t->types = types;
+	if (posix_memalign((void **)&t->ring, sizeof(*t->ring),
+			nrings * sizeof(*t->ring)) != 0) {
+		fprintf(stderr, "trace: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nrings; i++) {
+		t->ring[i].head = 0;
+		t->ring[i].mask = n - 1;
+		t->ring[i].ev = xmalloc(n * sizeof(struct trace_event));
+	}
+
+	return t;
+}
+
+/*
+ * Copy the events of r still in it to out, oldest first, and return
+ * how many. The owner may be recording meanwhile: whatever it may have
+ * overwritten while we copied is dropped, once we know how far it got.
+ * The event after the last one published may be half written, so its
+ * slot counts as overwritten too.
+ */
+static unsigned long snapshot_ring(struct trace_ring *r,
+	struct trace_event *out)
+{
+	unsigned long size = r->mask + 1, head, first, last, i;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = head > size ? head - size : 0;
+	for (i = first; i < head; i++)
+		out[i - first] = r->ev[i & r->mask];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if (last + 1 > size && last + 1 - size > first) {
+		i = last + 1 - size - first;
+		if (i > head - first)
+			i = head - first;
+		memmove(out, out + i, (head - first - i) * sizeof(*out));
+		first += i;
+	}
+
+	return head - first;
+}
+
+/* An event, and where it was in the snapshot, to keep qsort() stable */
+struct sort_key {
+	unsigned long ts_ns;
+	unsigned long idx;
+};
+
+static int cmp_key(const void *a, const void *b)
+{
+	const struct sort_key *x = a, *y = b;
+
+	if (x->ts_ns != y->ts_ns)
+		return x->ts_ns < y->ts_ns ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/*
+ * All events, merged by time; events of the same time stay in the
+ * order their thread recorded them. The caller frees the array.
+ */
+static struct trace_event *collect(struct trace *t, unsigned long *count)
+{
+	struct trace_event *snap, *all;
+	struct sort_key *key;
+	unsigned long n = 0, max = 0, i;
+	int r;
+
+	for (r = 0; r < t->nrings; r++)
+		max += t->ring[r].mask + 1;
+	if (max == 0)
+		max = 1;
+	snap = xmalloc(max * sizeof(*snap));
+	for (r = 0; r < t->nrings; r++)
+		n += snapshot_ring(&t->ring[r], snap + n);
+
+	key = xmalloc(max * sizeof(*key));
+	for (i = 0; i < n; i++) {
+		key[i].ts_ns = snap[i].ts_ns;
+		key[i].idx = i;
+	}
+	qsort(key, n, sizeof(*key), cmp_key);
+
+	all = xmalloc(max * sizeof(*all));
+	for (i = 0; i < n; i++)
+		all[i] = snap[key[i].idx];
+	free(key);
+	free(snap);
+	*count = n;
+
+	return all;
+}
+
+void trace_print_event(struct trace *t, struct trace_event *e, FILE *f)
+{
+	fprintf(f, t->types[e->type].fmt, e->thrid, e->arg[0], e->arg[1]);
+	fputc('\n', f);
+}
+
+void trace_dump_text(struct trace *t, FILE *f)
+{
+	struct trace_event *ev;
+	unsigned long n, i;
+
+	ev = collect(t, &n);
+	for (i = 0; i < n; i++) {
+		fprintf(f, "[%lu.%09lu] ", ev[i].ts_ns / 1000000000,
+			ev[i].ts_ns % 1000000000);
+		trace_print_event(t, &ev[i], f);
+	}
+	free(ev);
+}
+
+void trace_dump_json(struct trace *t, FILE *f)
+{
+	const struct trace_type *type;
+	struct trace_event *ev;
+	unsigned long n, i;
+
+	ev = collect(t, &n);
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		type = &t->types[ev[i].type];
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,"
+			"\"pid\":1,\"tid\":%d", type->name, type->phase,
+			ev[i].ts_ns / 1000, ev[i].ts_ns % 1000, ev[i].thrid);
+		if (type->phase == 'i')
+			fprintf(f, ",\"s\":\"t\"");
+		if (type->arg_name[0])
+			fprintf(f, ",\"args\":{\"%s\":%d,\"%s\":%d}",
+				type->arg_name[0], ev[i].arg[0],
+				type->arg_name[1] ? type->arg_name[1] : "arg1",
+				ev[i].arg[1]);
+		fprintf(f, "}%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+	free(ev);
+}
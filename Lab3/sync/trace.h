@@ -0,0 +1,73 @@
+/*
+ * trace.h
+ *
+ * Event tracing for multithreaded programs, cheap enough to leave on.
+ *
+ * Each thread records fixed-size events in a ring of its own, with no
+ * locks, system calls or shared cache lines; when the ring is full the
+ * oldest events are overwritten, so it keeps the most recent history.
+ * The dump functions take a snapshot of all rings, which they may do
+ * while the threads keep recording, merge the events by time and write
+ * them out as text, or as JSON for chrome://tracing and Perfetto.
+ */
+
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include <stdio.h>
+
+/*
+ * What an event type means. fmt is the text line, given the thread id
+ * and the two arguments. phase is that of the Chrome trace format: 'B'
+ * and 'E' begin and end a span called name, 'i' is an instant and 'C' a
+ * counter, whose values are the arguments, called arg_name[0] and [1].
+ */
+struct trace_type {
+	const char *name;
+	char phase;
+	const char *fmt;
+	const char *arg_name[2];
+};
+
+struct trace_event {
+	unsigned long ts_ns;
+	int type;
+	int thrid;
+	int arg[2];
+};
+
+struct trace_ring {
+	unsigned long head;             /* events ever recorded */
+	unsigned long mask;
+	struct trace_event *ev;
+} __attribute__((aligned(64)));
+
+struct trace {
+	int nrings;
+	struct trace_ring *ring;
+	const struct trace_type *types;
+};
+
+/* events_per_ring is rounded up to a power of two */
+struct trace *trace_create(int nrings, unsigned long events_per_ring,
+	const struct trace_type *types);
+
+/* Only the thread that owns r may record in it */
+static inline void trace_record(struct trace_ring *r, unsigned long ts_ns,
+	int type, int thrid, int a, int b)
+{
+	struct trace_event *e = &r->ev[r->head & r->mask];
+
+	e->ts_ns = ts_ns;
+	e->type = type;
+	e->thrid = thrid;
+	e->arg[0] = a;
+	e->arg[1] = b;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_print_event(struct trace *t, struct trace_event *e, FILE *f);
+void trace_dump_text(struct trace *t, FILE *f);
+void trace_dump_json(struct trace *t, FILE *f);
+
+#endif /* TRACE_H__ */
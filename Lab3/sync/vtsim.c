@@ -0,0 +1,216 @@
+/*
+ * vtsim.c
+ *
+ * The run queue is a binary heap of the threads that are due to run,
+ * ordered by wake-up time and then by a random key drawn when they were
+ * queued. The scheduler loop runs on the caller's stack and switches
+ * to each thread in turn; a thread switches back when it sleeps,
+ * blocks or returns.
+ *
+ * A thread is started on its own stack with makecontext() and
+ * swapcontext(), but every later switch is a _setjmp()/_longjmp() pair:
+ * these do not save and restore the signal mask, which is a system call.
+ *
+ * That jumps from one thread's stack to another's, which the checking
+ * longjmp() of _FORTIFY_SOURCE takes for a corrupt stack and aborts on.
+ * Some compilers turn it on by default at -O2, so it is turned off here.
+ */
+
+/* Before any system header, which would pick it up */
+#undef _FORTIFY_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <ucontext.h>
+
+#include "vtsim.h"
+
+#define VTSIM_STACK_SIZE (64 * 1024)
+
+struct vtsim_thread {
+	ucontext_t ctx;                 /* only to start it */
+	jmp_buf jmp;
+	int started;
+	void (*fn)(void *);
+	void *arg;
+
+	unsigned long wake;             /* virtual time to run at */
+	unsigned int key;               /* tie breaker, from the seed */
+	struct vtsim_thread *next;      /* in a wait queue */
+	int done;
+};
+
+static struct vtsim_thread **heap;
+static int heap_len, heap_size;
+static int nthreads, ndone;
+
+static struct vtsim_thread *current;
+static ucontext_t sched_ctx;
+static jmp_buf sched_jmp;
+static unsigned long now;
+static unsigned int seed;
+static int stopped;
+
+static void *xmalloc(size_t size)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		fprintf(stderr, "vtsim: out of memory, failed to allocate "
+			"%zd bytes\n", size);
+		exit(1);
+	}
+
+	return p;
+}
+
+static int earlier(struct vtsim_thread *a, struct vtsim_thread *b)
+{
+	return a->wake < b->wake || (a->wake == b->wake && a->key < b->key);
+}
+
+static void heap_push(struct vtsim_thread *t, unsigned long wake)
+{
+	int i, parent;
+
+	t->wake = wake;
+	t->key = rand_r(&seed);
+	if (heap_len == heap_size) {
+		heap_size = heap_size ? 2 * heap_size : 64;
+		heap = realloc(heap, heap_size * sizeof(*heap));
+		if (heap == NULL) {
+			fprintf(stderr, "vtsim: out of memory\n");
+			exit(1);
+		}
+	}
+
+	for (i = heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!earlier(t, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = t;
+}
+
+static struct vtsim_thread *heap_pop(void)
+{
+	struct vtsim_thread *top = heap[0], *last = heap[--heap_len];
+	int i, child;
+
+	for (i = 0; (child = 2 * i + 1) < heap_len; i = child) {
+		if (child + 1 < heap_len && earlier(heap[child + 1], heap[child]))
+			child++;
+		if (!earlier(heap[child], last))
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+
+	return top;
+}
+
+void vtsim_init(unsigned int s)
+{
+	seed = s;
+	now = 0;
+	stopped = 0;
+}
+
+static void trampoline(void)
+{
+	current->fn(current->arg);
+	current->done = 1;
+	ndone++;
+	_longjmp(sched_jmp, 1);
+}
+
+/* Back to the scheduler, until it picks us again */
+static void switch_out(struct vtsim_thread *self)
+{
+	if (_setjmp(self->jmp) == 0)
+		_longjmp(sched_jmp, 1);
+}
+
+void vtsim_spawn(void (*fn)(void *), void *arg)
+{
+	struct vtsim_thread *t = xmalloc(sizeof(*t));
+
+	t->fn = fn;
+	t->arg = arg;
+	t->next = NULL;
+	t->done = 0;
+	t->started = 0;
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = xmalloc(VTSIM_STACK_SIZE);
+	t->ctx.uc_stack.ss_size = VTSIM_STACK_SIZE;
+	t->ctx.uc_link = NULL;
+	makecontext(&t->ctx, trampoline, 0);
+
+	nthreads++;
+	heap_push(t, now);
+}
+
+int vtsim_run(void)
+{
+	while (!stopped && heap_len > 0) {
+		current = heap_pop();
+		now = current->wake;
+		if (_setjmp(sched_jmp) != 0)
+			continue;
+		if (current->started)
+			_longjmp(current->jmp, 1);
+		current->started = 1;
+		swapcontext(&sched_ctx, &current->ctx);
+	}
+	current = NULL;
+
+	/* Whoever is neither queued nor done is blocked */
+	return stopped ? 0 : nthreads - ndone - heap_len;
+}
+
+void vtsim_stop(void)
+{
+	stopped = 1;
+}
+
+unsigned long vtsim_now(void)
+{
+	return now;
+}
+
+void vtsim_sleep(unsigned long us)
+{
+	struct vtsim_thread *self = current;
+
+	heap_push(self, now + us);
+	switch_out(self);
+}
+
+void vtsim_block(struct vtsim_waitq *q)
+{
+	struct vtsim_thread *self = current;
+
+	self->next = NULL;
+	if (q->tail)
+		q->tail->next = self;
+	else
+		q->head = self;
+	q->tail = self;
+	switch_out(self);
+}
+
+int vtsim_wake_one(struct vtsim_waitq *q)
+{
+	struct vtsim_thread *t = q->head;
+
+	if (t == NULL)
+		return 0;
+	q->head = t->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	heap_push(t, now);
+
+	return 1;
+}
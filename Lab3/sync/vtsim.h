@@ -0,0 +1,46 @@
+/*
+ * vtsim.h
+ *
+ * A discrete-event simulator for multithreaded code: simulated threads
+ * are coroutines on a single OS thread, and time is virtual. A thread
+ * runs until it sleeps or blocks, and then the thread with the earliest
+ * wake-up time runs next; threads due at the same virtual time run in
+ * an order drawn from the seed. So a run is a reproducible function of
+ * the seed, and sleeping costs nothing but a context switch.
+ *
+ * Code under test must not hold a lock across vtsim_sleep() or
+ * vtsim_block(), since the next thread runs on the same OS thread; a
+ * pthread mutex taken and released between them is fine, and never
+ * contended.
+ */
+
+#ifndef VTSIM_H__
+#define VTSIM_H__
+
+struct vtsim_thread;
+
+/* Threads blocked until vtsim_wake_one(), in FIFO order */
+struct vtsim_waitq {
+	struct vtsim_thread *head;
+	struct vtsim_thread *tail;
+};
+
+void vtsim_init(unsigned int seed);
+void vtsim_spawn(void (*fn)(void *), void *arg);
+
+/*
+ * Run the threads until all of them have returned or blocked, or
+ * vtsim_stop() was called. Returns the number of threads left blocked.
+ */
+int vtsim_run(void);
+void vtsim_stop(void);
+
+/* Virtual time, in microseconds */
+unsigned long vtsim_now(void);
+
+void vtsim_sleep(unsigned long us);
+void vtsim_block(struct vtsim_waitq *q);
+/* The thread woken up runs at the current virtual time. 0 if none */
+int vtsim_wake_one(struct vtsim_waitq *q);
+
+#endif /* VTSIM_H__ */
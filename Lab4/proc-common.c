@@ -4,7 +4,14 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
@@ -35,6 +42,212 @@ void compute(int count)
 	}
 }
 
+/******************************************************************************
+ * Calibrated work
+ */
+
+#define COMPUTE_CACHE_BYTES  (128 << 10)
+#define COMPUTE_MEMORY_BYTES (64 << 20)
+
+/* Each calibration run lasts at least this long; the best of 3 is kept */
+#define CALIBRATE_NSEC 2000000
+
+/* Give up waiting for the CPU clock to settle after this long */
+#define WARM_UP_MAX_NSEC 200000000
+
+struct work_kernel {
+	double iters_per_ns;
+	size_t *ring;        /* pointer-chasing kernels: a single cycle */
+	size_t len;
+};
+
+static struct work_kernel kernels[COMPUTE_NR_KINDS];
+static double tsc_per_ns;
+static int warmed_up;
+static volatile size_t chase_sink;
+
+static long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long
+read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+static void
+run_kernel(enum compute_kind kind, long iters)
+{
+	struct work_kernel *k = &kernels[kind];
+	volatile long junk = 0;
+	size_t i = 0;
+
+	if (kind == COMPUTE_ALU) {
+		while (iters-- > 0)
+			junk++;
+		return;
+	}
+
+	while (iters-- > 0)
+		i = k->ring[i];
+	chase_sink = i;
+}
+
+/*
+ * A random cyclic permutation (Sattolo's algorithm), so that the
+ * prefetchers cannot guess the next element. The seed is fixed:
+ * every run walks the same cycle.
+ */
+static void
+build_ring(struct work_kernel *k, size_t bytes)
+{
+	unsigned long seed = 88172645463325252UL;
+	size_t i, j, tmp;
+
+	k->len = bytes / sizeof(size_t);
+	k->ring = malloc(bytes);
+	if (k->ring == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		exit(1);
+	}
+	for (i = 0; i < k->len; i++)
+		k->ring[i] = i;
+	for (i = k->len - 1; i > 0; i--) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % i;
+		tmp = k->ring[i];
+		k->ring[i] = k->ring[j];
+		k->ring[j] = tmp;
+	}
+}
+
+/*
+ * A CPU that has been idle runs slowly for a few milliseconds (the
+ * frequency ramps up; a virtual CPU may have to be scheduled in). Spin
+ * until two consecutive runs agree within 5%, before timing anything.
+ */
+static void
+warm_up(void)
+{
+	long iters = 1000000, t, start;
+	double rate, prev = 0;
+
+	start = now_ns();
+	do {
+		t = now_ns();
+		run_kernel(COMPUTE_ALU, iters);
+		t = now_ns() - t;
+		rate = (double)iters / t;
+		if (prev > 0 && rate < prev * 1.05 && rate > prev * 0.95)
+			break;
+		prev = rate;
+	} while (now_ns() - start < WARM_UP_MAX_NSEC);
+	warmed_up = 1;
+}
+
+static void
+calibrate(enum compute_kind kind)
+{
+	struct work_kernel *k = &kernels[kind];
+	long iters = 1024, t;
+	double rate, best = 0;
+	int runs = 0;
+
+	if (!warmed_up)
+		warm_up();
+	if (kind == COMPUTE_CACHE && k->ring == NULL)
+		build_ring(k, COMPUTE_CACHE_BYTES);
+	if (kind == COMPUTE_MEMORY && k->ring == NULL)
+		build_ring(k, COMPUTE_MEMORY_BYTES);
+
+	/* Double the run until it is long enough to time, then take 3 */
+	while (runs < 3) {
+		t = now_ns();
+		run_kernel(kind, iters);
+		t = now_ns() - t;
+		if (t < CALIBRATE_NSEC) {
+			iters *= 2;
+			continue;
+		}
+		rate = (double)iters / t;
+		if (rate > best)
+			best = rate;
+		runs++;
+	}
+	k->iters_per_ns = best;
+}
+
+static void
+calibrate_tsc(void)
+{
+	unsigned long c0;
+	long t0, t;
+
+	if (!warmed_up)
+		warm_up();
+	c0 = read_tsc();
+	t0 = now_ns();
+	do
+		t = now_ns() - t0;
+	while (t < CALIBRATE_NSEC);
+	tsc_per_ns = (double)(read_tsc() - c0) / t;
+}
+
+void
+compute_calibrate(void)
+{
+	int kind;
+
+	for (kind = 0; kind < COMPUTE_NR_KINDS; kind++)
+		calibrate(kind);
+	calibrate_tsc();
+}
+
+double
+compute_iters_per_us(enum compute_kind kind)
+{
+	if (kernels[kind].iters_per_ns == 0)
+		calibrate(kind);
+
+	return kernels[kind].iters_per_ns * 1000;
+}
+
+void
+compute_work(enum compute_kind kind, long ns)
+{
+	if (kernels[kind].iters_per_ns == 0)
+		calibrate(kind);
+
+	run_kernel(kind, (long)(ns * kernels[kind].iters_per_ns));
+}
+
+void
+compute_ns(long ns)
+{
+	compute_work(COMPUTE_ALU, ns);
+}
+
+void
+compute_cycles(long cycles)
+{
+	if (tsc_per_ns == 0)
+		calibrate_tsc();
+
+	compute_ns((long)(cycles / tsc_per_ns));
+}
+
 /*
  * Changes the process name, as appears in ps or pstree,
  * using a Linux-specific system call.
@@ -50,6 +263,251 @@ change_pname(const char *new_name)
 	}
 }
 
+/******************************************************************************
+ * Diagnostics log
+ *
+ * The ring is a bounded multi-producer queue: a producer claims a slot
+ * by advancing log_tail with a CAS, once the slot's sequence number says
+ * the previous record in it has been written out, and publishes it by
+ * setting the sequence to position + 1. A signal handler that interrupts
+ * a producer simply claims the next slot; the drain stops at the first
+ * unpublished record and picks it up on its next round.
+ */
+
+#define LOG_RING_SIZE   4096            /* records, a power of two */
+#define LOG_BATCH_BYTES 65536
+#define LOG_LINE_BYTES  512
+#define LOG_DRAIN_NSEC  20000000        /* drain at least this often */
+
+struct log_record {
+	unsigned seq;
+	int level;
+	long ts_ns;
+	const char *fmt;
+	long arg[4];
+};
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static unsigned log_head;               /* next record to write out */
+static unsigned log_tail;               /* next slot to claim */
+static unsigned long log_dropped;
+static int log_threshold = LOG_LEVEL_INFO;
+static int log_fd = STDERR_FILENO;
+static int log_started;
+static int log_wakeup;                  /* futex word of the drain thread */
+static int log_wakeup_pending;          /* a producer has woken it already */
+static char log_batch[LOG_BATCH_BYTES];
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+log_write_all(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(log_fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static size_t
+log_format(struct log_record *r, char *line)
+{
+	int n = 0, m;
+
+	if (log_threshold == LOG_LEVEL_DEBUG)
+		n = snprintf(line, LOG_LINE_BYTES, "[%ld.%06ld] ",
+			r->ts_ns / 1000000000, r->ts_ns % 1000000000 / 1000);
+	m = snprintf(line + n, LOG_LINE_BYTES - n, r->fmt,
+		r->arg[0], r->arg[1], r->arg[2], r->arg[3]);
+	if (m < 0)
+		m = 0;
+	n += m;
+
+	return n < LOG_LINE_BYTES ? n : LOG_LINE_BYTES - 1;
+}
+
+void
+log_flush(void)
+{
+	char line[LOG_LINE_BYTES];
+	struct log_record *r;
+	unsigned long dropped;
+	size_t len = 0, n;
+	unsigned pos;
+
+	pthread_mutex_lock(&log_drain_lock);
+	for (pos = log_head; ; pos++) {
+		r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		n = log_format(r, line);
+		__atomic_store_n(&r->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		if (len + n > LOG_BATCH_BYTES) {
+			log_write_all(log_batch, len);
+			len = 0;
+		}
+		memcpy(log_batch + len, line, n);
+		len += n;
+	}
+	__atomic_store_n(&log_head, pos, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0 && len + LOG_LINE_BYTES <= LOG_BATCH_BYTES)
+		len += snprintf(log_batch + len, LOG_LINE_BYTES,
+			"log: %lu records dropped, the ring was full\n", dropped);
+	log_write_all(log_batch, len);
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void *
+log_drain_thread(void *arg)
+{
+	struct timespec timeout = { 0, LOG_DRAIN_NSEC };
+	int w;
+
+	for (;;) {
+		__atomic_store_n(&log_wakeup_pending, 0, __ATOMIC_RELAXED);
+		w = __atomic_load_n(&log_wakeup, __ATOMIC_ACQUIRE);
+		log_flush();
+		syscall(SYS_futex, &log_wakeup, FUTEX_WAIT_PRIVATE, w, &timeout,
+			NULL, 0);
+	}
+
+	return NULL;
+}
+
+/* The thread blocks all signals, so that handlers run in our threads */
+static void
+log_start_thread(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&thread, NULL, log_drain_thread, NULL) != 0) {
+		fprintf(stderr, "log_init: cannot start the drain thread, "
+			"logging synchronously\n");
+		log_started = 0;
+	} else
+		pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Nothing is left in the ring to be printed twice, by both processes */
+static void
+log_fork_prepare(void)
+{
+	log_flush();
+	pthread_mutex_lock(&log_drain_lock);
+}
+
+static void
+log_fork_parent(void)
+{
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void
+log_fork_child(void)
+{
+	pthread_mutex_unlock(&log_drain_lock);
+	log_wakeup_pending = 0;
+	if (log_started)
+		log_start_thread();
+}
+
+void
+log_init(enum log_level level, int fd)
+{
+	unsigned i;
+
+	log_threshold = level;
+	log_fd = fd;
+	if (log_started)
+		return;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+	atexit(log_flush);
+	log_started = 1;
+	log_start_thread();
+}
+
+void
+log_set_level(enum log_level level)
+{
+	log_threshold = level;
+}
+
+void
+log_event(enum log_level level, const char *fmt, long a, long b, long c,
+	long d)
+{
+	struct log_record *r;
+	struct timespec ts;
+	unsigned pos, seq;
+	int dif, saved_errno;
+
+	if (level < log_threshold)
+		return;
+	if (!log_started) {
+		fprintf(stderr, fmt, a, b, c, d);
+		fflush(stderr);
+		return;
+	}
+
+	pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		dif = (int)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r->level = level;
+	r->ts_ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+	r->fmt = fmt;
+	r->arg[0] = a;
+	r->arg[1] = b;
+	r->arg[2] = c;
+	r->arg[3] = d;
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * Do not wait for the next round if the ring is filling up. Any
+	 * producer past the mark may be the one to notice, since the one at
+	 * it exactly may have been dropped or interrupted; the flag keeps the
+	 * others off the futex until the drain thread runs again.
+	 */
+	if (pos - __atomic_load_n(&log_head, __ATOMIC_RELAXED) >=
+	    LOG_RING_SIZE / 2 &&
+	    !__atomic_exchange_n(&log_wakeup_pending, 1, __ATOMIC_RELAXED)) {
+		saved_errno = errno;
+		__atomic_add_fetch(&log_wakeup, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &log_wakeup, FUTEX_WAKE_PRIVATE, 1, NULL,
+			NULL, 0);
+		errno = saved_errno;
+	}
+}
+
 /*
  * This function receives an integer status value,
  * as returned by wait()/waitpid() and explains what
@@ -61,29 +519,28 @@ change_pname(const char *new_name)
  *    * stopped because it did not handle one of SIGTSTP, SIGSTOP, SIGTTIN, SIGTTOU
  *      (WIFSTOPPED)
  *
- * For every case, a relevant diagnostic is output to standard error.
+ * For every case, a relevant diagnostic is logged; it is safe to call
+ * from a SIGCHLD handler once log_init() has been called.
  */
 void
 explain_wait_status(pid_t pid, int status)
 {
 	if (WIFEXITED(status))
-		fprintf(stderr, "My PID = %ld: Child PID = %ld terminated normally, exit status = %d\n",
-			(long)getpid(), (long)pid, WEXITSTATUS(status));
+		log_event(LOG_LEVEL_INFO, "My PID = %ld: Child PID = %ld terminated normally, exit status = %ld\n",
+			(long)getpid(), (long)pid, WEXITSTATUS(status), 0);
 	else if (WIFSIGNALED(status))
-		fprintf(stderr, "My PID = %ld: Child PID = %ld was terminated by a signal, signo = %d\n",
-			(long)getpid(), (long)pid, WTERMSIG(status));
+		log_event(LOG_LEVEL_WARN, "My PID = %ld: Child PID = %ld was terminated by a signal, signo = %ld\n",
+			(long)getpid(), (long)pid, WTERMSIG(status), 0);
 	else if (WIFSTOPPED(status))
-		fprintf(stderr, "My PID = %ld: Child PID = %ld has been stopped by a signal, signo = %d\n",
-			(long)getpid(), (long)pid, WSTOPSIG(status));
+		log_event(LOG_LEVEL_INFO, "My PID = %ld: Child PID = %ld has been stopped by a signal, signo = %ld\n",
+			(long)getpid(), (long)pid, WSTOPSIG(status), 0);
 	else {
-		fprintf(stderr, "%s: Internal error: Unhandled case, PID = %ld, status = %d\n",
-			__func__, (long)pid, status);
+		log_event(LOG_LEVEL_ERROR, "explain_wait_status: Internal error: Unhandled case, PID = %ld, status = %ld\n",
+			(long)pid, status, 0, 0);
 		exit(1);
 	}
-	fflush(stderr);
 }
 
-
 /*
  * Make sure all the children have raised SIGSTOP,
  * by using waitpid() with the WUNTRACED flag.
@@ -109,23 +566,391 @@ wait_for_ready_children(int cnt)
 	}
 }
 
+/*
+ * Read /proc/<pid>/stat into a proc_node.
+ *
+ * The command name is in parentheses and may itself contain spaces
+ * and parentheses, so the fields after it are found from the last ')'.
+ * Returns 0 on success, -1 if the process has gone away.
+ */
+static int
+read_proc_stat(pid_t pid, struct proc_node *node)
+{
+	char path[64], buf[1024], *start, *end;
+	unsigned long utime, stime;
+	static long ticks;
+	ssize_t len;
+	int fd, ppid;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	start = strchr(buf, '(');
+	end = strrchr(buf, ')');
+	if (start == NULL || end == NULL || end < start)
+		return -1;
+
+	/* fields 3, 4, 14, 15 and 20 of proc(5):
+	 * state, ppid, utime, stime and num_threads */
+	if (sscanf(end + 2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+		   "%*d %*d %*d %*d %d", &node->state, &ppid, &utime, &stime,
+		   &node->nr_threads) != 5)
+		return -1;
+
+	n = end - start - 1;
+	if (n >= PROC_COMM_SIZE)
+		n = PROC_COMM_SIZE - 1;
+	memcpy(node->comm, start + 1, n);
+	node->comm[n] = '\0';
+
+	if (ticks == 0)
+		ticks = sysconf(_SC_CLK_TCK);
+	node->pid = pid;
+	node->ppid = ppid;
+	node->utime = (double)utime / ticks;
+	node->stime = (double)stime / ticks;
+	node->first_child = node->next_sibling = -1;
+
+	return 0;
+}
+
+/* Append a node to the snapshot, linking it under node parent */
+static void
+proc_tree_add(struct proc_tree *tree, int *size, struct proc_node *node,
+	int parent)
+{
+	struct proc_node *p;
+
+	if (tree->nr_nodes == *size) {
+		*size *= 2;
+		tree->nodes = realloc(tree->nodes, *size * sizeof(*tree->nodes));
+		if (tree->nodes == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			exit(1);
+		}
+	}
+	tree->nodes[tree->nr_nodes] = *node;
+
+	/*
+	 * All the children of a node are added one after the other,
+	 * so the previous node is either the parent or the previous sibling.
+	 */
+	if (parent >= 0) {
+		p = &tree->nodes[parent];
+		if (p->first_child < 0)
+			p->first_child = tree->nr_nodes;
+		else
+			tree->nodes[tree->nr_nodes - 1].next_sibling = tree->nr_nodes;
+	}
+	tree->nr_nodes++;
+}
+
+/*
+ * Add the children of thread tid of node i, as listed in
+ * /proc/<pid>/task/<tid>/children. *buf grows to fit the whole list.
+ * Returns -1 if the file cannot be opened.
+ */
+static int
+add_task_children(struct proc_tree *tree, int *size, int i, const char *tid,
+	char **buf, size_t *buf_size)
+{
+	char path[320], *p, *endp;
+	struct proc_node node;
+	ssize_t len = 0, n;
+	long pid;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%ld/task/%s/children",
+		(long)tree->nodes[i].pid, tid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* one PID per child, the list may be long */
+	for (;;) {
+		if (len + 1 == *buf_size) {
+			*buf_size *= 2;
+			*buf = realloc(*buf, *buf_size);
+			if (*buf == NULL) {
+				fprintf(stderr, "%s: out of memory\n", __func__);
+				exit(1);
+			}
+		}
+		n = read(fd, *buf + len, *buf_size - len - 1);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	(*buf)[len] = '\0';
+
+	for (p = *buf;; p = endp) {
+		pid = strtol(p, &endp, 10);
+		if (endp == p)
+			break;
+		if (read_proc_stat(pid, &node) == 0)
+			proc_tree_add(tree, size, &node, i);
+	}
+
+	return 0;
+}
+
+/*
+ * Find the children of every node using /proc/<pid>/task/<tid>/children.
+ * Single-threaded processes, the common case, need no directory listing.
+ * Returns -1 if the kernel does not provide these files.
+ */
+static int
+snapshot_from_children(struct proc_tree *tree, int *size)
+{
+	char path[64], *buf;
+	size_t buf_size = 4096;
+	struct dirent *de;
+	DIR *dir;
+	int i, ret = 0;
+
+	buf = malloc(buf_size);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		exit(1);
+	}
+
+	for (i = 0; i < tree->nr_nodes; i++) {
+		if (tree->nodes[i].nr_threads == 1) {
+			snprintf(path, sizeof(path), "%ld", (long)tree->nodes[i].pid);
+			if (add_task_children(tree, size, i, path, &buf,
+					      &buf_size) < 0 &&
+			    errno == ENOENT && i == 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/proc/%ld/task",
+			(long)tree->nodes[i].pid);
+		dir = opendir(path);
+		if (dir == NULL)
+			continue;	/* went away meanwhile */
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (add_task_children(tree, size, i, de->d_name, &buf,
+					      &buf_size) < 0 &&
+			    errno == ENOENT && i == 0) {
+				ret = -1;
+				break;
+			}
+		}
+		closedir(dir);
+		if (ret < 0)
+			break;
+	}
+
+	free(buf);
+	return ret;
+}
+
+static int
+cmp_ppid(const void *a, const void *b)
+{
+	const struct proc_node *x = a, *y = b;
+
+	return (x->ppid > y->ppid) - (x->ppid < y->ppid);
+}
+
+/*
+ * Fallback: read the stat file of every process once, sort them by
+ * parent and pick the descendants with a binary search per node.
+ */
+static void
+snapshot_from_scan(struct proc_tree *tree, int *size)
+{
+	struct proc_node *all, key;
+	int nr_all = 0, size_all = 1024, i, lo, hi, mid;
+	struct dirent *de;
+	DIR *dir;
+	char *endp;
+	long pid;
+
+	all = malloc(size_all * sizeof(*all));
+	dir = opendir("/proc");
+	if (all == NULL || dir == NULL) {
+		perror("show_pstree: scanning /proc");
+		exit(104);
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		pid = strtol(de->d_name, &endp, 10);
+		if (*endp != '\0' || endp == de->d_name)
+			continue;
+		if (nr_all == size_all) {
+			size_all *= 2;
+			all = realloc(all, size_all * sizeof(*all));
+			if (all == NULL) {
+				fprintf(stderr, "%s: out of memory\n", __func__);
+				exit(1);
+			}
+		}
+		if (read_proc_stat(pid, &all[nr_all]) == 0)
+			nr_all++;
+	}
+	closedir(dir);
+
+	qsort(all, nr_all, sizeof(*all), cmp_ppid);
+
+	for (i = 0; i < tree->nr_nodes; i++) {
+		/* first entry whose parent is nodes[i] */
+		key.ppid = tree->nodes[i].pid;
+		lo = 0;
+		hi = nr_all;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (cmp_ppid(&all[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < nr_all && all[lo].ppid == key.ppid; lo++)
+			proc_tree_add(tree, size, &all[lo], i);
+	}
+
+	free(all);
+}
+
+/*
+ * Take a snapshot of the process tree rooted at process with PID p,
+ * without forking: nodes are visited breadth first, reading their
+ * children lists and stat files straight from /proc.
+ */
+struct proc_tree *
+proc_tree_snapshot(pid_t p)
+{
+	struct proc_tree *tree;
+	struct proc_node root;
+	int size = 64;
+
+	if (read_proc_stat(p, &root) < 0)
+		return NULL;
+
+	tree = malloc(sizeof(*tree));
+	if (tree == NULL || (tree->nodes = malloc(size * sizeof(root))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		exit(1);
+	}
+	tree->nr_nodes = 0;
+	proc_tree_add(tree, &size, &root, -1);
+
+	if (snapshot_from_children(tree, &size) < 0)
+		snapshot_from_scan(tree, &size);
+
+	return tree;
+}
+
+void
+proc_tree_free(struct proc_tree *tree)
+{
+	free(tree->nodes);
+	free(tree);
+}
+
+static void
+print_text_node(FILE *fp, struct proc_tree *tree, int i, char *prefix,
+	size_t len)
+{
+	struct proc_node *node = &tree->nodes[i];
+	int c;
+
+	fprintf(fp, "%s(%ld) %c %.2fu %.2fs\n", node->comm, (long)node->pid,
+		node->state, node->utime, node->stime);
+
+	for (c = node->first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+		int last = tree->nodes[c].next_sibling < 0;
+
+		fprintf(fp, "%.*s%s", (int)len, prefix, last ? "`-" : "|-");
+		/* deep trees are still printed, just less indented */
+		if (len + 2 < 1024) {
+			memcpy(prefix + len, last ? "  " : "| ", 2);
+			print_text_node(fp, tree, c, prefix, len + 2);
+		} else
+			print_text_node(fp, tree, c, prefix, len);
+	}
+}
+
+void
+print_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+print_json_node(FILE *fp, struct proc_tree *tree, int i)
+{
+	struct proc_node *node = &tree->nodes[i];
+	int c;
+
+	fprintf(fp, "{\"pid\": %ld, \"ppid\": %ld, \"name\": ",
+		(long)node->pid, (long)node->ppid);
+	print_json_string(fp, node->comm);
+	fprintf(fp, ", \"state\": \"%c\", \"utime\": %.2f, \"stime\": %.2f, "
+		"\"children\": [", node->state, node->utime, node->stime);
+	for (c = node->first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+		print_json_node(fp, tree, c);
+		if (tree->nodes[c].next_sibling >= 0)
+			fprintf(fp, ", ");
+	}
+	fprintf(fp, "]}");
+}
+
+void
+proc_tree_print(FILE *fp, struct proc_tree *tree, int json)
+{
+	char prefix[1024];
+
+	if (json) {
+		print_json_node(fp, tree, 0);
+		fputc('\n', fp);
+	} else
+		print_text_node(fp, tree, 0, prefix, 0);
+}
+
 /*
  * Print the process tree rooted at process with PID p.
  */
 void
 show_pstree(pid_t p)
 {
-	int ret;
-	char cmd[1024];
-
-	snprintf(cmd, sizeof(cmd), "echo; echo; pstree -G -c -p %ld; echo; echo",
-		(long)p);
-	cmd[sizeof(cmd)-1] = '\0';
-	ret = system(cmd);
-	if (ret < 0) {
-		perror("system");
-		exit(104);
+	struct proc_tree *tree;
+
+	tree = proc_tree_snapshot(p);
+	if (tree == NULL) {
+		fprintf(stderr, "show_pstree: no process with PID %ld\n", (long)p);
+		return;
 	}
+
+	printf("\n\n");
+	proc_tree_print(stdout, tree, 0);
+	printf("\n\n");
+	fflush(stdout);
+
+	proc_tree_free(tree);
 }
 
 
@@ -1,6 +1,9 @@
 #ifndef PROC_COMMON_H
 #define PROC_COMMON_H
 
+#include <stdio.h>
+#include <sys/types.h>
+
 /******************************************************************************
  * Helper Functions
  */
@@ -8,6 +11,40 @@
 /* does useless computation */
 void compute(int count);
 
+/*
+ * Calibrated work, with a cost given in time instead of loop counts.
+ *
+ * The rate of each kind of work, in iterations per microsecond, is
+ * measured once per process: on first use, or up front with
+ * compute_calibrate(). Calibrate before fork() and the children inherit
+ * the rates, so they all do the same amount of work for the same request.
+ * The work is a fixed number of iterations, so it takes longer when the
+ * process is preempted, as real work would.
+ *
+ *   COMPUTE_ALU     increment a counter, like compute()
+ *   COMPUTE_CACHE   chase pointers around a buffer that fits in L2
+ *   COMPUTE_MEMORY  chase pointers around a buffer much larger than
+ *                   the caches, so that every step is a cache miss
+ */
+enum compute_kind {
+	COMPUTE_ALU,
+	COMPUTE_CACHE,
+	COMPUTE_MEMORY,
+	COMPUTE_NR_KINDS
+};
+
+void compute_calibrate(void);
+double compute_iters_per_us(enum compute_kind kind);
+
+/* About ns nanoseconds of work of the given kind. */
+void compute_work(enum compute_kind kind, long ns);
+
+/* About ns nanoseconds of ALU work. */
+void compute_ns(long ns);
+
+/* ALU work for about this many TSC cycles (on x86, nanoseconds elsewhere). */
+void compute_cycles(long cycles);
+
 /* Does nothing and never returns. */
 void wait_forever(void);
 
@@ -31,6 +68,76 @@ void change_pname(const char *new_name);
 /* Print the process tree rooted at process with PID p. */
 void show_pstree(pid_t p);
 
+/******************************************************************************
+ * Process tree snapshots, read directly from /proc
+ */
+
+#define PROC_COMM_SIZE 16
+
+struct proc_node {
+	pid_t pid;
+	pid_t ppid;
+	char state;                  /* R, S, D, T, Z, ... */
+	char comm[PROC_COMM_SIZE];
+	double utime;                /* CPU time in user mode, in seconds */
+	double stime;                /* CPU time in kernel mode, in seconds */
+	int nr_threads;
+	int first_child;             /* index in ->nodes, or -1 */
+	int next_sibling;            /* index in ->nodes, or -1 */
+};
+
+/* nodes[0] is the root, children always come after their parent */
+struct proc_tree {
+	struct proc_node *nodes;
+	int nr_nodes;
+};
+
+/*
+ * Take a snapshot of the process with PID p and all its descendants.
+ * Returns NULL if p does not exist.
+ */
+struct proc_tree *proc_tree_snapshot(pid_t p);
+
+/* Print a snapshot as an indented tree, or as nested JSON objects. */
+void proc_tree_print(FILE *fp, struct proc_tree *tree, int json);
+
+/* Print s as a JSON string, quoted and escaped. */
+void print_json_string(FILE *fp, const char *s);
+
+void proc_tree_free(struct proc_tree *tree);
+
+/******************************************************************************
+ * Diagnostics log
+ *
+ * log_event() stores a fixed-size record (level, time, format string and
+ * four long arguments) in a lock-free ring buffer and returns: it takes
+ * no locks and calls nothing but clock_gettime() and, when the ring is
+ * half full, futex(), so it is safe to call from signal handlers. A
+ * thread started by log_init() formats the records and writes them out
+ * in large batches, every few milliseconds. If the ring is full, records
+ * are dropped and counted rather than waited for.
+ *
+ * The format must be a string literal, and all its conversions must
+ * take a long (%ld, %lx, ...): it is only applied later, by the thread.
+ * Until log_init() is called, log_event() prints to stderr right away.
+ * The log is flushed at exit() and before fork(); the child of a fork()
+ * gets a drain thread of its own.
+ */
+enum log_level {
+	LOG_LEVEL_DEBUG,         /* also prefixes every line with its time */
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR
+};
+
+void log_init(enum log_level level, int fd);
+void log_set_level(enum log_level level);
+void log_event(enum log_level level, const char *fmt,
+	long a, long b, long c, long d);
+
+/* Write out everything logged so far, from the calling thread. */
+void log_flush(void);
+
 /*
  * Create a shared memory area, usable by all descendants of the calling process.
  */
@@ -524,6 +524,9 @@ int main(int argc, char *argv[]) {
   // DEBUG:
   show_pstree(getpid());
 
+  /* The SIGCHLD handler logs through the ring, not stdio. */
+  log_init(LOG_LEVEL_INFO, STDERR_FILENO);
+
   /* Install SIGALRM and SIGCHLD handlers. */
   install_signal_handlers();
 
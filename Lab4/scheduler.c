@@ -197,6 +197,9 @@ int main(int argc, char *argv[]) {
   /* Wait for all children to raise SIGSTOP before exec()ing. */
   wait_for_ready_children(nproc - 1);
 
+  /* The SIGCHLD handler logs through the ring, not stdio. */
+  log_init(LOG_LEVEL_INFO, STDERR_FILENO);
+
   /* Install SIGALRM and SIGCHLD handlers. */
   install_signal_handlers();
 